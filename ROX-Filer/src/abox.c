@@ -687,3 +687,11 @@ void    abox_set_percentage(ABox *abox, int per)
 				      per/100.);
 }
 
+/* Show 'text' (eg, the time remaining) on the progress bar */
+void	abox_set_progress_text(ABox *abox, const gchar *text)
+{
+	if (!abox->progress)
+		abox_set_percentage(abox, 0);
+
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(abox->progress), text);
+}
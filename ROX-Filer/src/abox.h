@@ -84,5 +84,7 @@ void	abox_show_compare		(ABox *abox, gboolean show);
 void	abox_set_file			(ABox *abox, int file,
 					 const gchar *path);
 void    abox_set_percentage             (ABox *abox, int per);
+void	abox_set_progress_text		(ABox *abox,
+					 const gchar *text);
 
 #endif /* __ABOX_H__ */
@@ -31,6 +31,7 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <utime.h>
+#include <fcntl.h>
 #include <stdarg.h>
 
 #include "global.h"
@@ -52,6 +53,8 @@
 #include "type.h"
 #include "xtypes.h"
 #include "log.h"
+#include "usage.h"
+#include "nameindex.h"
 
 #if defined(HAVE_GETXATTR)
 # define ATTR_MAN_PAGE N_("See the attr(5) man page for full details.")
@@ -74,6 +77,24 @@ typedef struct _GUIside GUIside;
 typedef void ActionChild(gpointer data);
 typedef void ForDirCB(const char *path, const char *dest_path);
 
+/* The directory for_dir_contents() is walking. Callbacks use the walk_*()
+ * functions on the paths they're given, which work relative to this
+ * rather than looking up the whole path again.
+ */
+static int	walk_fd = -1;
+static const char *walk_dir = NULL;
+static size_t	walk_dir_len = 0;
+
+/* Names read from a directory at a time, before processing them */
+#define WALK_BATCH 1024
+
+/* Directories deeper than this aren't kept open while walking them; all
+ * the names are read first and the directory closed, so that deep trees
+ * don't run out of file descriptors.
+ */
+#define WALK_MAX_OPEN 32
+static int	walk_depth = 0;
+
 struct _GUIside
 {
 	ABox		*abox;		/* The action window widget */
@@ -101,12 +122,114 @@ static int 	from_parent = 0;
 static FILE	*to_parent = NULL;
 static gboolean	quiet = FALSE;
 static GString  *message = NULL;
+
+/* Messages to the filer are buffered, and sent when the buffer fills, when
+ * we need a reply, or every SEND_FLUSH_TIME seconds. Paths to check are
+ * collected in pending_checks and sent as one message per directory.
+ */
+#define SEND_FLUSH_TIME 0.2
+static GTimer	*send_timer = NULL;
+static GHashTable *pending_checks = NULL;	/* Set of paths */
+
+/* Most messages to process from a child in one go */
+#define MAX_MESSAGES_AT_ONCE 100
+
 static const char *action_dest = NULL;
 static const char *action_leaf = NULL;
 static void (*action_do_func)(const char *source, const char *dest);
-static double	size_tally;		/* For Disk Usage */
-static unsigned long dir_counter;	/* For Disk Usage */
-static unsigned long file_counter;	/* For Disk Usage */
+
+/* For Disk Usage. Directories are counted by usage_scan's threads, unless
+ * we need to ask about each one.
+ */
+static UsageScan *usage_scan = NULL;
+static UsageTotals usage_totals;	/* For the current item */
+static int	usage_per;		/* Percentage of the items done */
+
+/* For the progress bar of Copy, Move and Delete. A thread counts everything
+ * to be done while the operation itself runs and counts what it has done.
+ */
+typedef struct _Progress Progress;
+struct _Progress {
+	gint64	bytes;			/* In regular files */
+	gint64	entries;		/* Files, directories, etc */
+};
+
+G_LOCK_DEFINE_STATIC(progress);
+static GThreadPool *progress_scanner = NULL;
+static Progress	progress_total;		/* Found so far (locked) */
+static Progress	*progress_items = NULL;	/* Each item's total (locked) */
+static gboolean	progress_scanned;	/* Totals are complete (locked) */
+static Progress	progress_done;		/* (bytes locked) */
+static gboolean	progress_by_bytes;	/* Else count entries */
+static GTimer	*progress_timer = NULL;
+static gdouble	progress_last_sent;
+
+/* For Copy. do_copy2() walks the tree, making directories and links itself,
+ * but hands regular files to a pool of threads to copy. Results come back
+ * through copy_results and are reported by the walker.
+ */
+typedef struct _CopyDir CopyDir;
+typedef struct _CopyJob CopyJob;
+
+/* A directory we created. Its permissions and times are set once
+ * everything in it has been copied.
+ */
+struct _CopyDir {
+	gchar	*path;
+	mode_t	mode;
+	time_t	atime, mtime;
+	int	pending;	/* Walk, files and subdirectories unfinished */
+	CopyDir	*parent;	/* Waits for us, or NULL */
+};
+
+struct _CopyJob {
+	gchar	*src, *dest;
+	CopyDir	*dir;		/* Directory to update afterwards, or NULL */
+	guchar	*error;		/* Set by the worker thread */
+};
+
+/* Files queued or being copied, per thread, before the walker waits */
+#define COPY_QUEUE_PER_THREAD 16
+
+static GThreadPool *copy_pool = NULL;	/* NULL => copy files in-line */
+static GAsyncQueue *copy_results = NULL;
+static int	copy_in_flight = 0;
+static CopyDir	*copy_dir = NULL;	/* Where do_copy2() is copying to */
+
+/* When move_object() has to copy files between filesystems, this maps each
+ * file with several links ("dev ino") to its new path, so that the other
+ * links can be made again instead of copying the data twice.
+ */
+static GHashTable *moved_links = NULL;
+
+/* For Delete. When no questions need asking, the contents of a directory
+ * are deleted by a pool of threads, each taking a subdirectory at a time.
+ * Anything they can't delete is left for do_delete() to deal with.
+ */
+typedef struct _DeleteDir DeleteDir;
+
+struct _DeleteDir {
+	gchar	*path;
+	gint	pending;	/* Scan and subdirectories unfinished (atomic) */
+	DeleteDir *parent;	/* NULL for the directory do_delete() gave */
+};
+
+static GThreadPool *delete_pool = NULL;	/* NULL => delete in-line */
+static GAsyncQueue *delete_done = NULL;	/* Top DeleteDirs, when emptied */
+static gint	delete_count = 0;	/* Objects deleted by threads (atomic) */
+
+/* For Find. When no questions need asking, directories are searched by a
+ * pool of threads, each taking a directory at a time. Matches and errors
+ * come back through find_results as messages for the main thread to send.
+ */
+static GThreadPool *find_pool = NULL;	/* NULL => search in-line */
+static GAsyncQueue *find_results = NULL; /* GStrings, then FIND_DONE */
+static gint	find_pending = 0;	/* Directories unfinished (atomic) */
+static guint	find_needs = 0;		/* What find_condition looks at */
+#define FIND_DONE ((gpointer) &find_pending)
+
+/* Matches are sent together, up to about this many bytes at a time */
+#define FIND_BATCH_BYTES 4096
 
 static struct mode_change *mode_change = NULL;	/* For Permissions */
 static FindCondition *find_condition = NULL;	/* For Find */
@@ -123,6 +246,8 @@ static gboolean o_ignore = FALSE;
 static Option o_action_copy, o_action_move, o_action_link;
 static Option o_action_delete, o_action_mount;
 static Option o_action_force, o_action_brief, o_action_recurse;
+static Option o_action_prescan;
+Option o_action_threads;
 static Option o_action_merge, o_action_newer, o_action_ignore;
 
 static Option o_action_mount_command;
@@ -147,6 +272,10 @@ static void send_check_path(const gchar *path);
 static void send_mount_path(const gchar *path);
 static gboolean printf_send(const char *msg, ...);
 static gboolean send_msg(void);
+static gboolean write_msg(const gchar *data, gsize len);
+static void flush_messages(void);
+static void group_check(gpointer key, gpointer value, gpointer data);
+static void send_checks(gpointer key, gpointer value, gpointer data);
 static gboolean send_error(void);
 static gboolean send_dir(const char *dir);
 static gboolean read_exact(int source, char *buffer, ssize_t len);
@@ -154,6 +283,45 @@ static void do_mount(const guchar *path, gboolean mount);
 static gboolean printf_reply(int fd, gboolean ignore_quiet,
 			     const char *msg, ...);
 static gboolean remove_pinned_ok(GList *paths);
+static const char *walk_leaf(const char *path);
+static int walk_lstat(const char *path, struct stat *info);
+static int walk_unlink(const char *path);
+static int walk_rmdir(const char *path);
+static int walk_chmod(const char *path, mode_t mode);
+static int walk_access(const char *path, int mode);
+static int walk_open_dir(const char *path);
+static guchar *move_object(const char *path, const char *dest_path);
+static guchar *copy_tree(const char *from, const char *to);
+static guchar *remove_tree(const char *path);
+static void progress_start(GList *paths, gboolean by_bytes);
+static void progress_scan(gpointer data, gpointer user_data);
+static void progress_scan_tree(int dir_fd, const char *name,
+			       Progress *item);
+static void progress_add(gint64 bytes, gint64 entries);
+static void progress_copied(off_t bytes);
+static void progress_item_done(int i);
+static void progress_send(gboolean force);
+static void progress_copied_in_thread(off_t bytes);
+static void copy_start(void);
+static void copy_thread(gpointer data, gpointer user_data);
+static void copy_queue(const char *path, const char *dest_path);
+static gboolean copy_collect(gboolean wait);
+static void copy_flush(void);
+static CopyDir *copy_dir_new(const char *path, struct stat *info);
+static void copy_dir_unref(CopyDir *dir);
+static void delete_start(void);
+static void delete_thread(gpointer data, gpointer user_data);
+static void delete_dir_unref(DeleteDir *dir);
+static void delete_contents(const char *path);
+static void usage_tree(const char *path);
+static void find_start(void);
+static void find_thread(gpointer data, gpointer user_data);
+static void find_push(gchar *path);
+static void find_contents(const char *path);
+static void find_send(GString *batch);
+static void find_indexed(const char *path);
+static void find_index_hit(const char *path, gpointer data);
+static void usage_progress(const UsageTotals *so_far, gpointer data);
 
 /*			SUPPORT				*/
 
@@ -344,7 +512,7 @@ static void show_settype_help(gpointer data)
 	gtk_widget_show_all(help);
 }
 
-static void process_message(GUIside *gui_side, const gchar *buffer)
+static void process_message(GUIside *gui_side, const gchar *buffer, gsize len)
 {
 	ABox *abox = gui_side->abox;
 
@@ -352,8 +520,28 @@ static void process_message(GUIside *gui_side, const gchar *buffer)
 		abox_ask(abox, buffer + 1);
 	else if (*buffer == 's')
 		dir_check_this(buffer + 1);	/* Update this item */
+	else if (*buffer == 'S')
+	{
+		/* Update these items in one directory. The message is the
+		 * directory followed by the leafnames, each ending in '\0'.
+		 */
+		GPtrArray *leaves;
+		const gchar *p = buffer + strlen(buffer) + 1;
+
+		leaves = g_ptr_array_new();
+		for (; p < buffer + len; p += strlen(p) + 1)
+			g_ptr_array_add(leaves, (gchar *) p);
+		dir_check_these(buffer + 1, leaves);
+		g_ptr_array_free(leaves, TRUE);
+	}
 	else if (*buffer == '=')
-		abox_add_filename(abox, buffer + 1);
+	{
+		/* One or more results, separated by '\0's */
+		const gchar *p;
+
+		for (p = buffer + 1; p < buffer + len; p += strlen(p) + 1)
+			abox_add_filename(abox, p);
+	}
 	else if (*buffer == '#')
 		abox_clear_results(abox);
 	else if (*buffer == 'X')
@@ -391,7 +579,13 @@ static void process_message(GUIside *gui_side, const gchar *buffer)
 	}
 	else if (*buffer == '%')
 	{
+		const gchar *text;
+
+		/* Percentage, optionally followed by a space and a summary */
 		abox_set_percentage(abox, atoi(buffer+1));
+		text = strchr(buffer, ' ');
+		if (text)
+			abox_set_progress_text(abox, text + 1);
 	}
 	else
 		abox_log(abox, buffer + 1, NULL);
@@ -406,25 +600,41 @@ static void message_from_child(gpointer 	  data,
 	GUIside	*gui_side = (GUIside *) data;
 	ABox	*abox = gui_side->abox;
 	GtkTextBuffer *text_buffer;
+	int	n = 0;
 
 	text_buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(abox->log));
 
-	if (read_exact(source, buf, 4))
+	/* The child sends messages in batches, so deal with everything
+	 * that's waiting (within reason) rather than one per call.
+	 */
+	while (read_exact(source, buf, 4))
 	{
 		ssize_t message_len;
 		char	*buffer;
+		fd_set	set;
+		struct timeval tv;
 
 		buf[4] = '\0';
 		message_len = strtol(buf, NULL, 16);
 		buffer = g_malloc(message_len + 1);
-		if (message_len > 0 && read_exact(source, buffer, message_len))
+		if (message_len <= 0 || !read_exact(source, buffer, message_len))
 		{
-			buffer[message_len] = '\0';
-			process_message(gui_side, buffer);
 			g_free(buffer);
-			return;
+			g_printerr("Child died in the middle of a message.\n");
+			break;
 		}
-		g_printerr("Child died in the middle of a message.\n");
+
+		buffer[message_len] = '\0';
+		process_message(gui_side, buffer, message_len);
+		g_free(buffer);
+
+		FD_ZERO(&set);
+		FD_SET(source, &set);
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		if (++n >= MAX_MESSAGES_AT_ONCE ||
+		    select(source + 1, &set, NULL, NULL, &tv) != 1)
+			return;
 	}
 
 	if (gui_side->abort_attempts)
@@ -439,61 +649,953 @@ static void message_from_child(gpointer 	  data,
 	g_source_remove(gui_side->input_tag);
 	abox_cancel_ask(gui_side->abox);
 
-	if (gui_side->errors)
-	{
-		guchar *report;
+	if (gui_side->errors)
+	{
+		guchar *report;
+
+		if (gui_side->errors == 1)
+			report = g_strdup(_("There was one error.\n"));
+		else
+			report = g_strdup_printf(_("There were %d errors.\n"),
+							gui_side->errors);
+
+		gtk_text_buffer_insert_at_cursor(text_buffer, report, -1);
+
+		g_free(report);
+	}
+	else if (gui_side->show_info == FALSE)
+		gtk_widget_destroy(GTK_WIDGET(gui_side->abox));
+}
+
+/* Scans src_dir, calling cb(item, dest_path) for each item */
+static void for_dir_contents(ForDirCB *cb,
+			     const char *src_dir,
+			     const char *dest_path)
+{
+	DIR	*d = NULL;
+	struct dirent *ent = NULL;
+	GPtrArray *batch;
+	int	fd, old_fd = walk_fd;
+	const char *old_dir = walk_dir;
+	size_t	old_len = walk_dir_len;
+	gboolean keep_open = walk_depth < WALK_MAX_OPEN;
+	guint	i;
+
+	fd = walk_open_dir(src_dir);
+	if (fd != -1)
+	{
+		d = fdopendir(fd);
+		if (!d)
+			close(fd);
+	}
+	if (!d)
+	{
+		/* Message displayed is "ERROR reading 'path': message" */
+		printf_send("!%s '%s': %s\n", _("ERROR reading"),
+			    src_dir, g_strerror(errno));
+		return;
+	}
+
+	send_dir(src_dir);
+
+	/* Read the names a batch at a time, so huge directories don't use
+	 * lots of memory. Deleting entries already read doesn't upset
+	 * readdir().
+	 */
+	batch = g_ptr_array_new();
+	walk_depth++;
+	do
+	{
+		while ((batch->len < WALK_BATCH || !keep_open) &&
+		       (ent = readdir(d)))
+		{
+			if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0'
+				|| (ent->d_name[1] == '.'
+				    && ent->d_name[2] == '\0')))
+				continue;
+			g_ptr_array_add(batch, g_strdup(ent->d_name));
+		}
+
+		if (keep_open)
+		{
+			walk_fd = dirfd(d);
+			walk_dir = src_dir;
+			walk_dir_len = strlen(src_dir);
+		}
+		else
+		{
+			/* Everything's been read; use the paths */
+			closedir(d);
+			d = NULL;
+			walk_fd = -1;
+			walk_dir = NULL;
+			walk_dir_len = 0;
+		}
+
+		for (i = 0; i < batch->len; i++)
+		{
+			gchar	*path;
+
+			path = g_build_filename(src_dir,
+					g_ptr_array_index(batch, i), NULL);
+			cb(path, dest_path);
+			g_free(path);
+			g_free(g_ptr_array_index(batch, i));
+		}
+		g_ptr_array_set_size(batch, 0);
+	} while (ent);
+
+	g_ptr_array_free(batch, TRUE);
+	if (d)
+		closedir(d);
+	walk_depth--;
+
+	walk_fd = old_fd;
+	walk_dir = old_dir;
+	walk_dir_len = old_len;
+}
+
+/* If 'path' is directly inside the directory being walked, return its leaf
+ * (to use with walk_fd), otherwise NULL.
+ */
+static const char *walk_leaf(const char *path)
+{
+	const char *leaf;
+
+	if (walk_fd == -1 || strncmp(path, walk_dir, walk_dir_len) != 0)
+		return NULL;
+
+	leaf = path + walk_dir_len;
+	if (*leaf == '/')
+		leaf++;
+	else if (walk_dir_len == 0 || walk_dir[walk_dir_len - 1] != '/')
+		return NULL;
+
+	if (*leaf == '\0' || strchr(leaf, '/'))
+		return NULL;
+
+	return leaf;
+}
+
+/* Like lstat(), but relative to the walk if possible */
+static int walk_lstat(const char *path, struct stat *info)
+{
+	const char *leaf = walk_leaf(path);
+
+	if (leaf)
+		return fstatat(walk_fd, leaf, info, AT_SYMLINK_NOFOLLOW);
+	return mc_lstat(path, info);
+}
+
+static int walk_unlink(const char *path)
+{
+	const char *leaf = walk_leaf(path);
+
+	return leaf ? unlinkat(walk_fd, leaf, 0) : unlink(path);
+}
+
+static int walk_rmdir(const char *path)
+{
+	const char *leaf = walk_leaf(path);
+
+	return leaf ? unlinkat(walk_fd, leaf, AT_REMOVEDIR) : rmdir(path);
+}
+
+static int walk_chmod(const char *path, mode_t mode)
+{
+	const char *leaf = walk_leaf(path);
+
+	return leaf ? fchmodat(walk_fd, leaf, mode, 0) : chmod(path, mode);
+}
+
+static int walk_access(const char *path, int mode)
+{
+	const char *leaf = walk_leaf(path);
+
+	return leaf ? faccessat(walk_fd, leaf, mode, 0) : access(path, mode);
+}
+
+/* Open directory 'path' for reading, without following a symlink */
+static int walk_open_dir(const char *path)
+{
+	const char *leaf = walk_leaf(path);
+
+	return openat(leaf ? walk_fd : AT_FDCWD, leaf ? leaf : path,
+		      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/* Start the threads that copy files for do_copy2(), unless the user only
+ * wants one file copied at a time.
+ */
+static void copy_start(void)
+{
+	int	threads = o_action_threads.int_value;
+
+	if (threads < 2)
+		return;
+
+	/* Exclusive, since we've just forked and the parent's idle
+	 * threads don't exist here.
+	 */
+	copy_pool = g_thread_pool_new(copy_thread, NULL, threads, TRUE, NULL);
+	if (copy_pool)
+		copy_results = g_async_queue_new();
+}
+
+/* Runs in a copy thread */
+static void copy_thread(gpointer data, gpointer user_data)
+{
+	CopyJob	*job = (CopyJob *) data;
+
+	job->error = copy_file(job->src, job->dest,
+			       progress_copied_in_thread);
+	if (!job->error)
+		xattr_copy(job->src, job->dest);
+
+	g_async_queue_push(copy_results, job);
+}
+
+/* Have a copy thread copy this regular file. Waits for earlier files to
+ * finish if too many are queued already.
+ */
+static void copy_queue(const char *path, const char *dest_path)
+{
+	CopyJob	*job;
+
+	job = g_new(CopyJob, 1);
+	job->src = g_strdup(path);
+	job->dest = g_strdup(dest_path);
+	job->dir = copy_dir;
+	job->error = NULL;
+
+	if (copy_dir)
+		copy_dir->pending++;
+	copy_in_flight++;
+
+	g_thread_pool_push(copy_pool, job, NULL);
+
+	while (copy_in_flight >= COPY_QUEUE_PER_THREAD *
+				 g_thread_pool_get_max_threads(copy_pool))
+		copy_collect(TRUE);
+	while (copy_collect(FALSE))
+		;
+}
+
+/* Report on a file that a copy thread has finished with. If 'wait', block
+ * until one is ready (sending progress reports meanwhile).
+ * Returns FALSE if there was nothing to report.
+ */
+static gboolean copy_collect(gboolean wait)
+{
+	CopyJob	*job;
+
+	if (!copy_in_flight)
+		return FALSE;
+
+	if (wait)
+	{
+		GTimeVal timeout;
+
+		g_get_current_time(&timeout);
+		g_time_val_add(&timeout, G_USEC_PER_SEC / 2);
+		job = g_async_queue_timed_pop(copy_results, &timeout);
+		if (!job && progress_timer)
+			progress_send(FALSE);
+		if (!job)
+			flush_messages();
+	}
+	else
+		job = g_async_queue_try_pop(copy_results);
+
+	if (!job)
+		return FALSE;
+
+	copy_in_flight--;
+
+	if (job->error)
+	{
+		printf_send(_("!%s\nFailed to copy '%s'\n"),
+						job->error, job->src);
+		g_free(job->error);
+	}
+	else
+		send_check_path(job->dest);
+
+	if (job->dir)
+		copy_dir_unref(job->dir);
+
+	g_free(job->src);
+	g_free(job->dest);
+	g_free(job);
+
+	return TRUE;
+}
+
+/* Wait for every queued file to be copied */
+static void copy_flush(void)
+{
+	while (copy_in_flight)
+		copy_collect(TRUE);
+}
+
+/* We've just created directory 'path', a copy of one with 'info'.
+ * Files copied into it (and the walk through the original) hold
+ * references to it; the last one sets its permissions and times.
+ */
+static CopyDir *copy_dir_new(const char *path, struct stat *info)
+{
+	CopyDir	*dir;
+
+	dir = g_new(CopyDir, 1);
+	dir->path = g_strdup(path);
+	dir->mode = info->st_mode;
+	dir->atime = info->st_atime;
+	dir->mtime = info->st_mtime;
+	dir->pending = 1;
+	dir->parent = copy_dir;
+
+	/* The parent mustn't lose its write or search permission while
+	 * we're still being filled.
+	 */
+	if (copy_dir)
+		copy_dir->pending++;
+
+	return dir;
+}
+
+static void copy_dir_unref(CopyDir *dir)
+{
+	CopyDir	*parent = dir->parent;
+	struct utimbuf utb;
+
+	if (--dir->pending)
+		return;
+
+	/* We may have created the directory with more permissions than the
+	 * source so that we could write to it... change it back now.
+	 */
+	if (chmod(dir->path, dir->mode))
+	{
+		/* Some filesystems don't support SetGID and SetUID bits.
+		 * Ignore these errors.
+		 */
+		if (errno != EPERM)
+			send_error();
+	}
+
+	/* Also, try to preserve the timestamps */
+	utb.actime = dir->atime;
+	utb.modtime = dir->mtime;
+
+	utime(dir->path, &utb);
+
+	g_free(dir->path);
+	g_free(dir);
+
+	if (parent)
+		copy_dir_unref(parent);
+}
+
+/* Start the threads that delete directory contents for do_delete(), if
+ * the user wants more than one.
+ */
+static void delete_start(void)
+{
+	int	threads = o_action_threads.int_value;
+
+	if (threads < 2)
+		return;
+
+	delete_pool = g_thread_pool_new(delete_thread, NULL,
+					threads, TRUE, NULL);
+	if (delete_pool)
+		delete_done = g_async_queue_new();
+}
+
+/* Runs in a delete thread. Deletes everything in dir that can be deleted
+ * without asking, queuing subdirectories for other threads. Errors are
+ * ignored here; do_delete() will report them when it tries again.
+ */
+static void delete_thread(gpointer data, gpointer user_data)
+{
+	DeleteDir *dir = (DeleteDir *) data;
+	struct dirent *ent;
+	DIR	*d = NULL;
+	int	fd;
+
+	fd = open(dir->path,
+		  O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd != -1)
+	{
+		d = fdopendir(fd);
+		if (!d)
+			close(fd);
+	}
+
+	while (d && (ent = readdir(d)))
+	{
+		struct stat info;
+		gboolean is_dir;
+
+		if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0'
+			|| (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+			continue;
+
+		if (fstatat(fd, ent->d_name, &info, AT_SYMLINK_NOFOLLOW))
+			continue;
+		is_dir = S_ISDIR(info.st_mode);
+
+		/* do_delete() must ask about write-protected items. If it's
+		 * a directory, leave everything in it too, in case the
+		 * answer is No.
+		 */
+		if (!o_force && !S_ISLNK(info.st_mode) &&
+		    faccessat(fd, ent->d_name, W_OK, 0) != 0)
+			continue;
+
+		if (is_dir)
+		{
+			DeleteDir *sub;
+
+			sub = g_new(DeleteDir, 1);
+			sub->path = g_build_filename(dir->path,
+						     ent->d_name, NULL);
+			sub->pending = 1;
+			sub->parent = dir;
+			g_atomic_int_inc(&dir->pending);
+
+			g_thread_pool_push(delete_pool, sub, NULL);
+			continue;
+		}
+
+		if (unlinkat(fd, ent->d_name, 0) == 0)
+			g_atomic_int_inc(&delete_count);
+	}
+
+	if (d)
+		closedir(d);
+
+	delete_dir_unref(dir);
+}
+
+/* Called from any thread. When everything in 'dir' has been done, remove
+ * it (or, for the top one, tell delete_contents()).
+ */
+static void delete_dir_unref(DeleteDir *dir)
+{
+	DeleteDir *parent = dir->parent;
+
+	if (!g_atomic_int_dec_and_test(&dir->pending))
+		return;
+
+	if (!parent)
+	{
+		g_async_queue_push(delete_done, dir);
+		return;
+	}
+
+	if (rmdir(dir->path) == 0)
+		g_atomic_int_inc(&delete_count);
+
+	g_free(dir->path);
+	g_free(dir);
+
+	delete_dir_unref(parent);
+}
+
+/* Have the delete threads empty directory 'path', and wait until they
+ * have, sending progress reports meanwhile.
+ */
+static void delete_contents(const char *path)
+{
+	DeleteDir *top;
+	gint	counted;
+
+	/* delete_count includes what earlier calls deleted */
+	counted = g_atomic_int_get(&delete_count);
+
+	top = g_new(DeleteDir, 1);
+	top->path = g_strdup(path);
+	top->pending = 1;
+	top->parent = NULL;
+
+	g_thread_pool_push(delete_pool, top, NULL);
+
+	do
+	{
+		GTimeVal timeout;
+		gint	now;
+
+		g_get_current_time(&timeout);
+		g_time_val_add(&timeout, G_USEC_PER_SEC / 4);
+		top = g_async_queue_timed_pop(delete_done, &timeout);
+
+		now = g_atomic_int_get(&delete_count);
+		progress_add(0, now - counted);
+		counted = now;
+		flush_messages();
+	} while (!top);
+
+	g_free(top->path);
+	g_free(top);
+}
+
+/* Have usage_scan's threads count everything in 'path', adding it to
+ * usage_totals.
+ */
+static void usage_tree(const char *path)
+{
+	UsageTotals found;
+	gchar	*error;
+
+	error = usage_scan_path(usage_scan, path, &found,
+				usage_progress, NULL);
+	if (error)
+	{
+		printf_send("!%s\n", error);
+		if (found.errors > 1)
+			printf_send(_("!(%ld items couldn't be read)\n"),
+				    (long) found.errors);
+		g_free(error);
+	}
+
+	usage_totals_add(&usage_totals, &found);
+}
+
+static void usage_progress(const UsageTotals *so_far, gpointer data)
+{
+	UsageTotals sum = usage_totals;
+
+	check_flags();
+
+	usage_totals_add(&sum, so_far);
+	printf_send(_("%%%d %ld files, %s"), usage_per,
+		    (long) sum.files, format_double_size(sum.allocated));
+}
+
+/* Unlike Copy and Delete, we use a pool even for one thread, since
+ * find_thread() can often avoid stat() calls that do_find() needs.
+ */
+static void find_start(void)
+{
+	int	threads = MAX(o_action_threads.int_value, 1);
+
+	find_pool = g_thread_pool_new(find_thread, NULL, threads, TRUE, NULL);
+	if (find_pool)
+		find_results = g_async_queue_new();
+}
+
+/* Search one directory, queuing its subdirectories for other threads.
+ * Only the names are read, unless find_condition needs more.
+ */
+static void find_thread(gpointer data, gpointer user_data)
+{
+	gchar	*dir_path = (gchar *) data;
+	GString	*path, *batch;
+	FindInfo info;
+	struct dirent *ent;
+	DIR	*d = NULL;
+	int	fd;
+	gsize	dir_len;
+
+	fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd != -1)
+		d = fdopendir(fd);
+	if (!d)
+	{
+		int err = errno;
+
+		if (fd != -1)
+			close(fd);
+		batch = g_string_new(NULL);
+		g_string_printf(batch, "!%s '%s': %s\n", _("ERROR reading"),
+				dir_path, g_strerror(err));
+		g_async_queue_push(find_results, batch);
+		goto out;
+	}
+
+	path = g_string_new(dir_path);
+	if (path->str[path->len - 1] != '/')
+		g_string_append_c(path, '/');
+	dir_len = path->len;
+
+	/* "=", then each match followed by '\0' */
+	batch = g_string_new("=");
+
+	memset(&info.stats, 0, sizeof(info.stats));
+	if (find_needs & FIND_NEEDS_NOW)
+		time(&info.now);
+
+	while ((ent = readdir(d)))
+	{
+		const char *name = ent->d_name;
+		mode_t	type = DIRENT_TYPE(ent);
+
+		if (name[0] == '.' && (name[1] == '\0' ||
+				(name[1] == '.' && name[2] == '\0')))
+			continue;
+
+		g_string_truncate(path, dir_len);
+		g_string_append(path, name);
+
+		if (type && !(find_needs & FIND_NEEDS_STAT))
+			info.stats.st_mode = type;
+		else if (fstatat(fd, name, &info.stats, AT_SYMLINK_NOFOLLOW))
+		{
+			int	err = errno;
+			GString *error = g_string_new(NULL);
+
+			g_string_printf(error, "!%s: %s\n",
+					path->str, g_strerror(err));
+			g_async_queue_push(find_results, error);
+			continue;
+		}
+
+		info.fullpath = path->str;
+		info.leaf = name;
+		info.prune = FALSE;
+		if (find_test_condition(find_condition, &info))
+		{
+			g_string_append_len(batch, path->str, path->len + 1);
+			if (batch->len > FIND_BATCH_BYTES)
+			{
+				g_async_queue_push(find_results, batch);
+				batch = g_string_new("=");
+			}
+		}
+
+		if (S_ISDIR(info.stats.st_mode) && !info.prune)
+			find_push(g_strdup(path->str));
+	}
+
+	closedir(d);
+	g_string_free(path, TRUE);
+
+	if (batch->len > 1)
+		g_async_queue_push(find_results, batch);
+	else
+		g_string_free(batch, TRUE);
+out:
+	g_free(dir_path);
+
+	if (g_atomic_int_dec_and_test(&find_pending))
+		g_async_queue_push(find_results, FIND_DONE);
+}
+
+/* Takes ownership of 'path' */
+static void find_push(gchar *path)
+{
+	g_atomic_int_inc(&find_pending);
+	g_thread_pool_push(find_pool, path, NULL);
+}
+
+/* Have the find threads search everything inside directory 'path',
+ * sending the results as they come in.
+ */
+static void find_contents(const char *path)
+{
+	gpointer result;
+
+	find_push(g_strdup(path));
+
+	while (1)
+	{
+		GTimeVal timeout;
+
+		check_flags();
+
+		g_get_current_time(&timeout);
+		g_time_val_add(&timeout, G_USEC_PER_SEC / 4);
+		result = g_async_queue_timed_pop(find_results, &timeout);
+
+		if (result == FIND_DONE)
+			break;
+		else if (result)
+		{
+			find_send((GString *) result);
+			g_string_free((GString *) result, TRUE);
+		}
+		else
+			flush_messages();
+	}
+}
+
+static void find_send(GString *batch)
+{
+	/* May contain '\0's */
+	g_string_truncate(message, 0);
+	g_string_append_len(message, batch->str, batch->len);
+	send_msg();
+}
+
+/* Like find_contents(), but only test the paths that the index of
+ * filenames says might match. Only for conditions that test nothing but
+ * names; the index may be out of date for anything else.
+ */
+static void find_indexed(const char *path)
+{
+	GString	*batch;
+	gchar	**literals;
+
+	literals = find_condition_literals(find_condition);
+	batch = g_string_new("=");
+
+	name_index_search(path, literals, find_index_hit, batch);
+
+	if (batch->len > 1)
+		find_send(batch);
+	g_string_free(batch, TRUE);
+	g_strfreev(literals);
+}
+
+/* The index says 'path' might match. It might not exist any longer. */
+static void find_index_hit(const char *path, gpointer data)
+{
+	GString	*batch = (GString *) data;
+	FindInfo info;
+
+	/* Only the name is tested, so check that before lstat() */
+	memset(&info.stats, 0, sizeof(info.stats));
+	info.fullpath = path;
+	info.leaf = strrchr(path, '/') + 1;
+	info.prune = FALSE;
+	if (!find_test_condition(find_condition, &info) ||
+	    lstat(path, &info.stats))
+		return;
+
+	g_string_append_len(batch, path, strlen(path) + 1);
+	if (batch->len > FIND_BATCH_BYTES)
+	{
+		find_send(batch);
+		g_string_assign(batch, "=");
+		check_flags();
+	}
+}
+
+/* Start counting everything in 'paths' in the background, so that the
+ * operation can report its progress. Progress is measured in bytes copied
+ * if 'by_bytes', otherwise in entries processed.
+ */
+static void progress_start(GList *paths, gboolean by_bytes)
+{
+	if (!o_action_prescan.int_value)
+		return;
+
+	progress_items = g_new0(Progress, g_list_length(paths));
+	progress_total.bytes = progress_total.entries = 0;
+	progress_done.bytes = progress_done.entries = 0;
+	progress_scanned = FALSE;
+	progress_by_bytes = by_bytes;
+	progress_last_sent = 0;
 
-		if (gui_side->errors == 1)
-			report = g_strdup(_("There was one error.\n"));
-		else
-			report = g_strdup_printf(_("There were %d errors.\n"),
-							gui_side->errors);
+	/* Exclusive, since we've just forked and the parent's idle
+	 * threads don't exist here.
+	 */
+	progress_scanner = g_thread_pool_new(progress_scan, NULL,
+					     1, TRUE, NULL);
+	if (!progress_scanner)
+		return;
 
-		gtk_text_buffer_insert_at_cursor(text_buffer, report, -1);
+	progress_timer = g_timer_new();
+	g_thread_pool_push(progress_scanner, paths, NULL);
+}
 
-		g_free(report);
-	}
-	else if (gui_side->show_info == FALSE)
-		gtk_widget_destroy(GTK_WIDGET(gui_side->abox));
+/* Runs in the scanner thread */
+static void progress_scan(gpointer data, gpointer user_data)
+{
+	GList	*paths = (GList *) data;
+	int	i;
+
+	for (i = 0; paths; paths = paths->next, i++)
+		progress_scan_tree(AT_FDCWD, (char *) paths->data,
+				   &progress_items[i]);
+
+	G_LOCK(progress);
+	progress_scanned = TRUE;
+	G_UNLOCK(progress);
 }
 
-/* Scans src_dir, calling cb(item, dest_path) for each item */
-static void for_dir_contents(ForDirCB *cb,
-			     const char *src_dir,
-			     const char *dest_path)
+/* Add 'name' (in 'dir_fd') and everything in it to 'item' and the overall
+ * total.
+ */
+static void progress_scan_tree(int dir_fd, const char *name, Progress *item)
 {
+	struct stat info;
+	gint64	bytes;
 	DIR	*d;
 	struct dirent *ent;
-	GList  *list = NULL, *next;
+	int	fd;
+
+	if (fstatat(dir_fd, name, &info, AT_SYMLINK_NOFOLLOW))
+		return;
+
+	bytes = S_ISREG(info.st_mode) ? info.st_size : 0;
+
+	G_LOCK(progress);
+	item->bytes += bytes;
+	item->entries++;
+	progress_total.bytes += bytes;
+	progress_total.entries++;
+	G_UNLOCK(progress);
+
+	if (!S_ISDIR(info.st_mode))
+		return;
 
-	d = mc_opendir(src_dir);
+	fd = openat(dir_fd, name,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	d = fdopendir(fd);
 	if (!d)
 	{
-		/* Message displayed is "ERROR reading 'path': message" */
-		printf_send("!%s '%s': %s\n", _("ERROR reading"),
-			    src_dir, g_strerror(errno));
+		close(fd);
 		return;
 	}
 
-	send_dir(src_dir);
-
-	while ((ent = mc_readdir(d)))
+	while ((ent = readdir(d)))
 	{
 		if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0'
 			|| (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
 			continue;
-		list = g_list_prepend(list, g_strdup(make_path(src_dir,
-							       ent->d_name)));
+
+		progress_scan_tree(fd, ent->d_name, item);
+	}
+	closedir(d);
+}
+
+/* The operation has dealt with this much more */
+static void progress_add(gint64 bytes, gint64 entries)
+{
+	if (!progress_timer)
+		return;
+
+	G_LOCK(progress);
+	progress_done.bytes += bytes;
+	G_UNLOCK(progress);
+	progress_done.entries += entries;
+
+	progress_send(FALSE);
+}
+
+/* Called by copy_file() as data is copied */
+static void progress_copied(off_t bytes)
+{
+	progress_add(bytes, 0);
+}
+
+/* Called by copy_file() in a copy thread, which mustn't send messages */
+static void progress_copied_in_thread(off_t bytes)
+{
+	if (!progress_timer)
+		return;
+
+	G_LOCK(progress);
+	progress_done.bytes += bytes;
+	G_UNLOCK(progress);
+}
+
+/* Item 'i' of the list passed to progress_start() has been done. Anything
+ * in it we didn't count (eg, because a whole directory was renamed, or some
+ * files were skipped) counts as done now.
+ */
+static void progress_item_done(int i)
+{
+	Progress so_far = {0, 0};
+	int	j;
+
+	if (!progress_timer)
+		return;
+
+	G_LOCK(progress);
+	if (progress_scanned)
+	{
+		for (j = 0; j <= i; j++)
+		{
+			so_far.bytes += progress_items[j].bytes;
+			so_far.entries += progress_items[j].entries;
+		}
 	}
-	mc_closedir(d);
+	progress_done.bytes = MAX(progress_done.bytes, so_far.bytes);
+	G_UNLOCK(progress);
+
+	progress_done.entries = MAX(progress_done.entries, so_far.entries);
+
+	progress_send(TRUE);
+}
+
+/* Send the percentage done, speed and time left to the parent (at most
+ * twice a second, unless 'force').
+ */
+static void progress_send(gboolean force)
+{
+	Progress total, done_so_far;
+	gboolean scanned, by_bytes;
+	gdouble	elapsed, done, todo, rate;
+	gchar	*done_str, *total_str, *rate_str;
+	int	per, left;
+
+	elapsed = g_timer_elapsed(progress_timer, NULL);
+	if (!force && elapsed < progress_last_sent + 0.5)
+		return;
+	progress_last_sent = elapsed;
 
-	for (next = list; next; next = next->next)
+	G_LOCK(progress);
+	total = progress_total;
+	scanned = progress_scanned;
+	done_so_far.bytes = progress_done.bytes;
+	G_UNLOCK(progress);
+	done_so_far.entries = progress_done.entries;
+
+	done_str = g_strdup(format_double_size(done_so_far.bytes));
+	total_str = g_strdup(format_double_size(total.bytes));
+	rate_str = g_strdup(format_double_size(
+				done_so_far.bytes / MAX(elapsed, 0.001)));
+
+	if (!scanned)
 	{
-		cb((char *) next->data, dest_path);
+		/* Don't know how much there is yet; just show what we've
+		 * found so far.
+		 */
+		printf_send(_("%%0 Counting... %s, %.0f items found"),
+			    total_str, (double) total.entries);
+		goto out;
+	}
 
-		g_free(next->data);
+	/* If there are no bytes to copy (eg, only empty files), count the
+	 * entries instead, and say so.
+	 */
+	by_bytes = progress_by_bytes && total.bytes > 0;
+	if (by_bytes)
+	{
+		done = done_so_far.bytes;
+		todo = total.bytes;
+	}
+	else
+	{
+		done = done_so_far.entries;
+		todo = total.entries;
 	}
-	g_list_free(list);
+	done = MIN(done, todo);
+
+	per = todo > 0 ? 100 * done / todo : 100;
+	rate = done / MAX(elapsed, 0.001);
+	left = rate > 0 ? (todo - done) / rate : 0;
+
+	if (by_bytes)
+		printf_send(_("%%%d %s of %s (%s/s, %.0f files/s), "
+			      "%d:%02d:%02d left"),
+			    per, done_str, total_str, rate_str,
+			    done_so_far.entries / MAX(elapsed, 0.001),
+			    left / 3600, (left / 60) % 60, left % 60);
+	else
+		printf_send(_("%%%d %.0f of %.0f items (%.0f/s), "
+			      "%d:%02d:%02d left"),
+			    per, done, todo, rate,
+			    left / 3600, (left / 60) % 60, left % 60);
+out:
+	g_free(done_str);
+	g_free(total_str);
+	g_free(rate_str);
 }
 
 /* Read this many bytes into the buffer. TRUE on success. */
@@ -519,7 +1621,14 @@ static void send_done(void)
 /* Notify the filer that this item has been updated */
 static void send_check_path(const gchar *path)
 {
-	printf_send("s%s", path);
+	gchar	*copy;
+
+	if (!pending_checks)
+		pending_checks = g_hash_table_new_full(g_str_hash, g_str_equal,
+						       g_free, NULL);
+
+	copy = g_strdup(path);
+	g_hash_table_replace(pending_checks, copy, copy);
 }
 
 /* Notify the filer that this whole subtree has changed (eg, been unmounted) */
@@ -546,19 +1655,109 @@ static gboolean printf_send(const char *msg, ...)
 	return send_msg();
 }
 
-/* Send 'message' to our parent process. TRUE on success. */
+/* Send 'message' to our parent process (eventually; see flush_messages()).
+ * TRUE on success.
+ */
 static gboolean send_msg(void)
+{
+	gboolean ok;
+
+	ok = write_msg(message->str, message->len);
+
+	if (!send_timer)
+		send_timer = g_timer_new();
+	else if (g_timer_elapsed(send_timer, NULL) > SEND_FLUSH_TIME)
+		flush_messages();
+
+	return ok;
+}
+
+/* Add one message to the buffer */
+static gboolean write_msg(const gchar *data, gsize len)
 {
 	char len_buffer[5];
-	ssize_t len;
 
-	g_return_val_if_fail(message->len < 0xffff, FALSE);
+	g_return_val_if_fail(len < 0xffff, FALSE);
 
-	sprintf(len_buffer, "%04" G_GSIZE_MODIFIER "x", message->len);
+	sprintf(len_buffer, "%04" G_GSIZE_MODIFIER "x", len);
 	fwrite(len_buffer, 1, 4, to_parent);
-	len = fwrite(message->str, 1, message->len, to_parent);
+	return fwrite(data, 1, len, to_parent) == len;
+}
+
+/* Send everything buffered to the filer. Call this before waiting for
+ * anything.
+ */
+static void flush_messages(void)
+{
+	if (pending_checks && g_hash_table_size(pending_checks))
+	{
+		GHashTable *by_dir;
+
+		/* Directory -> 'S' message listing the leafnames */
+		by_dir = g_hash_table_new_full(g_str_hash, g_str_equal,
+					       g_free, NULL);
+		g_hash_table_foreach(pending_checks, group_check, by_dir);
+		g_hash_table_foreach(by_dir, send_checks, NULL);
+		g_hash_table_destroy(by_dir);
+
+		g_hash_table_remove_all(pending_checks);
+	}
+
 	fflush(to_parent);
-	return len == (ssize_t) message->len;
+	if (send_timer)
+		g_timer_start(send_timer);
+}
+
+static void group_check(gpointer key, gpointer value, gpointer data)
+{
+	GHashTable *by_dir = (GHashTable *) data;
+	const gchar *path = (gchar *) key;
+	const gchar *slash;
+	gchar	*dir;
+	GString	*msg;
+
+	slash = strrchr(path, '/');
+	if (!slash || slash[1] == '\0')
+	{
+		/* No leafname; send it on its own */
+		gchar	*tmp = g_strconcat("s", path, NULL);
+
+		write_msg(tmp, strlen(tmp));
+		g_free(tmp);
+		return;
+	}
+
+	dir = slash == path ? g_strdup("/") : g_strndup(path, slash - path);
+	msg = g_hash_table_lookup(by_dir, dir);
+	if (msg)
+		g_free(dir);
+	else
+	{
+		msg = g_string_new("S");
+		g_string_append(msg, dir);
+		g_string_append_c(msg, '\0');
+		g_hash_table_insert(by_dir, dir, msg);
+	}
+
+	/* Keep each message within the size limit */
+	if (msg->len + strlen(slash) + 1 >= 0xffff)
+	{
+		gsize	dir_len = strlen(msg->str) + 1;
+
+		write_msg(msg->str, msg->len);
+		g_string_truncate(msg, dir_len);
+	}
+
+	/* The leafname and its terminating '\0' */
+	g_string_append_len(msg, slash + 1, strlen(slash));
+}
+
+static void send_checks(gpointer key, gpointer value, gpointer data)
+{
+	GString	*msg = (GString *) value;
+
+	write_msg(msg->str, msg->len);
+	g_string_free(msg, TRUE);
 }
 
 /* Set the directory indicator at the top of the window */
@@ -714,6 +1913,7 @@ static gboolean printf_reply(int fd, gboolean ignore_quiet,
 	g_free(tmp);
 
 	send_msg();
+	flush_messages();
 
 	while (1)
 	{
@@ -822,7 +2022,11 @@ static GUIside *start_action(GtkWidget *abox, ActionChild *func, gpointer data,
 	o_newer = newer;
 	o_ignore = ignore;
 
+	worker_pools_pause();
 	child = fork();
+	if (child != 0)
+		worker_pools_resume();
+
 	switch (child)
 	{
 		case -1:
@@ -849,9 +2053,11 @@ static GUIside *start_action(GtkWidget *abox, ActionChild *func, gpointer data,
 			close(filedes[0]);
 			close(filedes[3]);
 			to_parent = fdopen(filedes[1], "wb");
+			setvbuf(to_parent, NULL, _IOFBF, 0x10000);
 			from_parent = filedes[2];
 			func(data);
 			send_dir("");
+			flush_messages();
 			_exit(0);
 	}
 
@@ -890,26 +2096,26 @@ static GUIside *start_action(GtkWidget *abox, ActionChild *func, gpointer data,
 
 /* These may call themselves recursively, or ask questions, etc */
 
-/* Updates the global size_tally, file_counter and dir_counter */
+/* Adds src_path to usage_totals */
 static void do_usage(const char *src_path, const char *unused)
 {
 	struct 		stat info;
 
 	check_flags();
 
-	if (mc_lstat(src_path, &info))
+	if (walk_lstat(src_path, &info))
 	{
 		printf_send("'%s:\n", src_path);
 		send_error();
+		usage_totals.errors++;
 	}
-	else if (S_ISREG(info.st_mode) || S_ISLNK(info.st_mode))
-	{
-	        file_counter++;
-		size_tally += info.st_size;
-	}
-	else if (S_ISDIR(info.st_mode))
+	else if (!S_ISDIR(info.st_mode))
+		usage_scan_add(usage_scan, &info, &usage_totals);
+	else if (quiet)
+		usage_tree(src_path);
+	else
 	{
-	        dir_counter++;
+		usage_scan_add(usage_scan, &info, &usage_totals);
 		if (printf_reply(from_parent, FALSE,
 				 _("?Count contents of %s?"), src_path))
 		{
@@ -919,8 +2125,6 @@ static void do_usage(const char *src_path, const char *unused)
 			g_free(safe_path);
 		}
 	}
-	else
-		file_counter++;
 }
 
 /* dest_path is the dir containing src_path */
@@ -929,18 +2133,21 @@ static void do_delete(const char *src_path, const char *unused)
 	struct stat 	info;
 	gboolean	write_prot;
 	char		*safe_path;
+	int		err;
 	gchar		*base = g_path_get_basename(src_path);
 
 	check_flags();
 
-	if (mc_lstat(src_path, &info))
+	if (walk_lstat(src_path, &info))
 	{
 		send_error();
 		return;
 	}
 
+	progress_add(0, 1);
+
 	write_prot = S_ISLNK(info.st_mode) ? FALSE
-					   : access(src_path, W_OK) != 0;
+					   : walk_access(src_path, W_OK) != 0;
 	if (write_prot || !quiet)
 	{
 		int res;
@@ -962,18 +2169,39 @@ static void do_delete(const char *src_path, const char *unused)
 
 	if (S_ISDIR(info.st_mode))
 	{
-		for_dir_contents(do_delete, safe_path, safe_path);
-		if (rmdir(safe_path))
+		/* Let the threads do what they can, then ask about (or
+		 * report errors for) anything left.
+		 */
+		if (delete_pool && quiet)
+			delete_contents(safe_path);
+
+		err = walk_rmdir(safe_path) ? errno : 0;
+		if (err == ENOTEMPTY || err == EEXIST)
 		{
-			g_free(safe_path);
+			for_dir_contents(do_delete, safe_path, safe_path);
+			err = walk_rmdir(safe_path) ? errno : 0;
+		}
+
+		if (err)
+		{
+			errno = err;
 			send_error();
-			return;
 		}
-		printf_send(_("'Directory '%s' deleted\n"), safe_path);
+		else
+			printf_send(_("'Directory '%s' deleted\n"),
+				    safe_path);
+
+		/* One update for the directory and everything in it */
 		send_mount_path(safe_path);
 	}
-	else if (unlink(src_path))
+	else if (walk_unlink(src_path))
 		send_error();
+	else if (walk_leaf(src_path))
+	{
+		/* We're deleting the contents of a directory, which will
+		 * be updated as a whole afterwards.
+		 */
+	}
 	else
 	{
 		send_check_path(safe_path);
@@ -1018,6 +2246,7 @@ static void do_eject(const char *path)
 	{
 		char c = '?';
 		printf_send("X%s", path);
+		flush_messages();
 		/* Wait until it's safe... */
 		read(from_parent, &c, 1);
 		g_return_if_fail(c == 'X');
@@ -1063,7 +2292,10 @@ static void do_find(const char *path, const char *unused)
 		}
 
 		if (find_condition)
+		{
+			find_needs = find_condition_needs(find_condition);
 			break;
+		}
 
 		printf_send(_("!Invalid find condition - "
 			      "change it and try again\n"));
@@ -1072,7 +2304,7 @@ static void do_find(const char *path, const char *unused)
 			return;
 	}
 
-	if (mc_lstat(path, &info.stats))
+	if (walk_lstat(path, &info.stats))
 	{
 		send_error();
 		printf_send(_("'(while checking '%s')\n"), path);
@@ -1080,14 +2312,22 @@ static void do_find(const char *path, const char *unused)
 	}
 
 	info.fullpath = path;
-	time(&info.now);	/* XXX: Not for each check! */
+	if (find_needs & FIND_NEEDS_NOW)
+		time(&info.now);
 
 	info.leaf = base;
 	info.prune = FALSE;
 	if (find_test_condition(find_condition, &info))
 		printf_send("=%s", path);
 
-	if (S_ISDIR(info.stats.st_mode) && !info.prune)
+	if (S_ISDIR(info.stats.st_mode) && !info.prune && quiet &&
+	    find_needs == 0 && o_find_index.int_value &&
+	    name_index_covers(path))
+		find_indexed(path);
+	else if (S_ISDIR(info.stats.st_mode) && !info.prune && quiet &&
+	    find_pool && !(find_needs & FIND_NEEDS_SERIAL))
+		find_contents(path);
+	else if (S_ISDIR(info.stats.st_mode) && !info.prune)
 	{
 		char *safe_path;
 		safe_path = g_strdup(path);
@@ -1136,7 +2376,7 @@ static void do_chmod(const char *path, const char *unused)
 
 	check_flags();
 
-	if (mc_lstat(path, &info))
+	if (walk_lstat(path, &info))
 	{
 		send_error();
 		return;
@@ -1179,7 +2419,7 @@ static void do_chmod(const char *path, const char *unused)
 			return;
 	}
 
-	if (mc_lstat(path, &info))
+	if (walk_lstat(path, &info))
 	{
 		send_error();
 		return;
@@ -1188,7 +2428,7 @@ static void do_chmod(const char *path, const char *unused)
 		return;
 
 	new_mode = mode_adjust(info.st_mode, mode_change);
-	if (chmod(path, new_mode))
+	if (walk_chmod(path, new_mode))
 	{
 		send_error();
 		return;
@@ -1216,7 +2456,7 @@ static void do_settype(const char *path, const char *unused)
 
 	check_flags();
 
-	if (mc_lstat(path, &info))
+	if (walk_lstat(path, &info))
 	{
 		send_error();
 		return;
@@ -1258,7 +2498,7 @@ static void do_settype(const char *path, const char *unused)
 			return;
 	}
 
-	if (mc_lstat(path, &info))
+	if (walk_lstat(path, &info))
 	{
 		send_error();
 		return;
@@ -1340,12 +2580,14 @@ static void do_copy2(const char *path, const char *dest)
 
 	dest_path = make_dest_path(path, dest);
 
-	if (mc_lstat(path, &info))
+	if (walk_lstat(path, &info))
 	{
 		send_error();
 		return;
 	}
 
+	progress_add(0, 1);
+
 	if (mc_lstat(dest_path, &dest_info) == 0)
 	{
 		int		err;
@@ -1423,6 +2665,7 @@ static void do_copy2(const char *path, const char *dest)
 	{
 		mode_t	mode = info.st_mode;
 		char *safe_path, *safe_dest;
+		CopyDir	*dir = NULL, *old_dir = copy_dir;
 		struct stat 	dest_info;
 		gboolean	exists;
 
@@ -1444,36 +2687,21 @@ static void do_copy2(const char *path, const char *dest)
 				lchown(safe_dest, info.st_uid, info.st_gid);
 				xattr_copy(safe_path, safe_dest);
 				send_check_path(safe_dest);
+
+				dir = copy_dir_new(safe_dest, &info);
+				copy_dir = dir;
 			}
 
 			action_leaf = NULL;
 			for_dir_contents(do_copy2, safe_path, safe_dest);
 			/* Note: dest_path now invalid... */
 
-			if (!exists)
-			{
-				struct utimbuf utb;
-
-				/* We may have created the directory with
-				 * more permissions than the source so that
-				 * we could write to it... change it back now.
-				 */
-				if (chmod(safe_dest, mode))
-				{
-					/* Some filesystems don't support
-					 * SetGID and SetUID bits. Ignore
-					 * these errors.
-					 */
-					if (errno != EPERM)
-						send_error();
-				}
-
-				/* Also, try to preserve the timestamps */
-				utb.actime = info.st_atime;
-				utb.modtime = info.st_mtime;
-
-				utime(safe_dest, &utb);
-			}
+			/* Sets the permissions and times, once all the
+			 * files in it have been copied.
+			 */
+			copy_dir = old_dir;
+			if (dir)
+				copy_dir_unref(dir);
 		}
 
 		g_free(safe_path);
@@ -1503,11 +2731,13 @@ static void do_copy2(const char *path, const char *dest)
 		else
 			send_error();
 	}
+	else if (copy_pool)
+		copy_queue(path, dest_path);
 	else
 	{
 		guchar	*error;
 
-		error = copy_file(path, dest_path);
+		error = copy_file(path, dest_path, progress_copied);
 
 		if (error)
 		{
@@ -1516,15 +2746,227 @@ static void do_copy2(const char *path, const char *dest)
 			g_free(error);
 		}
 		else
+		{
+			xattr_copy(path, dest_path);
 			send_check_path(dest_path);
+		}
+	}
+}
+
+/* Move 'path' to 'dest_path'. Anything that was at 'dest_path' has already
+ * been removed (with the user's permission), so if something appears there
+ * now it's left alone. Moves between filesystems copy the object and then
+ * remove the original.
+ * Returns an error string, or NULL on success. g_free() the result.
+ */
+static guchar *move_object(const char *path, const char *dest_path)
+{
+	struct stat info;
+	guchar	*error;
+
+#ifdef HAVE_RENAMEAT2
+	if (renameat2(AT_FDCWD, path, AT_FDCWD, dest_path,
+		      RENAME_NOREPLACE) == 0)
+		return NULL;
+
+	/* EINVAL if the filesystem doesn't support RENAME_NOREPLACE */
+	if (errno == EINVAL || errno == ENOSYS)
+#endif
+	{
+		if (mc_lstat(dest_path, &info) == 0)
+			errno = EEXIST;
+		else if (rename(path, dest_path) == 0)
+			return NULL;
+	}
+
+	if (errno != EXDEV)
+		return g_strdup(g_strerror(errno));
+
+	error = copy_tree(path, dest_path);
+	if (error)
+	{
+		/* Don't leave half a copy behind */
+		g_free(remove_tree(dest_path));
+		return error;
+	}
+
+	return remove_tree(path);
+}
+
+/* Copy 'from' (recursively) to 'to', which mustn't exist, keeping
+ * permissions, ownership (if we can), times and extended attributes.
+ * Files with several links that have already been copied during this
+ * operation are linked to the earlier copy. Links which stay behind on the
+ * old filesystem (not being moved) can't be kept, of course.
+ * Stops at the first error.
+ * Returns an error string, or NULL on success. g_free() the result.
+ */
+static guchar *copy_tree(const char *from, const char *to)
+{
+	struct stat info;
+	guchar	*error = NULL;
+
+	if (mc_lstat(from, &info))
+		return g_strdup_printf("%s: %s", from, g_strerror(errno));
+
+	if (S_ISDIR(info.st_mode))
+	{
+		DIR	*d;
+		struct dirent *ent;
+		struct utimbuf utb;
+
+		if (mkdir(to, 0700))
+			return g_strdup_printf("%s: %s", to, g_strerror(errno));
+
+		d = mc_opendir(from);
+		if (!d)
+			return g_strdup_printf("%s: %s",
+					       from, g_strerror(errno));
+
+		while (!error && (ent = mc_readdir(d)))
+		{
+			gchar	*sub_from, *sub_to;
+
+			if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0'
+			    || (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+				continue;
+
+			sub_from = g_build_filename(from, ent->d_name, NULL);
+			sub_to = g_build_filename(to, ent->d_name, NULL);
+			error = copy_tree(sub_from, sub_to);
+			g_free(sub_from);
+			g_free(sub_to);
+		}
+		mc_closedir(d);
+
+		if (error)
+			return error;
+
+		lchown(to, info.st_uid, info.st_gid);
+		xattr_copy(from, to);
+		if (chmod(to, info.st_mode & 07777) && errno != EPERM)
+			return g_strdup_printf("%s: %s", to, g_strerror(errno));
+
+		utb.actime = info.st_atime;
+		utb.modtime = info.st_mtime;
+		utime(to, &utb);
+	}
+	else if (S_ISLNK(info.st_mode))
+	{
+		char	*target;
+
+		target = readlink_dup(from);
+		if (!target || symlink(target, to))
+			error = g_strdup_printf("%s: %s",
+						to, g_strerror(errno));
+		else
+			lchown(to, info.st_uid, info.st_gid);
+		g_free(target);
+	}
+	else
+	{
+		gchar	*key = NULL;
+
+		if (info.st_nlink > 1)
+		{
+			const gchar *copied;
+
+			if (!moved_links)
+				moved_links = g_hash_table_new_full(g_str_hash,
+						g_str_equal, g_free, g_free);
+
+			key = g_strdup_printf("%" G_GUINT64_FORMAT " %"
+					      G_GUINT64_FORMAT,
+					      (guint64) info.st_dev,
+					      (guint64) info.st_ino);
+			copied = g_hash_table_lookup(moved_links, key);
+
+			/* (if the earlier copy has gone, copy it again) */
+			if (copied && link(copied, to) == 0)
+			{
+				g_free(key);
+				return NULL;
+			}
+		}
+
+		error = copy_file(from, to, progress_copied);
+		if (error)
+		{
+			guchar	*tmp = error;
+
+			error = g_strdup_printf("%s: %s", from, tmp);
+			g_free(tmp);
+			g_free(key);
+		}
+		else
+		{
+			xattr_copy(from, to);
+			if (key)
+				g_hash_table_replace(moved_links, key,
+						     g_strdup(to));
+		}
+	}
+
+	return error;
+}
+
+/* Delete 'path' and everything in it, without asking.
+ * Returns an error string, or NULL on success. g_free() the result.
+ */
+static guchar *remove_tree(const char *path)
+{
+	struct stat info;
+
+	if (mc_lstat(path, &info))
+		return errno == ENOENT ? NULL
+			: g_strdup_printf("%s: %s", path, g_strerror(errno));
+
+	if (S_ISDIR(info.st_mode))
+	{
+		DIR	*d;
+		struct dirent *ent;
+		GList	*list = NULL, *next;
+		guchar	*error = NULL;
+
+		d = mc_opendir(path);
+		if (!d)
+			return g_strdup_printf("%s: %s",
+					       path, g_strerror(errno));
+		while ((ent = mc_readdir(d)))
+		{
+			if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0'
+			    || (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+				continue;
+			list = g_list_prepend(list, g_build_filename(path,
+							ent->d_name, NULL));
+		}
+		mc_closedir(d);
+
+		for (next = list; next; next = next->next)
+		{
+			if (!error)
+				error = remove_tree((char *) next->data);
+			g_free(next->data);
+		}
+		g_list_free(list);
+
+		if (error)
+			return error;
+
+		if (rmdir(path))
+			return g_strdup_printf("%s: %s",
+					       path, g_strerror(errno));
 	}
+	else if (unlink(path))
+		return g_strdup_printf("%s: %s", path, g_strerror(errno));
+
+	return NULL;
 }
 
 /* If action_leaf is not NULL it specifies the new leaf name */
 static void do_move2(const char *path, const char *dest)
 {
 	const char	*dest_path;
-	const char	*argv[] = {"mv", "-f", NULL, NULL, NULL};
 	struct stat 	info;
 	struct stat 	dest_info;
 	guchar		*error = NULL;
@@ -1533,12 +2975,14 @@ static void do_move2(const char *path, const char *dest)
 
 	dest_path = make_dest_path(path, dest);
 
-	if (mc_lstat(path, &info))
+	if (walk_lstat(path, &info))
 	{
 		send_error();
 		return;
 	}
 
+	progress_add(0, 1);
+
 	if (mc_lstat(dest_path, &dest_info) == 0)
 	{
 		int		err;
@@ -1612,9 +3056,6 @@ static void do_move2(const char *path, const char *dest)
 	else if (!o_brief || S_ISDIR(info.st_mode))
 		printf_send(_("'Moving %s as %s\n"), path, dest_path);
 
-	argv[2] = path;
-	argv[3] = dest_path;
-
 	if (S_ISDIR(info.st_mode))
 	{
 		char *safe_path, *safe_dest;
@@ -1645,7 +3086,7 @@ static void do_move2(const char *path, const char *dest)
 			else
 			{
 				/* Do actual move. */
-				error = fork_exec_wait(argv);
+				error = move_object(safe_path, safe_dest);
 			}
 		}
 
@@ -1655,7 +3096,7 @@ static void do_move2(const char *path, const char *dest)
 	else
 	{
 		/* Do actual move. */
-		error = fork_exec_wait(argv);
+		error = move_object(path, dest_path);
 	}
 
 	if (error)
@@ -1686,6 +3127,7 @@ static void do_copy(const char *path, const char *dest)
 	else
 	{
 		do_copy2(path, dest);
+		copy_flush();
 		send_check_path(dest);
 	}
 }
@@ -1773,6 +3215,7 @@ static void do_mount(const guchar *path, gboolean mount)
 		 * can't unmount if dnotify is used.
 		 */
 		printf_send("X%s", path);
+		flush_messages();
 		/* Wait until it's safe... */
 		read(from_parent, &c, 1);
 		g_return_if_fail(c == 'X');
@@ -1806,16 +3249,18 @@ static void do_mount(const guchar *path, gboolean mount)
 
 /* After forking, the child calls one of these functions */
 
-/* We use a double for total size in order to count beyond 4Gb */
 static void usage_cb(gpointer data)
 {
 	GList *paths = (GList *) data;
-	double	total_size = 0;
-	int n, i, per;
-	gchar *base;
+	UsageTotals total;
+	int n, i;
+	gchar *base, *sizes;
 
 	n=g_list_length(paths);
-	dir_counter = file_counter = 0;
+	memset(&total, 0, sizeof(total));
+
+	/* Exclusive, since we've just forked */
+	usage_scan = usage_scan_new(o_action_threads.int_value, TRUE);
 
 	for (i=0; paths; paths = paths->next, i++)
 	{
@@ -1823,40 +3268,43 @@ static void usage_cb(gpointer data)
 
 		send_dir(path);
 
-		size_tally = 0;
+		memset(&usage_totals, 0, sizeof(usage_totals));
 
+		usage_per = 100 * i / n;
 		if(n>1 && i>0)
-		{
-			per=100*i/n;
-			printf_send("%%%d", per);
-		}
+			printf_send("%%%d", usage_per);
 		do_usage(path, NULL);
 
 		base = g_path_get_basename(path);
-		printf_send("'%s: %s\n",
-			    base,
-			    format_double_size(size_tally));
+		sizes = usage_format_sizes(&usage_totals);
+		printf_send("'%s: %s\n", base, sizes);
+		g_free(sizes);
 		g_free(base);
-		total_size += size_tally;
+		usage_totals_add(&total, &usage_totals);
 	}
 	printf_send("%%-1");
 
-	g_string_printf(message, _("'\nTotal: %s ("),
-			format_double_size(total_size));
+	usage_scan_finish(usage_scan);
+	usage_scan_free(usage_scan);
+	usage_scan = NULL;
+
+	sizes = usage_format_sizes(&total);
+	g_string_printf(message, _("'\nTotal: %s ("), sizes);
+	g_free(sizes);
 
-	if (file_counter)
+	if (total.files)
 		g_string_append_printf(message,
-				"%ld %s%s", file_counter,
-				file_counter == 1 ? _("file") : _("files"),
-				dir_counter ? ", " : ")\n");
+				"%ld %s%s", (long) total.files,
+				total.files == 1 ? _("file") : _("files"),
+				total.dirs ? ", " : ")\n");
 
-	if (file_counter == 0 && dir_counter == 0)
+	if (total.files == 0 && total.dirs == 0)
 		g_string_append(message, _("no directories)\n"));
-	else if (dir_counter)
+	else if (total.dirs)
 		g_string_append_printf(message,
-				"%ld %s)\n", dir_counter,
-				dir_counter == 1 ? _("directory")
-						 : _("directories"));
+				"%ld %s)\n", (long) total.dirs,
+				total.dirs == 1 ? _("directory")
+						: _("directories"));
 
 	send_msg();
 }
@@ -1920,6 +3368,8 @@ static void delete_cb(gpointer data)
 	int n, i, per;
 
 	n=g_list_length(paths);
+	progress_start(paths, FALSE);
+	delete_start();
 	for (i=0; paths; paths = paths->next, i++)
 	{
 		guchar	*path = (guchar *) paths->data;
@@ -1928,12 +3378,13 @@ static void delete_cb(gpointer data)
 		dir = dirname(path);
 		send_dir(dir);
 
-		if(n>1 && i>0)
+		if(n>1 && i>0 && !progress_timer)
 		{
 			per=100*i/n;
 			printf_send("%%%d", per);
 		}
 		do_delete(path, dir);
+		progress_item_done(i);
 		g_free(dir);
 	}
 
@@ -1969,6 +3420,8 @@ static void find_cb(gpointer data)
 	GList *all_paths = (GList *) data;
 	GList *paths;
 
+	find_start();
+
 	while (1)
 	{
 		for (paths = all_paths; paths; paths = paths->next)
@@ -2064,9 +3517,14 @@ static void list_cb(gpointer data)
 
 	n=g_list_length(paths);
 
+	if (action_do_func == do_copy || action_do_func == do_move)
+		progress_start(paths, TRUE);
+	if (action_do_func == do_copy)
+		copy_start();
+
 	for (i=0; paths; paths = paths->next, i++)
 	{
-		if(n>1 && i>0)
+		if(n>1 && i>0 && !progress_timer)
 		{
 			per=100*i/n;
 			printf_send("%%%d", per);
@@ -2074,6 +3532,7 @@ static void list_cb(gpointer data)
 		send_dir((char *) paths->data);
 
 		action_do_func((char *) paths->data, action_dest);
+		progress_item_done(i);
 	}
 
 	send_done();
@@ -2562,6 +4021,8 @@ void action_init(void)
 	option_add_int(&o_action_force, "action_force", FALSE);
 	option_add_int(&o_action_brief, "action_brief", FALSE);
 	option_add_int(&o_action_recurse, "action_recurse", FALSE);
+	option_add_int(&o_action_prescan, "action_prescan", TRUE);
+	option_add_int(&o_action_threads, "action_threads", 4);
 	option_add_int(&o_action_merge, "action_merge", FALSE);
 	option_add_int(&o_action_newer, "action_newer", FALSE);
 	option_add_int(&o_action_ignore, "action_ignore", FALSE);
@@ -8,6 +8,8 @@
 
 #include <gtk/gtk.h>
 
+extern Option o_action_threads;
+
 void action_init(void);
 
 void action_usage(GList *paths);
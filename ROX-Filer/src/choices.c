@@ -371,6 +371,35 @@ GPtrArray *choices_list_xdg_dirs(char *dir, char *site)
 	return list;
 }
 
+/* Like choices_list_xdg_dirs(), but also includes the old-style Choices
+ * directories that choices_find_xdg_path_load() falls back on. This is every
+ * existing directory that a file could be loaded from.
+ *
+ * Free the list using choices_free_list().
+ */
+GPtrArray *choices_list_load_dirs(char *dir, char *site)
+{
+	GPtrArray	*list;
+	gchar		**cdir;
+
+	list = choices_list_xdg_dirs(dir, site);
+	g_return_val_if_fail(list != NULL, NULL);
+
+	for (cdir = dir_list; *cdir; cdir++)
+	{
+		gchar	*path;
+
+		path = g_build_filename(*cdir, dir, NULL);
+
+		if (exists(path))
+			g_ptr_array_add(list, path);
+		else
+			g_free(path);
+	}
+
+	return list;
+}
+
 /****************************************************************
  *			INTERNAL FUNCTIONS			*
  ****************************************************************/
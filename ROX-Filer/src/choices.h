@@ -14,6 +14,7 @@ gchar 		*choices_find_xdg_path_load(const char *leaf, const char *dir,
 gchar	   	*choices_find_xdg_path_save(const char *leaf, const char *dir,
 					    const char *site, gboolean create);
 GPtrArray       *choices_list_xdg_dirs(char *dir, char *site);
+GPtrArray       *choices_list_load_dirs(char *dir, char *site);
 
 
 #endif /* _CHOICES_H */
@@ -1874,6 +1874,14 @@ void    collection_item_to_rowcol       (const Collection *collection,
 
 
 
+/* Set *first and *last to the first and last rows which are (at least
+ * partly) visible. The rows might not contain any items.
+ */
+void collection_get_visible_rows(Collection *collection, int *first, int *last)
+{
+	get_visible_limits(collection, first, last);
+}
+
 /* Translate the (row, column) form to the item number.
  * May return a number >= collection->number_of_items.
  */
@@ -160,6 +160,8 @@ void    collection_item_to_rowcol       (const Collection *collection,
 					 int item, int *row, int *col);
 int     collection_rowcol_to_item       (const Collection *collection,
 					 int row, int col);
+void	collection_get_visible_rows	(Collection *collection,
+					 int *first, int *last);
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
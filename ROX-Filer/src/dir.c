@@ -70,10 +70,15 @@
 #include "usericons.h"
 #include "main.h"
 #include "options.h"
+#include "xdgmime.h"
+#include "nameindex.h"
 
 /* For debugging. Can't detach when this is non-zero. */
 static int in_callback = 0;
 
+/* Number of directories with scanning set */
+static int n_scanning = 0;
+
 GFSCache *dir_cache = NULL;
 
 static Option o_close_dir_when_missing;
@@ -169,6 +174,9 @@ void dir_attach(Directory *dir, DirCallback callback, gpointer data)
 		callback(dir, DIR_ADD, items, data);
 	g_ptr_array_free(items, TRUE);
 
+	if (dir->mime_version != xdg_mime_get_database_version())
+		dir->needs_update = TRUE;
+
 	if (dir->needs_update && !dir->scanning)
 		dir_rescan(dir);
 	else
@@ -251,6 +259,28 @@ void dir_check_this(const guchar *path)
 	g_free(real_path);
 }
 
+/* Like dir_check_this(), for several items in one directory */
+void dir_check_these(const guchar *dir_path, GPtrArray *leaves)
+{
+	guchar	*real_path;
+	Directory *dir;
+	int	i;
+
+	real_path = pathdup(dir_path);
+
+	dir = g_fscache_lookup_full(dir_cache, real_path,
+					FSCACHE_LOOKUP_PEEK, NULL);
+	if (dir)
+	{
+		for (i = 0; i < leaves->len; i++)
+			dir_recheck(dir, real_path,
+				    g_ptr_array_index(leaves, i));
+		g_object_unref(dir);
+	}
+
+	g_free(real_path);
+}
+
 /* Used when we fork an action child, otherwise we can't delete or unmount
  * any directory which we're watching via dnotify!  inotify does not have
  * this problem
@@ -319,6 +349,14 @@ static void free_recheck_list(Directory *dir)
 	destroy_glist(&dir->recheck_list);
 }
 
+/* TRUE if any directory is being scanned. Background jobs can use this to
+ * keep out of the way.
+ */
+gboolean dir_any_scanning(void)
+{
+	return n_scanning > 0;
+}
+
 /* If scanning state has changed then notify all filer windows */
 static void dir_set_scanning(Directory *dir, gboolean scanning)
 {
@@ -330,6 +368,7 @@ static void dir_set_scanning(Directory *dir, gboolean scanning)
 	in_callback++;
 
 	dir->scanning = scanning;
+	n_scanning += scanning ? 1 : -1;
 
 	for (next = dir->users; next; next = next->next)
 	{
@@ -440,6 +479,9 @@ void dir_merge_new(Directory *dir)
 
 	in_callback--;
 
+	if (new->len)
+		name_index_add_items(dir->pathname, new);
+
 	for (i = 0; i < new->len; i++)
 	{
 		DirItem *item = (DirItem *) new->pdata[i];
@@ -838,6 +880,7 @@ static void directory_init(GTypeInstance *object, gpointer gclass)
 	dir->pathname = NULL;
 	dir->error = NULL;
 	dir->rescan_timeout = -1;
+	dir->mime_version = 0;
 
 	dir->new_items = g_ptr_array_new();
 	dir->up_items = g_ptr_array_new();
@@ -899,6 +942,7 @@ static void dir_rescan(Directory *dir)
 	pathname = dir->pathname;
 
 	dir->needs_update = FALSE;
+	dir->mime_version = xdg_mime_get_database_version();
 
 	names = g_ptr_array_new();
 
@@ -78,6 +78,11 @@ struct _Directory
 
 	gint		rescan_timeout;	/* See dir_rescan_soon() */
 
+	/* xdg_mime_get_database_version() at the last scan. If the MIME
+	 * database has been reloaded since, our items' types may be wrong.
+	 */
+	guint		mime_version;
+
 	GFileMonitor *monitor;
 };
 
@@ -89,10 +94,12 @@ void dir_detach(Directory *dir, DirCallback callback, gpointer data);
 void dir_update(Directory *dir, gchar *pathname);
 void refresh_dirs(const char *path);
 void dir_check_this(const guchar *path);
+void dir_check_these(const guchar *dir_path, GPtrArray *leaves);
 DirItem *dir_update_item(Directory *dir, const gchar *leafname);
 void dir_merge_new(Directory *dir);
 void dir_force_update_path(const gchar *path);
 void dir_drop_all_notifies(void);
 void dir_queue_recheck(Directory *dir, DirItem *item);
+gboolean dir_any_scanning(void);
 
 #endif /* _DIR_H */
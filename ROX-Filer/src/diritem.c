@@ -74,12 +74,18 @@ void diritem_restat(
 		struct stat *parent)
 {
 	struct stat	info;
+	int		xattrs = 0;
 
 	if (item->_image)
 	{
 		g_object_unref(item->_image);
 		item->_image = NULL;
 	}
+	if (item->label)
+	{
+		g_free(item->label);
+		item->label = NULL;
+	}
 	item->flags = 0;
 	item->mime_type = NULL;
 
@@ -108,11 +114,6 @@ void diritem_restat(
 		if (ABOUT_NOW(item->mtime) || ABOUT_NOW(item->ctime))
 			item->flags |= ITEM_FLAG_RECENT;
 
-		if (xattr_have(path))
-			item->flags |= ITEM_FLAG_HAS_XATTR;
-
-		item->label = xlabel_get(path);
-
 		if (S_ISLNK(info.st_mode))
 		{
 			if (mc_stat(path, &info))
@@ -131,6 +132,17 @@ void diritem_restat(
 			target_path = (guchar *) path;
 		}
 
+		/* (info is for the target now, which is what the xattr
+		 * calls look at)
+		 */
+		xattrs = xattr_scan(path,
+				item->base_type == TYPE_ERROR ? NULL : &info);
+		if (xattrs & XATTR_SCAN_ANY)
+			item->flags |= ITEM_FLAG_HAS_XATTR;
+
+		if (xattrs & XATTR_SCAN_LABEL)
+			item->label = xlabel_get(path);
+
 		if (item->base_type == TYPE_DIRECTORY)
 		{
 			if (mount_is_mounted(target_path, &info,
@@ -162,13 +174,15 @@ void diritem_restat(
 		{
 			guchar *link_path;
 			link_path = pathdup(path);
-			item->mime_type = type_from_path(link_path
+			item->mime_type = type_from_path_full(link_path
 					? link_path
-					: path);
+					: path,
+					xattrs & XATTR_SCAN_MIME_TYPE);
 			g_free(link_path);
 		}
 		else
-			item->mime_type = type_from_path(path);
+			item->mime_type = type_from_path_full(path,
+					xattrs & XATTR_SCAN_MIME_TYPE);
 
 		/* Note: for symlinks we need the mode of the target */
 		if (info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))
@@ -142,6 +142,8 @@ static void filer_add_signals(FilerWindow *filer_window);
 static void set_selection_state(FilerWindow *filer_window, gboolean normal);
 static void filer_next_thumb(GObject *window, const gchar *path);
 static void start_thumb_scanning(FilerWindow *filer_window);
+static void thumb_scroll_changed(GtkRange *range, FilerWindow *filer_window);
+static void thumb_queue_clear(FilerWindow *filer_window);
 static void filer_options_changed(void);
 static void drag_end(GtkWidget *widget, GdkDragContext *context,
 		     FilerWindow *filer_window);
@@ -448,7 +450,7 @@ static void update_display(Directory *dir,
 
 			filer_create_thumbs(filer_window);
 
-			if (filer_window->thumb_queue)
+			if (filer_window->thumb_heap->len)
 				start_thumb_scanning(filer_window);
 			break;
 		case DIR_UPDATE:
@@ -735,8 +737,13 @@ static void filer_window_destroyed(GtkWidget *widget, FilerWindow *filer_window)
 		filer_window->auto_scroll = -1;
 	}
 
-	if (filer_window->thumb_queue)
-		destroy_glist(&filer_window->thumb_queue);
+	g_signal_handlers_disconnect_by_func(filer_window->scrollbar,
+			thumb_scroll_changed, filer_window);
+	thumb_queue_clear(filer_window);
+	if (filer_window->thumb_reorder_timeout)
+		g_source_remove(filer_window->thumb_reorder_timeout);
+	g_hash_table_destroy(filer_window->thumb_queue);
+	g_ptr_array_free(filer_window->thumb_heap, TRUE);
 
 	tooltip_show(NULL);
 
@@ -1527,8 +1534,11 @@ FilerWindow *filer_opendir(const char *path, FilerWindow *src_win,
 	filer_window->details_type = DETAILS_TIMES;
 	filer_window->display_style = UNKNOWN_STYLE;
 	filer_window->display_style_wanted = UNKNOWN_STYLE;
-	filer_window->thumb_queue = NULL;
+	filer_window->thumb_queue = g_hash_table_new(g_str_hash, g_str_equal);
+	filer_window->thumb_heap = g_ptr_array_new();
 	filer_window->max_thumbs = 0;
+	filer_window->thumbs_running = 0;
+	filer_window->thumb_reorder_timeout = 0;
 	filer_window->sort_type = -1;
 
 	filer_window->filter = FILER_SHOW_ALL;
@@ -1771,6 +1781,8 @@ static void filer_add_widgets(FilerWindow *filer_window, const gchar *wm_class)
 
 	/* Create this now to make the Adjustment before the View */
 	filer_window->scrollbar = gtk_vscrollbar_new(NULL);
+	g_signal_connect(filer_window->scrollbar, "value-changed",
+			 G_CALLBACK(thumb_scroll_changed), filer_window);
 
 	vbox = gtk_vbox_new(FALSE, 0);
 	gtk_container_add(GTK_CONTAINER(filer_window->window), vbox);
@@ -1941,6 +1953,7 @@ void filer_update_all(void)
 void full_refresh(void)
 {
 	mount_update(TRUE);
+	xattr_forget_filesystems();
 	reread_mime_files();	/* Refreshes all windows */
 }
 
@@ -2245,54 +2258,260 @@ static void set_selection_state(FilerWindow *filer_window, gboolean normal)
 		gtk_widget_queue_draw(GTK_WIDGET(filer_window->view));
 }
 
+/* Thumbnail scheduling.
+ *
+ * Each window has a queue of thumbnails to make. It's a binary heap, so
+ * that the job nearest to the visible part of the window can be taken
+ * quickly, plus a hash table for finding jobs by path. When the window is
+ * scrolled, the distances are worked out again.
+ */
+typedef struct _ThumbJob ThumbJob;
+
+struct _ThumbJob {
+	gchar	*path;
+	int	distance;	/* From the visible area, in rows */
+	int	order;		/* Position in the batch, for ties */
+};
+
+static gboolean thumb_job_before(ThumbJob *a, ThumbJob *b)
+{
+	if (a->distance != b->distance)
+		return a->distance < b->distance;
+	return a->order < b->order;
+}
+
+static void thumb_heap_swap(GPtrArray *heap, guint a, guint b)
+{
+	gpointer tmp = heap->pdata[a];
+
+	heap->pdata[a] = heap->pdata[b];
+	heap->pdata[b] = tmp;
+}
+
+static void thumb_heap_sift_down(GPtrArray *heap, guint i)
+{
+	while (1)
+	{
+		guint best = i, left = 2 * i + 1, right = left + 1;
+
+		if (left < heap->len &&
+		    thumb_job_before(heap->pdata[left], heap->pdata[best]))
+			best = left;
+		if (right < heap->len &&
+		    thumb_job_before(heap->pdata[right], heap->pdata[best]))
+			best = right;
+		if (best == i)
+			return;
+
+		thumb_heap_swap(heap, i, best);
+		i = best;
+	}
+}
+
+static void thumb_heap_sift_up(GPtrArray *heap, guint i)
+{
+	while (i > 0)
+	{
+		guint parent = (i - 1) / 2;
+
+		if (!thumb_job_before(heap->pdata[i], heap->pdata[parent]))
+			return;
+
+		thumb_heap_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+/* Add 'path' to the queue, unless it's already there. Returns TRUE if
+ * added.
+ */
+static gboolean thumb_queue_add(FilerWindow *filer_window,
+				const gchar *path, int distance)
+{
+	GPtrArray *heap = filer_window->thumb_heap;
+	ThumbJob *job;
+
+	if (g_hash_table_lookup(filer_window->thumb_queue, path))
+		return FALSE;
+
+	if (!heap->len && !filer_window->thumbs_running)
+		filer_window->max_thumbs = 0;
+	filer_window->max_thumbs++;
+
+	job = g_new(ThumbJob, 1);
+	job->path = g_strdup(path);
+	job->distance = distance;
+	job->order = filer_window->max_thumbs;
+
+	g_hash_table_insert(filer_window->thumb_queue, job->path, job);
+	g_ptr_array_add(heap, job);
+	thumb_heap_sift_up(heap, heap->len - 1);
+
+	return TRUE;
+}
+
+/* Remove the most urgent job from the queue and return it (or NULL if the
+ * queue is empty). g_free() job->path and job afterwards.
+ */
+static ThumbJob *thumb_queue_pop(FilerWindow *filer_window)
+{
+	GPtrArray *heap = filer_window->thumb_heap;
+	ThumbJob *job, *last;
+
+	if (!heap->len)
+		return NULL;
+
+	job = heap->pdata[0];
+	last = g_ptr_array_remove_index(heap, heap->len - 1);
+	if (heap->len)
+	{
+		heap->pdata[0] = last;
+		thumb_heap_sift_down(heap, 0);
+	}
+
+	g_hash_table_remove(filer_window->thumb_queue, job->path);
+
+	return job;
+}
+
+static void thumb_queue_clear(FilerWindow *filer_window)
+{
+	ThumbJob *job;
+
+	while ((job = thumb_queue_pop(filer_window)))
+	{
+		g_free(job->path);
+		g_free(job);
+	}
+}
+
+/* Work out how far each queued item is from the visible area again */
+static void thumb_queue_reorder(FilerWindow *filer_window)
+{
+	GPtrArray *heap = filer_window->thumb_heap;
+	DirItem	*item;
+	ViewIter iter;
+	guint	i;
+
+	if (!heap->len)
+		return;
+
+	view_get_iter(filer_window->view, &iter, 0);
+	while ((item = iter.next(&iter)))
+	{
+		ThumbJob *job;
+
+		job = g_hash_table_lookup(filer_window->thumb_queue,
+			make_path(filer_window->real_path, item->leafname));
+		if (job)
+			job->distance = view_visible_distance(
+						filer_window->view, &iter);
+	}
+
+	for (i = heap->len / 2; i > 0; i--)
+		thumb_heap_sift_down(heap, i - 1);
+}
+
+static gboolean thumb_reorder_timeout(gpointer data)
+{
+	FilerWindow *filer_window = (FilerWindow *) data;
+
+	filer_window->thumb_reorder_timeout = 0;
+	thumb_queue_reorder(filer_window);
+
+	return FALSE;
+}
+
+/* The window has been scrolled. Once it stops, make thumbnails for the
+ * newly visible items first.
+ */
+static void thumb_scroll_changed(GtkRange *range, FilerWindow *filer_window)
+{
+	if (!filer_window->thumb_heap->len)
+		return;
+
+	if (filer_window->thumb_reorder_timeout)
+		g_source_remove(filer_window->thumb_reorder_timeout);
+	filer_window->thumb_reorder_timeout =
+		g_timeout_add(200, thumb_reorder_timeout, filer_window);
+}
+
+/* Forget all queued thumbnails (those already being made will finish) */
 void filer_cancel_thumbnails(FilerWindow *filer_window)
 {
 	gtk_widget_hide(filer_window->thumb_bar);
 
-	destroy_glist(&filer_window->thumb_queue);
+	thumb_queue_clear(filer_window);
 	filer_window->max_thumbs = 0;
+
+	if (filer_window->thumb_reorder_timeout)
+	{
+		g_source_remove(filer_window->thumb_reorder_timeout);
+		filer_window->thumb_reorder_timeout = 0;
+	}
 }
 
-/* Generate the next thumb for this window. The window object is
- * unref'd when there is nothing more to do.
- * If the window no longer has a filer window, nothing is done.
+/* Start making thumbnails from the queue, until pixmap_thumb_jobs() are
+ * being made at once. Each one holds a ref on the window until it's done.
  */
-static gboolean filer_next_thumb_real(GObject *window)
+static void filer_start_thumbs(FilerWindow *filer_window)
 {
-	FilerWindow *filer_window;
-	gchar	*path;
-	int	done, total;
-
-	filer_window = g_object_get_data(window, "filer_window");
+	GObject	*window = G_OBJECT(filer_window->window);
+	ThumbJob *job;
+	gchar	*text;
+	int	done, total, left;
 
-	if (!filer_window)
+	while (filer_window->thumbs_running < pixmap_thumb_jobs() &&
+	       (job = thumb_queue_pop(filer_window)))
 	{
-		g_object_unref(window);
-		return FALSE;
+		filer_window->thumbs_running++;
+		g_object_ref(window);
+		pixmap_background_thumb(job->path, (GFunc) filer_next_thumb,
+					window);
+		g_free(job->path);
+		g_free(job);
 	}
 
-	if (!filer_window->thumb_queue)
+	left = filer_window->thumb_heap->len + filer_window->thumbs_running;
+	if (left == 0)
 	{
 		filer_cancel_thumbnails(filer_window);
-		g_object_unref(window);
-		return FALSE;
+		return;
 	}
 
 	total = filer_window->max_thumbs;
-	done = total - g_list_length(filer_window->thumb_queue);
-
-	path = (gchar *) filer_window->thumb_queue->data;
-
-	pixmap_background_thumb(path, (GFunc) filer_next_thumb, window);
-
-	filer_window->thumb_queue = g_list_remove(filer_window->thumb_queue,
-						  path);
-	g_free(path);
+	if (total == 0)
+		return;		/* Cancelled; just waiting for the last few */
+	done = total - left;
 
 	gtk_progress_bar_set_fraction(
 			GTK_PROGRESS_BAR(filer_window->thumb_progress),
 			done / (float) total);
 
+	text = g_strdup_printf(_("%d thumbnails to do"), left);
+	gtk_progress_bar_set_text(
+			GTK_PROGRESS_BAR(filer_window->thumb_progress), text);
+	g_free(text);
+}
+
+/* One thumbnail has finished; start another. The window object is
+ * unref'd.
+ * If the window no longer has a filer window, nothing is done.
+ */
+static gboolean filer_next_thumb_real(GObject *window)
+{
+	FilerWindow *filer_window;
+
+	filer_window = g_object_get_data(window, "filer_window");
+
+	if (filer_window)
+	{
+		filer_window->thumbs_running--;
+		filer_start_thumbs(filer_window);
+	}
+
+	g_object_unref(window);
+
 	return FALSE;
 }
 
@@ -2309,29 +2528,20 @@ static void filer_next_thumb(GObject *window, const gchar *path)
 
 static void start_thumb_scanning(FilerWindow *filer_window)
 {
-	if (GTK_WIDGET_VISIBLE(filer_window->thumb_bar))
-		return;		/* Already scanning */
-
-	gtk_widget_show_all(filer_window->thumb_bar);
+	if (!GTK_WIDGET_VISIBLE(filer_window->thumb_bar))
+		gtk_widget_show_all(filer_window->thumb_bar);
 
-	g_object_ref(G_OBJECT(filer_window->window));
-	filer_next_thumb(G_OBJECT(filer_window->window), NULL);
+	filer_start_thumbs(filer_window);
 }
 
-/* Set this image to be loaded some time in the future */
+/* Set this image to be loaded some time in the future (but before the
+ * ones queued by filer_create_thumbs() which aren't visible).
+ */
 void filer_create_thumb(FilerWindow *filer_window, const gchar *path)
 {
-	if (g_list_find_custom(filer_window->thumb_queue, path,
-			       (GCompareFunc) strcmp))
+	if (!thumb_queue_add(filer_window, path, 0))
 		return;
 
-	if (!filer_window->thumb_queue)
-		filer_window->max_thumbs=0;
-	filer_window->max_thumbs++;
-
-	filer_window->thumb_queue = g_list_append(filer_window->thumb_queue,
-						  g_strdup(path));
-
 	if (filer_window->scanning)
 		return;			/* Will start when scan ends */
 
@@ -2339,12 +2549,14 @@ void filer_create_thumb(FilerWindow *filer_window, const gchar *path)
 }
 
 /* If thumbnail display is on, look through all the items in this directory
- * and start creating or updating the thumbnails as needed.
+ * and start creating or updating the thumbnails as needed. Items nearest
+ * the visible area are done first.
  */
 void filer_create_thumbs(FilerWindow *filer_window)
 {
 	DirItem *item;
 	ViewIter iter;
+	gboolean added = FALSE;
 
 	if (!filer_window->show_thumbs)
 		return;
@@ -2379,9 +2591,14 @@ void filer_create_thumbs(FilerWindow *filer_window)
 		 * - We haven't tried loading the image. found is
 		 *   FALSE, and we start creating the thumb here.
 		 */
-		if (!found)
-			filer_create_thumb(filer_window, path);
+		if (!found && thumb_queue_add(filer_window, path,
+				view_visible_distance(filer_window->view,
+						      &iter)))
+			added = TRUE;
 	}
+
+	if (added && !filer_window->scanning)
+		start_thumb_scanning(filer_window);
 }
 
 static void filer_options_changed(void)
@@ -113,9 +113,12 @@ struct _FilerWindow
 	GtkStateType	selection_state;	/* for drawing selection */
 
 	gboolean	show_thumbs;
-	GList		*thumb_queue;		/* paths to thumbnail */
+	GHashTable	*thumb_queue;		/* path -> ThumbJob */
+	GPtrArray	*thumb_heap;		/* ThumbJobs, most urgent first */
 	GtkWidget	*thumb_bar, *thumb_progress;
 	int		max_thumbs;		/* total for this batch */
+	int		thumbs_running;		/* being made right now */
+	gint		thumb_reorder_timeout;	/* after scrolling */
 
 	gint		auto_scroll;		/* Timer */
 
@@ -57,6 +57,12 @@ static Eval *parse_eval(const gchar **expression);
 static Eval *parse_variable(const gchar **expression);
 
 static gboolean match(const gchar **expression, const gchar *word);
+static guint condition_needs(FindCondition *condition);
+static guint eval_needs(Eval *eval);
+static GPtrArray *condition_literals(FindCondition *condition);
+static gchar *pattern_literal(const gchar *pattern, gboolean path);
+static double get_constant(Eval *eval, FindInfo *info);
+static double get_var(Eval *eval, FindInfo *info);
 
 typedef enum {
 	IS_DIR,
@@ -180,6 +186,35 @@ gboolean find_test_condition(FindCondition *condition, FindInfo *info)
 	return condition->test(condition, info);
 }
 
+/* Returns a set of FIND_NEEDS_* flags. The caller may leave out anything
+ * else when filling in a FindInfo; eg, a condition which only looks at
+ * names needs no stat() call.
+ */
+guint find_condition_needs(FindCondition *condition)
+{
+	g_return_val_if_fail(condition != NULL, 0);
+
+	return condition_needs(condition);
+}
+
+/* Returns a list of strings, at least one of which appears in the leafname
+ * of anything that 'condition' matches; eg, "foo" for "'*foo*.c'". NULL if
+ * we can't tell, eg for "IsDir" or "Not 'foo'". g_strfreev() the result.
+ */
+gchar **find_condition_literals(FindCondition *condition)
+{
+	GPtrArray *literals;
+
+	g_return_val_if_fail(condition != NULL, NULL);
+
+	literals = condition_literals(condition);
+	if (!literals)
+		return NULL;
+
+	g_ptr_array_add(literals, NULL);
+	return (gchar **) g_ptr_array_free(literals, FALSE);
+}
+
 void find_condition_free(FindCondition *condition)
 {
 	if (condition)
@@ -438,6 +473,179 @@ static gboolean test_xattr(FindCondition *condition, FindInfo *info) {
 }
 #endif
 
+/*				NEEDS CODE				*/
+
+static guint condition_needs(FindCondition *condition)
+{
+	FindTest test = condition->test;
+
+	if (test == test_OR || test == test_AND)
+		return condition_needs(condition->data1) |
+		       condition_needs(condition->data2);
+	else if (test == test_neg)
+		return condition_needs(condition->data1);
+	else if (test == test_leaf || test == test_path)
+		return 0;
+	else if (test == test_prune)
+		return FIND_NEEDS_WALK;
+	else if (test == test_comp)
+		return eval_needs(condition->data1) |
+		       eval_needs(condition->data2);
+	else if (test == test_is)
+	{
+		switch ((IsTest) condition->value)
+		{
+			case IS_DIR: case IS_REG: case IS_LNK:
+			case IS_FIFO: case IS_SOCK: case IS_CHR:
+			case IS_BLK: case IS_DEV: case IS_DOOR:
+				return FIND_NEEDS_TYPE;
+			case IS_READABLE: case IS_WRITEABLE: case IS_EXEC:
+				return 0;
+			case HAS_XATTR:
+				/* xattr_have() uses a static buffer */
+				return FIND_NEEDS_SERIAL;
+			default:
+				return FIND_NEEDS_STAT;
+		}
+	}
+
+	/* system() and extended attributes, or something new. Assume
+	 * the worst.
+	 */
+	return FIND_NEEDS_STAT | FIND_NEEDS_NOW | FIND_NEEDS_SERIAL;
+}
+
+static guint eval_needs(Eval *eval)
+{
+	if (eval->calc == get_var)
+		return FIND_NEEDS_STAT;
+	else if (eval->calc == get_constant &&
+		 GPOINTER_TO_INT(eval->data2) & (FLAG_AGO | FLAG_HENCE))
+		return FIND_NEEDS_NOW;
+	return 0;
+}
+
+/*				LITERALS CODE				*/
+
+static GPtrArray *condition_literals(FindCondition *condition)
+{
+	FindTest  test = condition->test;
+	GPtrArray *first, *second;
+	gchar	  *literal;
+	guint	  i;
+
+	if (test == test_leaf || test == test_path)
+	{
+		literal = pattern_literal(condition->data1, test == test_path);
+		if (!literal)
+			return NULL;
+		first = g_ptr_array_new();
+		g_ptr_array_add(first, literal);
+		return first;
+	}
+	else if (test != test_OR && test != test_AND)
+		return NULL;
+
+	first = condition_literals(condition->data1);
+	second = condition_literals(condition->data2);
+
+	if (test == test_AND)
+	{
+		/* Either side will do. Use the one with fewer choices. */
+		if (!first || (second && second->len < first->len))
+		{
+			GPtrArray *tmp = first;
+
+			first = second;
+			second = tmp;
+		}
+	}
+	else if (first && second)
+	{
+		/* Could be either */
+		for (i = 0; i < second->len; i++)
+			g_ptr_array_add(first, second->pdata[i]);
+		g_ptr_array_set_size(second, 0);
+	}
+	else if (first)
+	{
+		/* 'second' could match anything */
+		second = first;
+		first = NULL;
+	}
+
+	if (second)
+	{
+		for (i = 0; i < second->len; i++)
+			g_free(second->pdata[i]);
+		g_ptr_array_free(second, TRUE);
+	}
+
+	return first;
+}
+
+/* Returns the longest run of ordinary characters in the part of 'pattern'
+ * that matches the leafname, or NULL if there are none.
+ */
+static gchar *pattern_literal(const gchar *pattern, gboolean path)
+{
+	GString	*run, *best;
+	const gchar *p;
+
+	if (path)
+	{
+		p = strrchr(pattern, '/');
+		if (p)
+			pattern = p + 1;
+	}
+
+	run = g_string_new(NULL);
+	best = g_string_new(NULL);
+
+	for (p = pattern; ; p++)
+	{
+		if (*p == '\\' && p[1])
+		{
+			g_string_append_c(run, *++p);
+			continue;
+		}
+		else if (*p && *p != '*' && *p != '?' && *p != '[')
+		{
+			g_string_append_c(run, *p);
+			continue;
+		}
+
+		if (run->len > best->len)
+			g_string_assign(best, run->str);
+		g_string_truncate(run, 0);
+
+		if (*p == '\0')
+			break;
+		else if (*p == '[')
+		{
+			/* Skip the set. A ']' first is part of it. */
+			const gchar *end = p + 1;
+
+			if (*end == '!' || *end == '^')
+				end++;
+			if (*end == ']')
+				end++;
+			end = strchr(end, ']');
+			if (end)
+				p = end;
+		}
+	}
+
+	g_string_free(run, TRUE);
+	if (best->len == 0)
+	{
+		g_string_free(best, TRUE);
+		return NULL;
+	}
+
+	return g_string_free(best, FALSE);
+}
+
 /*				FREEING CODE				*/
 
 /* Frees the structure and g_free()s both data items (NULL is OK) */
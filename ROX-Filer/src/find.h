@@ -20,6 +20,17 @@ struct _FindInfo
 	gboolean	prune;
 };
 
+/* Which fields of FindInfo a condition looks at, besides the names */
+enum {
+	FIND_NEEDS_TYPE	  = 1 << 0,	/* The S_IFMT bits of stats.st_mode */
+	FIND_NEEDS_STAT	  = 1 << 1,	/* Everything in stats */
+	FIND_NEEDS_NOW	  = 1 << 2,	/* now */
+	FIND_NEEDS_SERIAL = 1 << 3,	/* Don't test in several threads */
+	FIND_NEEDS_WALK	  = 1 << 4,	/* Uses prune; test parents first */
+};
+
 FindCondition *find_compile(const gchar *string);
 gboolean find_test_condition(FindCondition *condition, FindInfo *info);
+guint find_condition_needs(FindCondition *condition);
+gchar **find_condition_literals(FindCondition *condition);
 void find_condition_free(FindCondition *condition);
@@ -28,12 +28,16 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "global.h"
 
 #include "fscache.h"
 
 typedef struct _GFSCacheKey GFSCacheKey;
 typedef struct _GFSCacheData GFSCacheData;
+typedef struct _GFSCachePolicy GFSCachePolicy;
+typedef struct _GFSCachePath GFSCachePath;
 
 struct _GFSCache
 {
@@ -41,6 +45,41 @@ struct _GFSCache
 	GFSLoadFunc	load;
 	GFSUpdateFunc	update;
 	gpointer	user_data;
+
+	/* Least recently looked-up entries are at the tail */
+	GQueue		*lru;
+
+	/* Optional memory budget (see g_fscache_set_budget()) */
+	GFSSizeFunc	size;
+	gsize		budget;		/* 0 for no limit */
+	gsize		total_size;	/* Sum of the entries' sizes */
+	GHashTable	*objects;	/* GObject -> GFSCacheData */
+
+	guint		hits, misses, evictions;
+
+	/* Directories whose files needn't be stat()ed on every lookup */
+	GList		*policies;
+
+	/* Paths under those directories, with the entry they found last
+	 * time (pathname -> GFSCachePath).
+	 */
+	GHashTable	*trusted;
+};
+
+struct _GFSCachePolicy
+{
+	gchar		*dir;		/* No trailing slash */
+	int		dir_len;
+	FSCacheCheck	check;
+	gint		seconds;	/* For FSCACHE_CHECK_AFTER */
+};
+
+struct _GFSCachePath
+{
+	gchar		*path;		/* Key in the trusted table */
+	GFSCacheData	*data;
+	GFSCachePolicy	*policy;
+	time_t		checked;	/* When we last stat()ed it */
 };
 
 struct _GFSCacheKey
@@ -54,6 +93,11 @@ struct _GFSCacheData
 	GObject		*data;		/* The object from the file */
 	time_t		last_lookup;
 
+	GFSCacheKey	*key;		/* Our key in inode_to_stats */
+	GList		*lru_link;	/* Our link in the cache's lru queue */
+	gsize		size;		/* From cache->size, or 0 */
+	GSList		*paths;		/* GFSCachePaths which lead here */
+
 	/* Details of the file last time we checked it */
 	time_t		m_time, c_time;
 	off_t		length;
@@ -74,6 +118,16 @@ static gint cmp_stats(gconstpointer a, gconstpointer b);
 static void destroy_hash_entry(gpointer key, gpointer data, gpointer user_data);
 static gboolean purge_hash_entry(gpointer key, gpointer data,
 				 gpointer user_data);
+static void free_entry(GFSCache *cache, GFSCacheData *data);
+static void set_data(GFSCache *cache, GFSCacheData *data, GObject *obj);
+static void update_size(GFSCache *cache, GFSCacheData *data);
+static void enforce_budget(GFSCache *cache, GFSCacheData *keep);
+static void free_trusted(gpointer data);
+static gboolean invalidate_path(gpointer key, gpointer value, gpointer data);
+static gboolean still_trusted(GFSCachePath *trusted, time_t now);
+static void trust_path(GFSCache *cache, GFSCacheData *data,
+		       const char *pathname, time_t now);
+static gboolean is_under(const char *pathname, const char *dir, int dir_len);
 static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
 					FSCacheLookup lookup_type);
 
@@ -115,15 +169,180 @@ GFSCache *g_fscache_new(GFSLoadFunc load,
 	cache->update = update;
 	cache->user_data = user_data;
 
+	cache->lru = g_queue_new();
+
+	cache->size = NULL;
+	cache->budget = 0;
+	cache->total_size = 0;
+	cache->objects = g_hash_table_new(NULL, NULL);
+
+	cache->hits = cache->misses = cache->evictions = 0;
+
+	cache->policies = NULL;
+	cache->trusted = g_hash_table_new_full(g_str_hash, g_str_equal,
+					       NULL, free_trusted);
+
 	return cache;
 }
 
+/* Choose how files inside 'dir' are checked for changes on lookup:
+ *
+ * FSCACHE_CHECK_STAT: stat() the file every time (the default).
+ * FSCACHE_CHECK_AFTER: once a path has been looked up, trust it (without
+ *	calling stat()) for 'seconds' seconds.
+ * FSCACHE_CHECK_MONITOR: trust it until g_fscache_invalidate() is called
+ *	for it. Use this if you're monitoring the directory anyway.
+ *
+ * The cheaper policies are for things like icon themes, which are looked up
+ * often and hardly ever change. The most specific directory wins.
+ */
+void g_fscache_set_policy(GFSCache *cache, const char *dir,
+			  FSCacheCheck check, gint seconds)
+{
+	GFSCachePolicy *policy = NULL;
+	GList	*next;
+	gchar	*clean;
+	int	len;
+
+	g_return_if_fail(cache != NULL);
+	g_return_if_fail(dir != NULL && dir[0] == '/');
+
+	clean = g_strdup(dir);
+	len = strlen(clean);
+	while (len > 1 && clean[len - 1] == '/')
+		clean[--len] = '\0';
+
+	/* Anything trusted under the old policy must be checked again */
+	g_fscache_invalidate(cache, clean);
+
+	for (next = cache->policies; next; next = next->next)
+	{
+		GFSCachePolicy *p = (GFSCachePolicy *) next->data;
+
+		if (strcmp(p->dir, clean) == 0)
+		{
+			policy = p;
+			break;
+		}
+	}
+
+	if (check == FSCACHE_CHECK_STAT)
+	{
+		if (policy)
+		{
+			cache->policies = g_list_remove(cache->policies,
+							policy);
+			g_free(policy->dir);
+			g_free(policy);
+		}
+		g_free(clean);
+		return;
+	}
+
+	if (policy)
+		g_free(clean);
+	else
+	{
+		policy = g_new(GFSCachePolicy, 1);
+		policy->dir = clean;
+		policy->dir_len = len;
+		cache->policies = g_list_prepend(cache->policies, policy);
+	}
+
+	policy->check = check;
+	policy->seconds = seconds;
+}
+
+/* Forget that 'pathname', and everything under it, is trusted. The next
+ * lookup of each will stat() it again.
+ */
+void g_fscache_invalidate(GFSCache *cache, const char *pathname)
+{
+	g_return_if_fail(cache != NULL);
+	g_return_if_fail(pathname != NULL);
+
+	if (g_hash_table_size(cache->trusted) == 0)
+		return;
+
+	g_hash_table_foreach_remove(cache->trusted, invalidate_path,
+				    (gpointer) pathname);
+}
+
+/* Limit the memory used by the cache. size(object, user_data) returns the
+ * number of bytes used by an object; it's called when the object is added
+ * or updated. Whenever the total goes over 'budget', the least recently
+ * looked-up entries are dropped until it fits again. Objects that are
+ * also in use elsewhere are kept (dropping them wouldn't free anything).
+ * A budget of 0 means no limit (the default).
+ */
+void g_fscache_set_budget(GFSCache *cache, GFSSizeFunc size, gsize budget)
+{
+	GList	*next;
+
+	g_return_if_fail(cache != NULL);
+	g_return_if_fail(size != NULL || budget == 0);
+
+	cache->size = size;
+	cache->budget = budget;
+
+	for (next = cache->lru->head; next; next = next->next)
+		update_size(cache, (GFSCacheData *) next->data);
+
+	enforce_budget(cache, NULL);
+}
+
+/* Call this when 'object' has grown or shrunk since it was loaded, eg
+ * because more versions of an image have been made. Objects that aren't in
+ * the cache are ignored.
+ */
+void g_fscache_update_size(GFSCache *cache, gpointer object)
+{
+	GFSCacheData *data;
+
+	g_return_if_fail(cache != NULL);
+
+	data = g_hash_table_lookup(cache->objects, object);
+	if (!data)
+		return;
+
+	update_size(cache, data);
+	enforce_budget(cache, data);
+}
+
+/* Fill in 'stats' with the current usage and the hit, miss and eviction
+ * counts since the cache was created.
+ */
+void g_fscache_get_stats(GFSCache *cache, GFSCacheStats *stats)
+{
+	g_return_if_fail(cache != NULL);
+	g_return_if_fail(stats != NULL);
+
+	stats->entries = g_queue_get_length(cache->lru);
+	stats->size = cache->total_size;
+	stats->budget = cache->budget;
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+}
+
 void g_fscache_destroy(GFSCache *cache)
 {
 	g_return_if_fail(cache != NULL);
 
-	g_hash_table_foreach(cache->inode_to_stats, destroy_hash_entry, NULL);
+	g_hash_table_foreach(cache->inode_to_stats, destroy_hash_entry, cache);
 	g_hash_table_destroy(cache->inode_to_stats);
+	g_hash_table_destroy(cache->trusted);
+	g_hash_table_destroy(cache->objects);
+	g_queue_free(cache->lru);
+
+	while (cache->policies)
+	{
+		GFSCachePolicy *policy = (GFSCachePolicy *) cache->policies->data;
+
+		cache->policies = g_list_remove(cache->policies, policy);
+		g_free(policy->dir);
+		g_free(policy);
+	}
 
 	g_free(cache);
 }
@@ -163,9 +382,9 @@ void g_fscache_insert(GFSCache *cache, const char *pathname, gpointer obj,
 
 	if (obj)
 		g_object_ref(obj);
-	if (data->data)
-		g_object_unref(data->data);
-	data->data = obj;
+	set_data(cache, data, obj);
+
+	enforce_budget(cache, data);
 }
 
 /* As g_fscache_lookup, but 'lookup_type' controls what happens if the data
@@ -225,6 +444,7 @@ void g_fscache_may_update(GFSCache *cache, const char *pathname)
 	if (data && !UPTODATE(data, info))
 	{
 		cache->update(data->data, pathname, cache->user_data);
+		update_size(cache, data);
 		data->m_time = info.st_mtime;
 		data->c_time = info.st_ctime;
 		data->length = info.st_size;
@@ -254,6 +474,7 @@ void g_fscache_update(GFSCache *cache, const char *pathname)
 	if (data)
 	{
 		cache->update(data->data, pathname, cache->user_data);
+		update_size(cache, data);
 		data->m_time = info.st_mtime;
 		data->c_time = info.st_ctime;
 		data->length = info.st_size;
@@ -303,13 +524,7 @@ static gint cmp_stats(gconstpointer a, gconstpointer b)
 
 static void destroy_hash_entry(gpointer key, gpointer data, gpointer user_data)
 {
-	GFSCacheData *cache_data = (GFSCacheData *) data;
-
-	if (cache_data->data)
-		g_object_unref(cache_data->data);
-
-	g_free(key);
-	g_free(data);
+	free_entry((GFSCache *) user_data, (GFSCacheData *) data);
 }
 
 static gboolean purge_hash_entry(gpointer key, gpointer data,
@@ -326,13 +541,175 @@ static gboolean purge_hash_entry(gpointer key, gpointer data,
 		&& cache_data->last_lookup >= info->now - info->age)
 		return FALSE;
 
-	if (cache_data->data)
-		g_object_unref(cache_data->data);
+	free_entry(info->cache, cache_data);
 
-	g_free(key);
+	return TRUE;
+}
+
+/* Free an entry which has been (or is being) removed from inode_to_stats */
+static void free_entry(GFSCache *cache, GFSCacheData *data)
+{
+	set_data(cache, data, NULL);
+
+	/* (free_trusted() removes each one from the list) */
+	while (data->paths)
+		g_hash_table_remove(cache->trusted,
+			((GFSCachePath *) data->paths->data)->path);
+
+	g_queue_delete_link(cache->lru, data->lru_link);
+
+	g_free(data->key);
 	g_free(data);
+}
 
-	return TRUE;
+/* Replace the entry's object with 'obj' (whose ref we take over) */
+static void set_data(GFSCache *cache, GFSCacheData *data, GObject *obj)
+{
+	if (data->data)
+	{
+		if (g_hash_table_lookup(cache->objects, data->data) == data)
+			g_hash_table_remove(cache->objects, data->data);
+		g_object_unref(data->data);
+	}
+	data->data = obj;
+	if (obj)
+		g_hash_table_insert(cache->objects, obj, data);
+
+	update_size(cache, data);
+}
+
+/* The object may have changed size; recalculate it */
+static void update_size(GFSCache *cache, GFSCacheData *data)
+{
+	cache->total_size -= data->size;
+
+	if (data->data && cache->size)
+		data->size = cache->size(data->data, cache->user_data);
+	else
+		data->size = 0;
+
+	cache->total_size += data->size;
+}
+
+/* Drop least recently used entries until we're within budget.
+ * 'keep' is about to be returned, so don't drop that one.
+ */
+static void enforce_budget(GFSCache *cache, GFSCacheData *keep)
+{
+	GList	*link, *prev;
+
+	if (cache->budget == 0)
+		return;
+
+	for (link = cache->lru->tail;
+	     link && cache->total_size > cache->budget;
+	     link = prev)
+	{
+		GFSCacheData *data = (GFSCacheData *) link->data;
+
+		prev = link->prev;
+
+		/* Entries without objects cost nothing (and may mean that
+		 * the object is still being created), and in-use objects
+		 * won't be freed anyway.
+		 */
+		if (data == keep || data->size == 0 ||
+		    data->data->ref_count > 1)
+			continue;
+
+		g_hash_table_remove(cache->inode_to_stats, data->key);
+		free_entry(cache, data);
+		cache->evictions++;
+	}
+}
+
+static void free_trusted(gpointer data)
+{
+	GFSCachePath *trusted = (GFSCachePath *) data;
+
+	trusted->data->paths = g_slist_remove(trusted->data->paths, trusted);
+
+	g_free(trusted->path);
+	g_free(trusted);
+}
+
+static gboolean invalidate_path(gpointer key, gpointer value, gpointer data)
+{
+	const char *pathname = (const char *) data;
+
+	return is_under((const char *) key, pathname, strlen(pathname));
+}
+
+/* TRUE if 'pathname' is 'dir' or is inside it */
+static gboolean is_under(const char *pathname, const char *dir, int dir_len)
+{
+	if (strncmp(pathname, dir, dir_len) != 0)
+		return FALSE;
+
+	return pathname[dir_len] == '\0' || pathname[dir_len] == '/' ||
+		(dir_len == 1 && dir[0] == '/');
+}
+
+/* Can we use the entry this path found last time without checking? */
+static gboolean still_trusted(GFSCachePath *trusted, time_t now)
+{
+	switch (trusted->policy->check)
+	{
+		case FSCACHE_CHECK_MONITOR:
+			return TRUE;
+		case FSCACHE_CHECK_AFTER:
+			return trusted->checked <= now &&
+				now - trusted->checked < trusted->policy->seconds;
+		default:
+			return FALSE;
+	}
+}
+
+/* We've just stat()ed 'pathname' and found 'data'. If it's in a directory
+ * with a policy, remember that so the next lookup can skip the stat().
+ */
+static void trust_path(GFSCache *cache, GFSCacheData *data,
+		       const char *pathname, time_t now)
+{
+	GFSCachePath *trusted;
+
+	if (!cache->policies)
+		return;
+
+	trusted = g_hash_table_lookup(cache->trusted, pathname);
+	if (!trusted)
+	{
+		GFSCachePolicy *policy = NULL;
+		GList	*next;
+
+		for (next = cache->policies; next; next = next->next)
+		{
+			GFSCachePolicy *p = (GFSCachePolicy *) next->data;
+
+			if ((!policy || p->dir_len > policy->dir_len) &&
+			    is_under(pathname, p->dir, p->dir_len))
+				policy = p;
+		}
+		if (!policy)
+			return;
+
+		trusted = g_new(GFSCachePath, 1);
+		trusted->path = g_strdup(pathname);
+		trusted->policy = policy;
+		trusted->data = data;
+		data->paths = g_slist_prepend(data->paths, trusted);
+		g_hash_table_insert(cache->trusted, trusted->path, trusted);
+	}
+	else if (trusted->data != data)
+	{
+		/* The file has been replaced */
+		trusted->data->paths = g_slist_remove(trusted->data->paths,
+						      trusted);
+		trusted->data = data;
+		data->paths = g_slist_prepend(data->paths, trusted);
+	}
+
+	trusted->checked = now;
 }
 
 /* As for g_fscache_lookup_full, but return the GFSCacheData rather than
@@ -344,12 +721,32 @@ static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
 	struct stat 	info;
 	GFSCacheKey	key;
 	GFSCacheData	*data;
+	time_t		now;
 
 	g_return_val_if_fail(cache != NULL, NULL);
 	g_return_val_if_fail(pathname != NULL, NULL);
 
+	now = time(NULL);
+
+	if (lookup_type != FSCACHE_LOOKUP_INIT &&
+	    lookup_type != FSCACHE_LOOKUP_INSERT)
+	{
+		GFSCachePath *trusted;
+
+		trusted = g_hash_table_lookup(cache->trusted, pathname);
+		if (trusted && still_trusted(trusted, now))
+		{
+			data = trusted->data;
+			cache->hits++;
+			goto touch;
+		}
+	}
+
 	if (mc_stat(pathname, &info))
+	{
+		g_hash_table_remove(cache->trusted, pathname);
 		return NULL;
+	}
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
@@ -360,6 +757,9 @@ static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
 	{
 		/* We've cached this file already */
 
+		if (lookup_type == FSCACHE_LOOKUP_PEEK)
+			cache->hits++;
+
 		if (lookup_type == FSCACHE_LOOKUP_PEEK ||
 		    lookup_type == FSCACHE_LOOKUP_INSERT)
 			goto out;	/* Never update on peeks */
@@ -370,35 +770,44 @@ static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
 		/* Is it up-to-date? */
 
 		if (UPTODATE(data, info))
+		{
+			cache->hits++;
 			goto out;
+		}
+
+		cache->misses++;
 
 		if (lookup_type == FSCACHE_LOOKUP_ONLY_NEW)
 			return NULL;
 
 		/* Out-of-date */
 		if (cache->update)
-			cache->update(data->data, pathname, cache->user_data);
-		else
 		{
-			if (data->data)
-				g_object_unref(data->data);
-			data->data = NULL;
+			cache->update(data->data, pathname, cache->user_data);
+			update_size(cache, data);
 		}
+		else
+			set_data(cache, data, NULL);
 	}
 	else
 	{
-		GFSCacheKey *new_key;
+		if (lookup_type != FSCACHE_LOOKUP_INIT &&
+		    lookup_type != FSCACHE_LOOKUP_INSERT)
+			cache->misses++;
 
 		if (lookup_type != FSCACHE_LOOKUP_CREATE &&
 		    lookup_type != FSCACHE_LOOKUP_INIT)
 			return NULL;
 
-		new_key = g_memdup(&key, sizeof(key));
-
 		data = g_new(GFSCacheData, 1);
 		data->data = NULL;
+		data->size = 0;
+		data->paths = NULL;
+		data->key = g_memdup(&key, sizeof(key));
+		g_queue_push_head(cache->lru, data);
+		data->lru_link = cache->lru->head;
 
-		g_hash_table_insert(cache->inode_to_stats, new_key, data);
+		g_hash_table_insert(cache->inode_to_stats, data->key, data);
 	}
 
 init:
@@ -413,10 +822,21 @@ init:
 	{
 		/* Create the object for the file (ie, not an update) */
 		if (cache->load)
-			data->data = cache->load(pathname, cache->user_data);
+			set_data(cache, data, cache->load(pathname,
+							  cache->user_data));
 	}
 out:
-	data->last_lookup = time(NULL);
+	trust_path(cache, data, pathname, now);
+touch:
+	data->last_lookup = now;
+
+	if (data->lru_link != cache->lru->head)
+	{
+		g_queue_unlink(cache->lru, data->lru_link);
+		g_queue_push_head_link(cache->lru, data->lru_link);
+	}
+
+	enforce_budget(cache, data);
 
 	return data;
 }
@@ -18,6 +18,7 @@ typedef GObject *(*GFSLoadFunc)(const char *pathname, gpointer user_data);
 typedef void (*GFSUpdateFunc)(gpointer object,
 			      const char *pathname,
 			      gpointer user_data);
+typedef gsize (*GFSSizeFunc)(gpointer object, gpointer user_data);
 typedef enum {
 	FSCACHE_LOOKUP_CREATE,	/* Load if missing. Update as needed. */
 	FSCACHE_LOOKUP_ONLY_NEW,/* Return NULL if not present AND uptodate */
@@ -26,10 +27,31 @@ typedef enum {
 	FSCACHE_LOOKUP_INSERT,	/* Internal use */
 } FSCacheLookup;
 
+typedef enum {
+	FSCACHE_CHECK_STAT,	/* stat() on every lookup (default) */
+	FSCACHE_CHECK_AFTER,	/* Trust for some seconds, then stat() */
+	FSCACHE_CHECK_MONITOR,	/* Trust until g_fscache_invalidate() */
+} FSCacheCheck;
+
+typedef struct _GFSCacheStats GFSCacheStats;
+
+struct _GFSCacheStats {
+	guint	entries;
+	gsize	size;		/* Bytes, according to the size function */
+	gsize	budget;		/* 0 if unlimited */
+	guint	hits, misses, evictions;
+};
+
 GFSCache *g_fscache_new(GFSLoadFunc load,
 			GFSUpdateFunc update,
 			gpointer user_data);
 void g_fscache_destroy(GFSCache *cache);
+void g_fscache_set_budget(GFSCache *cache, GFSSizeFunc size, gsize budget);
+void g_fscache_update_size(GFSCache *cache, gpointer object);
+void g_fscache_get_stats(GFSCache *cache, GFSCacheStats *stats);
+void g_fscache_set_policy(GFSCache *cache, const char *dir,
+			  FSCacheCheck check, gint seconds);
+void g_fscache_invalidate(GFSCache *cache, const char *pathname);
 gpointer g_fscache_lookup(GFSCache *cache, const char *pathname);
 gpointer g_fscache_lookup_full(GFSCache *cache, const char *pathname,
 				FSCacheLookup lookup_type,
@@ -87,6 +87,12 @@ typedef struct _Option Option;
  */
 typedef struct _GFSCache GFSCache;
 
+/* Counts the space used by directories, using a pool of threads */
+typedef struct _UsageScan UsageScan;
+
+/* A pool of threads in the filer that can be paused while we fork() */
+typedef struct _WorkerPool WorkerPool;
+
 /* Each cached XML file is represented by one of these */
 typedef struct _XMLwrapper XMLwrapper;
 
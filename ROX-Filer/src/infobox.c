@@ -25,7 +25,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/param.h>
-#include <signal.h>
 #include <libxml/parser.h>
 
 #include <gtk/gtk.h>
@@ -46,6 +45,9 @@
 #include "pixmaps.h"
 #include "xtypes.h"
 #include "filer.h"
+#include "options.h"
+#include "action.h"	/* For o_action_threads */
+#include "usage.h"
 
 typedef struct _FileStatus FileStatus;
 
@@ -58,14 +60,22 @@ struct _FileStatus
 	gchar	*text;	/* String so far */
 };
 
+/* The size of a directory is counted in a thread */
 typedef struct du {
-	gchar        *path;
+	gchar        *path;		/* Row in store */
 	GtkListStore *store;
-	guint         watch;
-	GIOChannel   *chan;
-	gint          child;
+	GtkWidget    *view;
+	gulong        destroy;		/* Handler on view */
+	gchar        *dir;		/* Directory being counted */
+	UsageScan    *scan;		/* NULL once finished (du_scan lock) */
+	UsageTotals   totals;
+	gchar        *error;
+	gboolean      gone;		/* view was destroyed first */
 } DU;
 
+/* Lets cancel_du() use a DU's scan while du_thread() might be freeing it */
+G_LOCK_DEFINE_STATIC(du_scan);
+
 typedef struct _Permissions Permissions;
 
 struct _Permissions
@@ -434,67 +444,61 @@ static void set_cell(GtkListStore *store, const gchar *path,
 	gtk_list_store_set(store, &iter, 1, ctext, -1);
 }
 
-static void insert_size(DU *du, const char *line)
+static gboolean du_done(gpointer data)
 {
-	off_t size;
-	gchar *cell;
+	DU *du = (DU *) data;
 
-#ifdef	LARGE_FILE_SUPPORT
-	size = strtoll(line, NULL, 10);
-#else
-	size = strtol(line, NULL, 10);
-#endif
-	size <<= 10; /* Because du reports in K */
-	cell = (size >= PRETTY_SIZE_LIMIT)
-		? g_strdup_printf("%s (%" SIZE_FMT " %s)",
-				format_size(size),
-				size, _("bytes"))
-		: g_strdup(format_size(size));
+	if (!du->gone)
+	{
+		g_signal_handler_disconnect(du->view, du->destroy);
 
-	set_cell(du->store, du->path, cell);
+		if (du->totals.dirs == 0)
+			set_cell(du->store, du->path,
+				 du->error ? du->error : _("Failed to scan"));
+		else
+		{
+			gchar *sizes = usage_format_sizes(&du->totals);
+			set_cell(du->store, du->path, sizes);
+			g_free(sizes);
+		}
+	}
+
+	g_object_unref(G_OBJECT(du->store));
+	g_free(du->path);
+	g_free(du->dir);
+	g_free(du->error);
+	g_free(du);
 
-	g_free(cell);
+	return FALSE;
 }
 
-static gboolean read_du_output(GIOChannel *source, GIOCondition cond, DU *du)
+static gpointer du_thread(gpointer data)
 {
-	GString *line;
-	GIOStatus stat;
-	GError *err = NULL;
+	DU *du = (DU *) data;
+	UsageScan *scan = du->scan;
 
-	line = g_string_new("");
-	stat = g_io_channel_read_line_string(source, line, NULL, &err);
-	switch (stat)
-	{
-		case G_IO_STATUS_NORMAL:
-			insert_size(du, line->str);
-			break;
-		case G_IO_STATUS_EOF:
-		        set_cell(du->store, du->path,
-				 _("Failed to read size"));
-			break;
-		case G_IO_STATUS_AGAIN:
-			g_string_free(line, TRUE);
-			return TRUE;
-		case G_IO_STATUS_ERROR:
-			set_cell(du->store, du->path, err->message);
-			break;
-	}
-	g_string_free(line, TRUE);
+	du->error = usage_scan_path(scan, du->dir, &du->totals, NULL, NULL);
+	usage_scan_finish(scan);
 
-	return FALSE;
+	/* Freeing a large scan takes a while; don't do it in the GUI */
+	G_LOCK(du_scan);
+	du->scan = NULL;
+	G_UNLOCK(du_scan);
+	usage_scan_free(scan);
+
+	g_idle_add(du_done, du);
+
+	return NULL;
 }
 
-static void kill_du_output(GtkWidget *widget, DU *du)
+static void cancel_du(GtkWidget *widget, DU *du)
 {
-		g_source_remove(du->watch);
+	du->gone = TRUE;
 
-	g_io_channel_shutdown(du->chan, FALSE, NULL);
-	g_io_channel_unref(du->chan);
-	kill((pid_t) du->child, SIGTERM);
-	g_object_unref(G_OBJECT(du->store));
-	g_free(du->path);
-	g_free(du);
+	G_LOCK(du_scan);
+	if (du->scan)
+		usage_scan_cancel(du->scan);
+	G_UNLOCK(du_scan);
 }
 
 static gboolean refresh_info_idle(gpointer data)
@@ -604,39 +608,29 @@ static GtkWidget *make_details(const guchar *path, DirItem *item,
 			add_row_and_free(store, _("Size:"), stt);
 		} else {
 			DU *du;
-			int out;
-
-			gchar *args[] = {"du", "-sk", "", NULL};
 
-			du = g_new(DU, 1);
+			du = g_new0(DU, 1);
 			du->store = store;
 			du->path = g_strdup(add_row(store, _("Size:"),
 						    _("Scanning")));
+			du->view = view;
+			du->dir = g_strdup(path);
+			du->scan = usage_scan_new(o_action_threads.int_value,
+						  FALSE);
 
-			args[2] = (gchar *) path;
-			if (g_spawn_async_with_pipes(NULL, args, NULL,
-						     G_SPAWN_SEARCH_PATH,
-						     NULL, NULL, &du->child,
-						     NULL, &out, NULL,
-						     NULL))
+			if (g_thread_create(du_thread, du, FALSE, NULL))
 			{
-				du->chan = g_io_channel_unix_new(out);
-				/* Select binary encoding so we don't get an
-				 * error with non-UTF-8 filenames.
-				 */
-				g_io_channel_set_encoding(du->chan, NULL, NULL);
-				du->watch = g_io_add_watch(du->chan,
-						   G_IO_IN|G_IO_ERR|G_IO_HUP,
-						 (GIOFunc) read_du_output, du);
 				g_object_ref(G_OBJECT(du->store));
-				g_signal_connect(G_OBJECT(view),
+				du->destroy = g_signal_connect(G_OBJECT(view),
 						 "destroy",
-						 G_CALLBACK(kill_du_output),
+						 G_CALLBACK(cancel_du),
 						 du);
 			}
 			else
 			{
 				set_cell(store, du->path, _("Failed to scan"));
+				usage_scan_free(du->scan);
+				g_free(du->dir);
 				g_free(du->path);
 				g_free(du);
 			}
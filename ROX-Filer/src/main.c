@@ -63,6 +63,8 @@
 #include "dir.h"
 #include "diritem.h"
 #include "action.h"
+#include "usage.h"
+#include "nameindex.h"
 #include "i18n.h"
 #include "remote.h"
 #include "pinboard.h"
@@ -280,6 +282,17 @@ int main(int argc, char **argv)
 		close(fd);
 	}
 
+	/* Thumbnails are made by threads, but we still fork() for other
+	 * things. malloc() makes sure its locks are usable in the child;
+	 * older GSlices don't, so make GSlice use malloc().
+	 */
+	g_setenv("G_SLICE", "always-malloc", FALSE);
+
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	/* (only the main thread uses GTK; see pixmap_background_thumb()) */
+	g_thread_init(NULL);
+#endif
+
 	home_dir = g_get_home_dir();
 	home_dir_len = strlen(home_dir);
 	app_dir = g_strdup(getenv("APP_DIR"));
@@ -478,9 +491,12 @@ int main(int argc, char **argv)
 		        case 'm':
 			{
 				MIME_type *type;
-				type_init();
-				diritem_init();
+				/* Same order as below; type_init() sets
+				 * pixmap_cache's policy for icon directories.
+				 */
 				pixmaps_init();
+				diritem_init();
+				type_init();
 				type = type_get_type(VALUE);
 				printf("%s/%s\n", type->media_type,
 						type->subtype);
@@ -609,6 +625,8 @@ int main(int argc, char **argv)
 	mount_init();
 	type_init();
 	action_init();
+	usage_init();
+	name_index_init();
 
 	pinboard_init();
 	panel_init();
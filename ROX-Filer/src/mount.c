@@ -197,6 +197,64 @@ gboolean mount_is_user_mounted(const gchar *path)
 	return retval;
 }
 
+/* Is another filesystem mounted anywhere inside directory 'dir' (not
+ * counting 'dir' itself)? TRUE if we can't tell.
+ */
+gboolean mount_any_inside(const gchar *dir)
+{
+	gboolean found = FALSE;
+	gchar	*real, *prefix;
+	size_t	len;
+#ifdef HAVE_MNTENT_H
+	FILE	*tab;
+	struct mntent *ent;
+#elif HAVE_SYS_MNTENT_H
+	FILE	*tab;
+	struct mnttab ent;
+#elif HAVE_SYS_UCRED_H
+	struct statfs *mnts;
+	int	n, i;
+#endif
+
+	real = pathdup(dir);
+	prefix = strcmp(real, "/") == 0 ? g_strdup(real)
+					: g_strconcat(real, "/", NULL);
+	len = strlen(prefix);
+	g_free(real);
+
+#ifdef HAVE_MNTENT_H
+	tab = setmntent("/proc/self/mounts", "r");
+	if (!tab)
+		tab = setmntent(MOUNTED, "r");
+	if (!tab)
+		found = TRUE;
+	while (tab && !found && (ent = getmntent(tab)))
+		found = strncmp(ent->mnt_dir, prefix, len) == 0;
+	if (tab)
+		endmntent(tab);
+#elif HAVE_SYS_MNTENT_H
+	tab = fopen(MNTTAB, "r");
+	if (!tab)
+		found = TRUE;
+	while (tab && !found && getmntent(tab, &ent) == 0)
+		found = strncmp(ent.mnt_mountp, prefix, len) == 0;
+	if (tab)
+		fclose(tab);
+#elif HAVE_SYS_UCRED_H
+	n = getmntinfo(&mnts, MNT_NOWAIT);
+	if (n <= 0)
+		found = TRUE;
+	for (i = 0; i < n && !found; i++)
+		found = strncmp(mnts[i].f_mntonname, prefix, len) == 0;
+#else
+	found = TRUE;
+#endif
+
+	g_free(prefix);
+
+	return found;
+}
+
 /****************************************************************
  *			INTERNAL FUNCTIONS			*
  ****************************************************************/
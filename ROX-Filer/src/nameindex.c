@@ -0,0 +1,986 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* nameindex.c - an index of filenames, for Find
+ *
+ * If enabled, a thread lists everything under the configured roots (without
+ * crossing into other filesystems) and writes an index file, which is then
+ * mapped into memory. It holds:
+ *
+ * - every path, sorted, so that everything in a directory is together.
+ * - for each trigram (three bytes) found in any leafname, the numbers of
+ *   the paths whose leafnames contain it.
+ *
+ * Find uses the index for conditions that only look at names. A leafname
+ * that matches "'*report*.txt'" must contain each of "rep", "epo", "por"
+ * and "ort", so only the paths listed under all four need to be tested.
+ * Every match is lstat()ed, so nothing deleted since is reported.
+ *
+ * Things created in directories the filer is showing are added to a list
+ * as the filer notices them. Anything else created since the index was
+ * built won't be found until it is rebuilt, which happens every
+ * NAME_INDEX_MAX_AGE seconds.
+ *
+ * Action windows are fork()ed from the filer, and so get a copy of the
+ * index and the list.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "global.h"
+
+#include "options.h"
+#include "support.h"
+#include "diritem.h"
+#include "mount.h"
+#include "nameindex.h"
+
+/* Rebuild the index once it is this old (seconds) */
+#define NAME_INDEX_MAX_AGE (60 * 60)
+
+/* How often to check the index's age (seconds) */
+#define NAME_INDEX_CHECK_TIME (5 * 60)
+
+/* Rebuild early if this many new paths have been noticed */
+#define NAME_INDEX_MAX_ADDED 100000
+
+#define NAME_INDEX_MAGIC "ROXNI001"
+
+#define TRIGRAM(s) (((guint32) (guchar) (s)[0] << 16) | \
+		    ((guint32) (guchar) (s)[1] << 8) | \
+		    (guint32) (guchar) (s)[2])
+
+typedef struct _IndexHeader IndexHeader;
+typedef struct _IndexTrigram IndexTrigram;
+typedef struct _IndexBuild IndexBuild;
+
+/* The start of the index file. Each section is 8-byte aligned. */
+struct _IndexHeader {
+	char	magic[8];
+	gint64	built;		/* When we started listing */
+	guint64	size;		/* Of the whole file */
+	guint32	n_paths;
+	guint32	n_trigrams;
+	guint64	roots;		/* Offset of "root\0root\0\0" */
+	guint64	paths;		/* Offset of n_paths guint32s into strings */
+	guint64	trigrams;	/* Offset of n_trigrams IndexTrigrams */
+	guint64	postings;	/* Offset of the guint32 path numbers */
+	guint64	strings;	/* Offset of the paths, each ending in '\0' */
+	guint64	strings_size;
+};
+
+/* Sorted by trigram */
+struct _IndexTrigram {
+	guint32	trigram;
+	guint32	n;		/* Number of paths */
+	guint64	first;		/* Index into postings, ascending */
+};
+
+/* Passed to the building thread and back */
+struct _IndexBuild {
+	gchar	**roots;
+	time_t	started;
+	gboolean ok;
+};
+
+Option o_find_index;
+static Option o_find_index_roots;
+
+/* The current index, if any */
+static gchar	*index_map = NULL;
+static gsize	index_map_size = 0;
+static const IndexHeader *index_header = NULL;
+static const guint32 *index_paths = NULL;
+static const IndexTrigram *index_trigrams = NULL;
+static const guint32 *index_postings = NULL;
+static const gchar *index_strings = NULL;
+
+/* Paths noticed since the index was built (set), and since the one being
+ * built was started.
+ */
+static GHashTable *index_added = NULL;
+static GHashTable *index_added_new = NULL;
+
+static gboolean	building = FALSE;
+
+/* Static prototypes */
+static void name_index_check_options(void);
+static gboolean check_age(gpointer data);
+static gchar *index_path(void);
+static gchar **configured_roots(void);
+static gboolean same_roots(gchar **roots);
+static gboolean load_index(void);
+static gboolean index_valid(const gchar *map, gsize size);
+static void unload_index(void);
+static void start_build(void);
+static gpointer build_thread(gpointer data);
+static gboolean build_done(gpointer data);
+static gboolean build_index(IndexBuild *build);
+static void list_tree(const gchar *root, GString *strings, GArray *offsets);
+static guint64 align_file(FILE *file);
+static gboolean write_index(IndexBuild *build, GString *strings,
+			    GArray *offsets);
+static gint compare_offsets(gconstpointer a, gconstpointer b, gpointer data);
+static gboolean in_index(const gchar *path);
+static gsize first_with_prefix(const gchar *prefix);
+static const IndexTrigram *find_trigram(guint32 trigram);
+static void add_postings(const gchar *literal, GArray *found);
+static gint compare_guint32(gconstpointer a, gconstpointer b);
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+void name_index_init(void)
+{
+	option_add_int(&o_find_index, "find_index", FALSE);
+	option_add_string(&o_find_index_roots, "find_index_roots", "");
+	option_add_notify(name_index_check_options);
+
+	if (o_find_index.int_value)
+		check_age(NULL);
+
+	g_timeout_add(NAME_INDEX_CHECK_TIME * 1000, check_age, NULL);
+}
+
+/* Is everything inside directory 'path' in the index? Not if 'path' is
+ * on a different filesystem to its root, or has other filesystems mounted
+ * inside it, since we don't index those and Find must still search them.
+ */
+gboolean name_index_covers(const char *path)
+{
+	const gchar *root;
+
+	if (!index_header)
+		return FALSE;
+
+	for (root = index_map + index_header->roots; *root;
+	     root += strlen(root) + 1)
+	{
+		struct stat root_info, info;
+		size_t len = strlen(root);
+
+		if (strcmp(root, "/") != 0 &&
+		    (strncmp(path, root, len) != 0 ||
+		     (path[len] != '\0' && path[len] != '/')))
+			continue;
+
+		if (lstat(root, &root_info) == 0 && lstat(path, &info) == 0 &&
+		    root_info.st_dev == info.st_dev)
+			return !mount_any_inside(path);
+	}
+
+	return FALSE;
+}
+
+/* Call 'func' for each path inside 'dir' that might match. If 'literals'
+ * isn't NULL then only paths whose leafnames contain one of them are
+ * needed (some others may be passed too). The paths might not exist any
+ * longer.
+ */
+void name_index_search(const char *dir, gchar **literals,
+		       NameIndexFunc func, gpointer data)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gchar	*prefix;
+	size_t	prefix_len;
+	int	i;
+
+	g_return_if_fail(index_header != NULL);
+
+	prefix = strcmp(dir, "/") == 0 ? g_strdup(dir)
+				       : g_strconcat(dir, "/", NULL);
+	prefix_len = strlen(prefix);
+
+	/* Trigrams are only useful if every literal has one */
+	for (i = 0; literals && literals[i]; i++)
+		if (strlen(literals[i]) < 3)
+			literals = NULL;
+
+	if (literals)
+	{
+		GArray	*found;
+		guint	j;
+
+		found = g_array_new(FALSE, FALSE, sizeof(guint32));
+		for (i = 0; literals[i]; i++)
+			add_postings(literals[i], found);
+		g_array_sort(found, compare_guint32);
+
+		for (j = 0; j < found->len; j++)
+		{
+			guint32 n = g_array_index(found, guint32, j);
+			const gchar *path;
+
+			if (j > 0 && n == g_array_index(found, guint32, j - 1))
+				continue;
+
+			path = index_strings + index_paths[n];
+			if (strncmp(path, prefix, prefix_len) == 0)
+				func(path, data);
+		}
+
+		g_array_free(found, TRUE);
+	}
+	else
+	{
+		gsize	n;
+
+		/* Everything inside dir is together in the sorted list */
+		for (n = first_with_prefix(prefix);
+		     n < index_header->n_paths; n++)
+		{
+			const gchar *path = index_strings + index_paths[n];
+
+			if (strncmp(path, prefix, prefix_len) != 0)
+				break;
+			func(path, data);
+		}
+	}
+
+	g_hash_table_iter_init(&iter, index_added);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		if (strncmp((gchar *) key, prefix, prefix_len) == 0)
+			func((gchar *) key, data);
+	}
+
+	g_free(prefix);
+}
+
+/* The filer has found these DirItems in 'dir_path'. Note any that aren't
+ * in the index.
+ */
+void name_index_add_items(const char *dir_path, GPtrArray *items)
+{
+	guint	i;
+
+	if (!index_header || !name_index_covers(dir_path))
+		return;
+
+	for (i = 0; i < items->len; i++)
+	{
+		DirItem *item = (DirItem *) items->pdata[i];
+		gchar	*path;
+
+		path = g_build_filename(dir_path, item->leafname, NULL);
+
+		if (index_added_new)
+			g_hash_table_replace(index_added_new,
+					     g_strdup(path), NULL);
+
+		if (in_index(path) || g_hash_table_lookup_extended(index_added,
+							path, NULL, NULL))
+			g_free(path);
+		else
+			g_hash_table_insert(index_added, path, NULL);
+	}
+
+	if (g_hash_table_size(index_added) > NAME_INDEX_MAX_ADDED)
+		start_build();
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+static void name_index_check_options(void)
+{
+	if (!o_find_index.has_changed && !o_find_index_roots.has_changed)
+		return;
+
+	/* Don't search the old roots while building the new index */
+	unload_index();
+
+	if (o_find_index.int_value)
+		start_build();
+}
+
+/* Load the index, or rebuild it if it's missing or out of date */
+static gboolean check_age(gpointer data)
+{
+	if (!o_find_index.int_value || building)
+		return TRUE;
+
+	if (!index_header)
+		load_index();
+
+	if (!index_header ||
+	    time(NULL) - index_header->built > NAME_INDEX_MAX_AGE)
+		start_build();
+
+	return TRUE;
+}
+
+static gchar *index_path(void)
+{
+	return g_build_filename(g_get_user_cache_dir(),
+				"rox.sourceforge.net", PROJECT, "names", NULL);
+}
+
+/* The roots to index, from the option. $HOME if none are given. */
+static gchar **configured_roots(void)
+{
+	gchar	**roots;
+	int	i, n = 0;
+
+	roots = g_strsplit(o_find_index_roots.value, ":", -1);
+	for (i = 0; roots[i]; i++)
+	{
+		gchar *root = roots[i];
+
+		g_strstrip(root);
+		if (*root == '\0')
+		{
+			g_free(root);
+			continue;
+		}
+		roots[n++] = expand_path(root);
+		g_free(root);
+	}
+	roots[n] = NULL;
+
+	if (n == 0)
+	{
+		g_strfreev(roots);
+		roots = g_new(gchar *, 2);
+		roots[0] = g_strdup(home_dir);
+		roots[1] = NULL;
+	}
+
+	return roots;
+}
+
+/* Does the loaded index cover exactly these roots? */
+static gboolean same_roots(gchar **roots)
+{
+	const gchar *root = index_map + index_header->roots;
+	int	i;
+
+	for (i = 0; roots[i]; i++)
+	{
+		if (strcmp(root, roots[i]) != 0)
+			return FALSE;
+		root += strlen(root) + 1;
+	}
+
+	return *root == '\0';
+}
+
+/* Map the index file into memory, if it's for the current roots */
+static gboolean load_index(void)
+{
+	const IndexHeader *header;
+	struct stat info;
+	gchar	*path, **roots;
+	gpointer map;
+	int	fd;
+
+	unload_index();
+
+	path = index_path();
+	fd = open(path, O_RDONLY);
+	g_free(path);
+	if (fd == -1)
+		return FALSE;
+
+	if (fstat(fd, &info) || info.st_size < sizeof(IndexHeader))
+	{
+		close(fd);
+		return FALSE;
+	}
+
+	map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return FALSE;
+
+	index_map = map;
+	index_map_size = info.st_size;
+	header = (IndexHeader *) map;
+
+	if (!index_valid(index_map, index_map_size))
+	{
+		unload_index();
+		return FALSE;
+	}
+
+	index_header = header;
+	index_paths = (guint32 *) (index_map + header->paths);
+	index_trigrams = (IndexTrigram *) (index_map + header->trigrams);
+	index_postings = (guint32 *) (index_map + header->postings);
+	index_strings = index_map + header->strings;
+
+	roots = configured_roots();
+	if (!same_roots(roots))
+		unload_index();
+	g_strfreev(roots);
+
+	if (!index_header)
+		return FALSE;
+
+	index_added = g_hash_table_new_full(g_str_hash, g_str_equal,
+					    g_free, NULL);
+	return TRUE;
+}
+
+/* Check that nothing in the file can make us read outside it (it may be
+ * truncated, or written by a different version).
+ */
+static gboolean index_valid(const gchar *map, gsize size)
+{
+	const IndexHeader *header = (IndexHeader *) map;
+	const IndexTrigram *trigrams;
+	const guint32 *paths, *postings;
+	const gchar *root;
+	guint64	n_postings, i;
+
+	if (memcmp(header->magic, NAME_INDEX_MAGIC, 8) != 0 ||
+	    header->size != size)
+		return FALSE;
+
+	/* The sections must be in order, aligned, and big enough */
+	if (header->roots < sizeof(IndexHeader) ||
+	    header->paths <= header->roots ||
+	    header->trigrams < header->paths ||
+	    header->postings < header->trigrams ||
+	    header->strings < header->postings ||
+	    header->strings > size ||
+	    header->strings_size != size - header->strings ||
+	    (header->roots | header->paths | header->trigrams |
+	     header->postings) % 8 != 0 ||
+	    (header->trigrams - header->paths) / 4 < header->n_paths ||
+	    (header->postings - header->trigrams) / sizeof(IndexTrigram) <
+			header->n_trigrams)
+		return FALSE;
+
+	/* The roots (and the empty string after them) must end within
+	 * their section.
+	 */
+	for (root = map + header->roots; ; root += strlen(root) + 1)
+	{
+		if (root >= map + header->paths ||
+		    memchr(root, '\0', map + header->paths - root) == NULL)
+			return FALSE;
+		if (*root == '\0')
+			break;
+	}
+
+	/* Paths must be absolute and end within the strings */
+	if (header->strings_size == 0 ? header->n_paths != 0 :
+	    map[size - 1] != '\0')
+		return FALSE;
+	paths = (guint32 *) (map + header->paths);
+	for (i = 0; i < header->n_paths; i++)
+	{
+		if (paths[i] >= header->strings_size ||
+		    map[header->strings + paths[i]] != '/')
+			return FALSE;
+	}
+
+	n_postings = (header->strings - header->postings) / 4;
+	trigrams = (IndexTrigram *) (map + header->trigrams);
+	for (i = 0; i < header->n_trigrams; i++)
+	{
+		if (trigrams[i].first > n_postings ||
+		    trigrams[i].n > n_postings - trigrams[i].first)
+			return FALSE;
+	}
+
+	postings = (guint32 *) (map + header->postings);
+	for (i = 0; i < n_postings; i++)
+	{
+		if (postings[i] >= header->n_paths)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void unload_index(void)
+{
+	if (index_map)
+		munmap(index_map, index_map_size);
+	index_map = NULL;
+	index_map_size = 0;
+	index_header = NULL;
+
+	if (index_added)
+		g_hash_table_destroy(index_added);
+	index_added = NULL;
+}
+
+/* List everything in a thread, and load the new index when done */
+static void start_build(void)
+{
+	IndexBuild *build;
+
+	if (building)
+		return;
+
+	build = g_new(IndexBuild, 1);
+	build->roots = configured_roots();
+	build->started = time(NULL);
+	build->ok = FALSE;
+
+	index_added_new = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, NULL);
+
+	if (!g_thread_create(build_thread, build, FALSE, NULL))
+	{
+		g_hash_table_destroy(index_added_new);
+		index_added_new = NULL;
+		g_strfreev(build->roots);
+		g_free(build);
+		return;
+	}
+
+	building = TRUE;
+}
+
+static gpointer build_thread(gpointer data)
+{
+	IndexBuild *build = (IndexBuild *) data;
+
+	build->ok = build_index(build);
+	g_idle_add(build_done, build);
+
+	return NULL;
+}
+
+static gboolean build_done(gpointer data)
+{
+	IndexBuild *build = (IndexBuild *) data;
+	GHashTable *added = index_added_new;
+
+	building = FALSE;
+	index_added_new = NULL;
+
+	if (build->ok && o_find_index.int_value && load_index())
+	{
+		/* Things noticed since we started listing may be missing */
+		GHashTableIter iter;
+		gpointer key;
+
+		g_hash_table_iter_init(&iter, added);
+		while (g_hash_table_iter_next(&iter, &key, NULL))
+		{
+			if (!in_index(key))
+				g_hash_table_replace(index_added,
+						     g_strdup(key), NULL);
+		}
+	}
+
+	g_hash_table_destroy(added);
+	g_strfreev(build->roots);
+	g_free(build);
+
+	return FALSE;
+}
+
+/* Runs in a thread. Writes the index file. */
+static gboolean build_index(IndexBuild *build)
+{
+	GString	*strings;
+	GArray	*offsets;
+	gboolean ok;
+	int	i;
+	guint	n, j;
+
+	strings = g_string_new(NULL);
+	offsets = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+	for (i = 0; build->roots[i]; i++)
+		list_tree(build->roots[i], strings, offsets);
+
+	ok = strings->len < G_MAXUINT32;
+	if (ok)
+	{
+		g_qsort_with_data(offsets->data, offsets->len, sizeof(guint32),
+				  compare_offsets, strings->str);
+
+		/* Roots inside other roots give duplicates */
+		for (n = 0, j = 0; j < offsets->len; j++)
+		{
+			guint32 off = g_array_index(offsets, guint32, j);
+
+			if (n > 0 && strcmp(strings->str + off, strings->str +
+				g_array_index(offsets, guint32, n - 1)) == 0)
+				continue;
+			g_array_index(offsets, guint32, n++) = off;
+		}
+		g_array_set_size(offsets, n);
+
+		ok = write_index(build, strings, offsets);
+	}
+
+	g_array_free(offsets, TRUE);
+	g_string_free(strings, TRUE);
+
+	return ok;
+}
+
+/* Add the path of everything under 'root' to 'strings', and its offset
+ * to 'offsets'. Doesn't go into other filesystems. Only directories
+ * are stat()ed, unless readdir() doesn't give the type.
+ */
+static void list_tree(const gchar *root, GString *strings, GArray *offsets)
+{
+	GPtrArray *to_do;
+	struct stat info;
+	dev_t	dev;
+
+	if (lstat(root, &info) || !S_ISDIR(info.st_mode))
+		return;
+	dev = info.st_dev;
+
+	to_do = g_ptr_array_new();
+	g_ptr_array_add(to_do, g_strdup(root));
+
+	while (to_do->len)
+	{
+		gchar	*dir_path;
+		struct dirent *ent;
+		DIR	*d = NULL;
+		int	fd;
+
+		dir_path = g_ptr_array_remove_index_fast(to_do,
+							 to_do->len - 1);
+
+		fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd != -1)
+		{
+			d = fdopendir(fd);
+			if (!d)
+				close(fd);
+		}
+
+		while (d && (ent = readdir(d)))
+		{
+			const char *name = ent->d_name;
+			mode_t	type = DIRENT_TYPE(ent);
+			guint32	off = strings->len;
+
+			if (name[0] == '.' && (name[1] == '\0' ||
+					(name[1] == '.' && name[2] == '\0')))
+				continue;
+
+			g_string_append(strings, dir_path);
+			if (strings->str[strings->len - 1] != '/')
+				g_string_append_c(strings, '/');
+			g_string_append_len(strings, name, strlen(name) + 1);
+			g_array_append_val(offsets, off);
+
+			if (type && !S_ISDIR(type))
+				continue;
+			if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) ||
+			    !S_ISDIR(info.st_mode) || info.st_dev != dev)
+				continue;
+
+			g_ptr_array_add(to_do, g_strdup(strings->str + off));
+		}
+
+		if (d)
+			closedir(d);
+		g_free(dir_path);
+	}
+
+	g_ptr_array_free(to_do, TRUE);
+}
+
+/* Pad 'file' to a multiple of 8 bytes, returning the new position */
+static guint64 align_file(FILE *file)
+{
+	long	pos = ftell(file);
+
+	while (pos % 8)
+	{
+		fputc('\0', file);
+		pos++;
+	}
+
+	return pos;
+}
+
+static gboolean write_index(IndexBuild *build, GString *strings,
+			    GArray *offsets)
+{
+	IndexHeader header;
+	guint32	*starts, *counts, *postings;
+	guint64	n_postings = 0;
+	GArray	*trigrams;
+	gchar	*path, *dir, *tmp;
+	FILE	*file;
+	guint	i, t;
+	int	r, fd;
+
+	/* Count the paths for each trigram (perhaps more than once, if
+	 * it appears twice in a leafname).
+	 */
+	counts = g_new0(guint32, 1 << 24);
+	for (i = 0; i < offsets->len; i++)
+	{
+		const gchar *leaf = strings->str +
+				g_array_index(offsets, guint32, i);
+
+		leaf = strrchr(leaf, '/') + 1;
+		for (; leaf[0] && leaf[1] && leaf[2]; leaf++)
+			counts[TRIGRAM(leaf)]++;
+	}
+
+	trigrams = g_array_new(FALSE, FALSE, sizeof(IndexTrigram));
+	starts = g_new(guint32, 1 << 24);
+	for (t = 0; t < (1 << 24); t++)
+	{
+		IndexTrigram tri;
+
+		if (!counts[t])
+			continue;
+
+		tri.trigram = t;
+		tri.n = 0;
+		tri.first = n_postings;
+		g_array_append_val(trigrams, tri);
+
+		starts[t] = trigrams->len - 1;
+		n_postings += counts[t];
+	}
+	g_free(counts);
+
+	/* Fill in the path numbers, which come out in order */
+	postings = g_try_new(guint32, n_postings);
+	if (!postings && n_postings)
+	{
+		g_free(starts);
+		g_array_free(trigrams, TRUE);
+		return FALSE;
+	}
+
+	for (i = 0; i < offsets->len; i++)
+	{
+		const gchar *leaf = strings->str +
+				g_array_index(offsets, guint32, i);
+
+		leaf = strrchr(leaf, '/') + 1;
+		for (; leaf[0] && leaf[1] && leaf[2]; leaf++)
+		{
+			IndexTrigram *tri = &g_array_index(trigrams,
+					IndexTrigram, starts[TRIGRAM(leaf)]);
+			guint32 *list = postings + tri->first;
+
+			if (tri->n && list[tri->n - 1] == i)
+				continue;	/* Twice in one leafname */
+			list[tri->n++] = i;
+		}
+	}
+	g_free(starts);
+
+	path = index_path();
+	dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	/* g_mkstemp() makes it private; it lists every filename we found */
+	tmp = g_strconcat(path, ".XXXXXX", NULL);
+	fd = g_mkstemp(tmp);
+	file = fd == -1 ? NULL : fdopen(fd, "wb");
+	if (fd != -1 && !file)
+	{
+		close(fd);
+		unlink(tmp);
+	}
+	if (file)
+	{
+		memset(&header, 0, sizeof(header));
+		fwrite(&header, sizeof(header), 1, file);
+
+		memcpy(header.magic, NAME_INDEX_MAGIC, 8);
+		header.built = build->started;
+		header.n_paths = offsets->len;
+		header.n_trigrams = trigrams->len;
+
+		header.roots = align_file(file);
+		for (r = 0; build->roots[r]; r++)
+			fwrite(build->roots[r], 1,
+			       strlen(build->roots[r]) + 1, file);
+		fputc('\0', file);
+
+		header.paths = align_file(file);
+		fwrite(offsets->data, sizeof(guint32), offsets->len, file);
+
+		header.trigrams = align_file(file);
+		fwrite(trigrams->data, sizeof(IndexTrigram),
+		       trigrams->len, file);
+
+		header.postings = align_file(file);
+		fwrite(postings, sizeof(guint32), n_postings, file);
+
+		header.strings = align_file(file);
+		header.strings_size = strings->len;
+		fwrite(strings->str, 1, strings->len, file);
+		header.size = ftell(file);
+
+		rewind(file);
+		fwrite(&header, sizeof(header), 1, file);
+
+		if (ferror(file) | fclose(file) || rename(tmp, path))
+		{
+			unlink(tmp);
+			file = NULL;
+		}
+	}
+
+	g_free(tmp);
+	g_free(path);
+	g_free(postings);
+	g_array_free(trigrams, TRUE);
+
+	return file != NULL;
+}
+
+static gint compare_offsets(gconstpointer a, gconstpointer b, gpointer data)
+{
+	const gchar *strings = (const gchar *) data;
+
+	return strcmp(strings + *(guint32 *) a, strings + *(guint32 *) b);
+}
+
+/* Is 'path' in the index file? */
+static gboolean in_index(const gchar *path)
+{
+	gsize n = first_with_prefix(path);
+
+	return n < index_header->n_paths &&
+		strcmp(index_strings + index_paths[n], path) == 0;
+}
+
+/* The number of the first path not less than 'prefix' */
+static gsize first_with_prefix(const gchar *prefix)
+{
+	gsize	low = 0, high = index_header->n_paths;
+
+	while (low < high)
+	{
+		gsize mid = (low + high) / 2;
+
+		if (strcmp(index_strings + index_paths[mid], prefix) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static const IndexTrigram *find_trigram(guint32 trigram)
+{
+	gsize	low = 0, high = index_header->n_trigrams;
+
+	while (low < high)
+	{
+		gsize mid = (low + high) / 2;
+
+		if (index_trigrams[mid].trigram < trigram)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low < index_header->n_trigrams &&
+	    index_trigrams[low].trigram == trigram)
+		return &index_trigrams[low];
+	return NULL;
+}
+
+/* Add to 'found' the number of each path whose leafname contains every
+ * trigram in 'literal'.
+ */
+static void add_postings(const gchar *literal, GArray *found)
+{
+	const IndexTrigram *shortest = NULL;
+	GPtrArray *others;
+	const gchar *p;
+	guint32	i;
+	guint	j;
+
+	/* Go through the shortest list, checking the others */
+	others = g_ptr_array_new();
+	for (p = literal; p[0] && p[1] && p[2]; p++)
+	{
+		const IndexTrigram *tri = find_trigram(TRIGRAM(p));
+
+		if (!tri)
+			goto out;	/* Nothing has this trigram */
+
+		g_ptr_array_add(others, (gpointer) tri);
+		if (!shortest || tri->n < shortest->n)
+			shortest = tri;
+	}
+
+	for (i = 0; i < shortest->n; i++)
+	{
+		guint32 n = index_postings[shortest->first + i];
+
+		for (j = 0; j < others->len; j++)
+		{
+			const IndexTrigram *tri = others->pdata[j];
+			const guint32 *list = index_postings + tri->first;
+			gsize	low = 0, high = tri->n;
+
+			if (tri == shortest)
+				continue;
+
+			while (low < high)
+			{
+				gsize mid = (low + high) / 2;
+
+				if (list[mid] < n)
+					low = mid + 1;
+				else
+					high = mid;
+			}
+			if (low == tri->n || list[low] != n)
+				break;
+		}
+
+		if (j == others->len)
+			g_array_append_val(found, n);
+	}
+out:
+	g_ptr_array_free(others, TRUE);
+}
+
+static gint compare_guint32(gconstpointer a, gconstpointer b)
+{
+	guint32 x = *(guint32 *) a, y = *(guint32 *) b;
+
+	return x < y ? -1 : x > y;
+}
@@ -0,0 +1,21 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * By Thomas Leonard, <tal197@users.sourceforge.net>.
+ */
+
+#ifndef _NAMEINDEX_H
+#define _NAMEINDEX_H
+
+#include <glib.h>
+
+typedef void (*NameIndexFunc)(const char *path, gpointer data);
+
+extern Option o_find_index;
+
+void name_index_init(void);
+gboolean name_index_covers(const char *path);
+void name_index_search(const char *dir, gchar **literals,
+		       NameIndexFunc func, gpointer data);
+void name_index_add_items(const char *dir_path, GPtrArray *items);
+
+#endif /* _NAMEINDEX_H */
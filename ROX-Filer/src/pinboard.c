@@ -31,6 +31,8 @@
 #include <math.h>
 #include <libxml/parser.h>
 #include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "global.h"
 
@@ -76,6 +78,34 @@ struct _Pinboard {
 	GdkGC		*shadow_gc;
 };
 
+typedef struct _BackdropJob BackdropJob;
+
+/* Loading and scaling the backdrop image is done by a thread. Scaled images
+ * are cached on disk, so doing it again for the same image and screen size
+ * is quick.
+ */
+struct _BackdropJob {
+	gchar		*path;
+	BackdropStyle	style;
+	int		width, height;	/* Screen size */
+	guint32		bg;		/* Background colour, as RGBA */
+	GdkInterpType	interp;
+	gchar		*cache;		/* Scaled image file, or NULL */
+	guint		serial;		/* Still wanted if == backdrop_serial */
+
+	GdkPixbuf	*pixbuf;	/* Result... */
+	gchar		*error;		/* ...or error message */
+};
+
+/* Scaled backdrops to keep in the cache (one per screen size, usually) */
+#define BACKDROP_CACHE_MAX 4
+
+static WorkerPool *backdrop_pool = NULL;
+static guint backdrop_serial = 0;
+
+/* The screen size the backdrop was last scaled for */
+static int backdrop_width = 0, backdrop_height = 0;
+
 #define IS_PIN_ICON(obj) G_TYPE_CHECK_INSTANCE_TYPE((obj), pin_icon_get_type())
 
 typedef struct _PinIconClass PinIconClass;
@@ -232,6 +262,13 @@ static void clear_backdrop(GtkWidget *drop_box, gpointer data);
 static void radios_changed(Radios *radios, gpointer data);
 static void update_radios(GtkWidget *dialog);
 static void pinboard_set_backdrop_box(void);
+static void start_backdrop_job(const gchar *path, BackdropStyle style);
+static gchar *backdrop_cache_path(BackdropJob *job);
+static void backdrop_thread(gpointer data, gpointer user_data);
+static gboolean backdrop_done(gpointer data);
+static GdkPixbuf *scale_backdrop(BackdropJob *job, GError **error);
+static void save_backdrop_cache(BackdropJob *job);
+static void set_backdrop_pixmap(Pinboard *pinboard, GdkPixmap *pixmap);
 
 /****************************************************************
  *			EXTERNAL INTERFACE			*
@@ -946,6 +983,16 @@ void pinboard_update_size(void)
 	height = MAX(height, screen_height);
 
 	gtk_widget_set_size_request(current_pinboard->window, width, height);
+
+	/* A scaled backdrop needs redoing for the new size (this is quick if
+	 * it's a size we've had before).
+	 */
+	if (current_pinboard->backdrop &&
+	    current_pinboard->backdrop_style != BACKDROP_PROGRAM &&
+	    current_pinboard->backdrop_style != BACKDROP_TILE &&
+	    (backdrop_width != screen_width || backdrop_height != screen_height))
+		reload_backdrop(current_pinboard, current_pinboard->backdrop,
+				current_pinboard->backdrop_style);
 }
 
 /****************************************************************
@@ -2377,24 +2424,147 @@ static void create_pinboard_window(Pinboard *pinboard)
 	gdk_window_lower(win->window);
 }
 
-/* Load image 'path' and scale according to 'style' */
-static GdkPixmap *load_backdrop(const gchar *path, BackdropStyle style)
+/* Load and scale the backdrop image in a thread, and set it as the backdrop
+ * when done. The current backdrop stays until then.
+ */
+static void start_backdrop_job(const gchar *path, BackdropStyle style)
+{
+	BackdropJob *job;
+
+	job = g_new(BackdropJob, 1);
+	job->path = g_strdup(path);
+	job->style = style;
+	job->width = screen_width;
+	job->height = screen_height;
+	job->bg = ((pin_text_bg_col.red & 0xff00) << 16) |
+		  ((pin_text_bg_col.green & 0xff00) << 8) |
+		  ((pin_text_bg_col.blue & 0xff00));
+	job->interp = o_pinboard_image_scaling.int_value ?
+			GDK_INTERP_BILINEAR : GDK_INTERP_HYPER;
+	job->cache = backdrop_cache_path(job);
+	job->serial = backdrop_serial;
+	job->pixbuf = NULL;
+	job->error = NULL;
+
+	backdrop_width = screen_width;
+	backdrop_height = screen_height;
+
+	if (!backdrop_pool)
+	{
+		backdrop_pool = worker_pool_new(backdrop_thread, 1, NULL);
+		if (!backdrop_pool)
+		{
+			backdrop_thread(job, NULL);	/* Do it now, then */
+			return;
+		}
+	}
+
+	worker_pool_push(backdrop_pool, job);
+}
+
+/* The scaled image depends on the image (and its mtime) and everything in
+ * job. Returns the file it's cached in, or NULL if it's not worth caching.
+ */
+static gchar *backdrop_cache_path(BackdropJob *job)
 {
-	GdkPixmap *pixmap;
-	GdkPixbuf *pixbuf;
+	struct stat info;
+	gchar *key, *md5, *leaf, *path;
+
+	if (job->style == BACKDROP_TILE)
+		return NULL;	/* Not scaled */
+
+	if (mc_stat(job->path, &info))
+		return NULL;
+
+	key = g_strdup_printf("%s\n%ld\n%" SIZE_FMT "\n%dx%d\n%d\n%08x\n%d",
+			job->path, (long) info.st_mtime, info.st_size,
+			job->width, job->height, job->style,
+			(unsigned) job->bg, job->interp);
+	md5 = md5_hash(key);
+	leaf = g_strconcat("backdrop-", md5, ".png", NULL);
+	path = g_build_filename(g_get_user_cache_dir(),
+				"rox.sourceforge.net", PROJECT, leaf, NULL);
+
+	g_free(leaf);
+	g_free(md5);
+	g_free(key);
+
+	return path;
+}
+
+/* Runs in the backdrop thread. Must not use GTK. */
+static void backdrop_thread(gpointer data, gpointer user_data)
+{
+	BackdropJob *job = (BackdropJob *) data;
 	GError *error = NULL;
 
-	pixbuf = gdk_pixbuf_new_from_file(path, &error);
-	if (error)
+	if (job->cache)
+		job->pixbuf = gdk_pixbuf_new_from_file(job->cache, NULL);
+
+	if (!job->pixbuf)
 	{
-		delayed_error(_("Error loading backdrop image:\n%s\n"
-				"Backdrop removed."),
-				error->message);
-		g_error_free(error);
-		pinboard_set_backdrop(NULL, BACKDROP_NONE);
-		return NULL;
+		job->pixbuf = scale_backdrop(job, &error);
+		if (!job->pixbuf)
+		{
+			job->error = g_strdup(error->message);
+			g_error_free(error);
+		}
+		else if (job->cache)
+			save_backdrop_cache(job);
 	}
 
+	g_idle_add(backdrop_done, job);
+}
+
+/* Back in the main thread. Use the new image, unless something else has
+ * been chosen since.
+ */
+static gboolean backdrop_done(gpointer data)
+{
+	BackdropJob *job = (BackdropJob *) data;
+
+	if (job->serial == backdrop_serial && current_pinboard)
+	{
+		if (job->pixbuf)
+		{
+			GdkPixmap *pixmap;
+
+			gdk_pixbuf_render_pixmap_and_mask(job->pixbuf,
+					&pixmap, NULL, 0);
+			set_backdrop_pixmap(current_pinboard, pixmap);
+		}
+		else
+		{
+			delayed_error(_("Error loading backdrop image:\n%s\n"
+					"Backdrop removed."),
+					job->error);
+			pinboard_set_backdrop(NULL, BACKDROP_NONE);
+		}
+	}
+
+	if (job->pixbuf)
+		g_object_unref(job->pixbuf);
+	g_free(job->error);
+	g_free(job->cache);
+	g_free(job->path);
+	g_free(job);
+
+	return FALSE;
+}
+
+/* Load image job->path and scale according to job->style.
+ * Called from the backdrop thread.
+ */
+static GdkPixbuf *scale_backdrop(BackdropJob *job, GError **error)
+{
+	GdkPixbuf *pixbuf;
+	BackdropStyle style = job->style;
+	int screen_width = job->width, screen_height = job->height;
+
+	pixbuf = gdk_pixbuf_new_from_file(job->path, error);
+	if (!pixbuf)
+		return NULL;
+
 	if (style == BACKDROP_STRETCH)
 	{
 		GdkPixbuf *old = pixbuf;
@@ -2435,9 +2605,7 @@ static GdkPixmap *load_backdrop(const gchar *path, BackdropStyle style)
 		pixbuf = gdk_pixbuf_new(
 				gdk_pixbuf_get_colorspace(pixbuf), FALSE,
 				8, screen_width, screen_height);
-		gdk_pixbuf_fill(pixbuf, ((pin_text_bg_col.red & 0xff00) << 16) |
-					((pin_text_bg_col.green & 0xff00) << 8) |
-					((pin_text_bg_col.blue & 0xff00)));
+		gdk_pixbuf_fill(pixbuf, job->bg);
 
 		x = (screen_width - width * scale) / 2;
 		y = (screen_height - height * scale) / 2;
@@ -2462,17 +2630,83 @@ static GdkPixmap *load_backdrop(const gchar *path, BackdropStyle style)
 				MIN(screen_width, width * scale),
 				MIN(screen_height, height * scale),
 				offset_x, offset_y, scale, scale,
-				o_pinboard_image_scaling.int_value?
-				     GDK_INTERP_BILINEAR: GDK_INTERP_HYPER,
+				job->interp,
 				255);
 		g_object_unref(old);
 	}
 
-	gdk_pixbuf_render_pixmap_and_mask(pixbuf,
-			&pixmap, NULL, 0);
-	g_object_unref(pixbuf);
+	return pixbuf;
+}
+
+static gint newest_first(gconstpointer a, gconstpointer b)
+{
+	const struct stat *ia = (const struct stat *) ((gchar **) a)[1];
+	const struct stat *ib = (const struct stat *) ((gchar **) b)[1];
+
+	return ib->st_mtime - ia->st_mtime;
+}
+
+/* Save job->pixbuf as job->cache, and remove all but the newest few
+ * cached images. Called from the backdrop thread.
+ */
+static void save_backdrop_cache(BackdropJob *job)
+{
+	gchar *dir_path, *tmp;
+	GArray *files;
+	DIR *dir;
+	struct dirent *ent;
+	int i;
+
+	dir_path = g_path_get_dirname(job->cache);
+	g_mkdir_with_parents(dir_path, 0700);
+
+	/* Write to a temporary file first, in case we crash or another
+	 * copy of the filer is doing the same thing.
+	 */
+	tmp = g_strdup_printf("%s.%ld", job->cache, (long) getpid());
+	if (gdk_pixbuf_save(job->pixbuf, tmp, "png", NULL,
+			    "compression", "1", NULL) == FALSE ||
+	    rename(tmp, job->cache) != 0)
+		unlink(tmp);
+	g_free(tmp);
+
+	/* Each element is a (path, stat) pair */
+	files = g_array_new(FALSE, FALSE, sizeof(gpointer) * 2);
+	dir = opendir(dir_path);
+	while (dir && (ent = readdir(dir)))
+	{
+		gpointer file[2];
+		struct stat info;
+
+		if (strncmp(ent->d_name, "backdrop-", 9) != 0)
+			continue;
+
+		file[0] = g_build_filename(dir_path, ent->d_name, NULL);
+		if (mc_stat(file[0], &info) != 0)
+		{
+			g_free(file[0]);
+			continue;
+		}
+		file[1] = g_memdup(&info, sizeof(info));
+		g_array_append_val(files, file);
+	}
+	if (dir)
+		closedir(dir);
+
+	g_array_sort(files, newest_first);
+
+	for (i = 0; i < files->len; i++)
+	{
+		gpointer *file = &g_array_index(files, gpointer, i * 2);
+
+		if (i >= BACKDROP_CACHE_MAX)
+			unlink(file[0]);
+		g_free(file[0]);
+		g_free(file[1]);
+	}
 
-	return pixmap;
+	g_array_free(files, TRUE);
+	g_free(dir_path);
 }
 
 static void abandon_backdrop_app(Pinboard *pinboard)
@@ -2601,7 +2835,8 @@ static void reload_backdrop(Pinboard *pinboard,
 			    const gchar *backdrop,
 			    BackdropStyle backdrop_style)
 {
-	GtkStyle *style;
+	/* Any backdrop still being loaded isn't wanted now */
+	backdrop_serial++;
 
 	if (backdrop && backdrop_style == BACKDROP_PROGRAM)
 	{
@@ -2644,14 +2879,23 @@ static void reload_backdrop(Pinboard *pinboard,
 		return;
 	}
 
+	if (backdrop)
+		start_backdrop_job(backdrop, backdrop_style);
+	else
+		set_backdrop_pixmap(pinboard, NULL);
+}
+
+/* Make 'pixmap' (which may be NULL) the pinboard's backdrop. Takes over the
+ * reference to it.
+ */
+static void set_backdrop_pixmap(Pinboard *pinboard, GdkPixmap *pixmap)
+{
+	GtkStyle *style;
+
 	/* Note: Copying a style does not ref the pixmaps! */
 
 	style = gtk_style_copy(gtk_widget_get_style(pinboard->window));
-	style->bg_pixmap[GTK_STATE_NORMAL] = NULL;
-
-	if (backdrop)
-		style->bg_pixmap[GTK_STATE_NORMAL] =
-			load_backdrop(backdrop, backdrop_style);
+	style->bg_pixmap[GTK_STATE_NORMAL] = pixmap;
 
 	gdk_color_parse(o_pinboard_bg_colour.value,
 			&style->bg[GTK_STATE_NORMAL]);
@@ -2663,9 +2907,9 @@ static void reload_backdrop(Pinboard *pinboard,
 	gtk_widget_queue_draw(pinboard->window);
 
 	/* Also update root window property (for transparent xterms, etc) */
-	if (style->bg_pixmap[GTK_STATE_NORMAL])
+	if (pixmap)
 	{
-		XID id = GDK_DRAWABLE_XID(style->bg_pixmap[GTK_STATE_NORMAL]);
+		XID id = GDK_DRAWABLE_XID(pixmap);
 		gdk_property_change(gdk_get_default_root_window(),
 				gdk_atom_intern("_XROOTPMAP_ID", FALSE),
 				gdk_atom_intern("PIXMAP", FALSE),
@@ -28,8 +28,27 @@
 
 #define PIXMAP_PURGE_TIME 1200
 #define PIXMAP_THUMB_SIZE  128
+#define PIXMAP_THUMB_LARGE_SIZE  256
 #define PIXMAP_THUMB_TOO_OLD_TIME  5
 
+/* pixmap_cache drops the least recently used images not in use elsewhere
+ * when they take up more than this many bytes.
+ */
+#define PIXMAP_CACHE_BUDGET (32 * 1024 * 1024)
+
+/* If the thumbnail directory can't be indexed (eg, it doesn't exist yet),
+ * wait this long (seconds) before trying again.
+ */
+#define THUMB_INDEX_RETRY_TIME 10
+
+/* A thumbnail helper that makes no progress for this long (seconds) is
+ * assumed to be stuck, and killed.
+ */
+#define THUMB_HELPER_TIMEOUT 30
+
+/* Batch helpers are stopped when they've had nothing to do for this long */
+#define THUMB_BATCH_IDLE_TIME 60
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -37,6 +56,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <signal.h>
 
 #include <gtk/gtk.h>
 
@@ -54,6 +74,8 @@
 #include "options.h"
 #include "action.h"
 #include "type.h"
+#include "appinfo.h"
+#include "xml.h"
 
 GFSCache *pixmap_cache = NULL;
 GFSCache *desktop_icon_cache = NULL;
@@ -87,13 +109,107 @@ GtkIconSize mount_icon_size = -1;
 
 typedef struct _ChildThumbnail ChildThumbnail;
 
-/* There is one of these for each active child process */
+/* There is one of these for each thumbnail being made, either by one of our
+ * threads or by a helper program.
+ */
 struct _ChildThumbnail {
 	gchar	 *path;
 	GFunc	 callback;
 	gpointer data;
+	MIME_type *type;
+	gchar	 *thumb_prog;	/* Helper program, or NULL to do it ourself */
+	GdkPixbuf *thumb;	/* Set by the thread, if successful */
+	gboolean attempted;	/* We tried (so no thumb means it can't be done) */
+	gboolean timed_out;	/* Helper was too slow (perhaps just busy) */
+	pid_t	 child;		/* Helper making it just for us, if any */
+	guint	 timeout;	/* Kills child if it takes too long */
+	guint	 request;	/* ID of our request to a batch helper */
+};
+
+/* Images we can load ourselves are thumbnailed by this pool of threads */
+static WorkerPool *thumb_pool = NULL;
+
+/* Helper programs run at once, and ChildThumbnails waiting to start one */
+static int n_helpers = 0;
+static GQueue *waiting_helpers = NULL;
+
+typedef struct _ThumbBatch ThumbBatch;
+
+/* A helper program which says (with <Thumbnailer batch='yes'/> in its
+ * AppInfo.xml) that it can make many thumbnails in one run. It is run with
+ * "--batch", and we send it one request per line on stdin:
+ *	ID <tab> SIZE <tab> SOURCE PATH <tab> THUMBNAIL PATH
+ * For each one it replies on stdout, in any order, with:
+ *	ID <tab> "ok" or "failed"
+ * It should exit at the end of its input.
+ */
+struct _ThumbBatch {
+	gchar	   *thumb_prog;	/* Key in thumb_batches */
+	gboolean   usable;	/* Can do batches, and hasn't gone wrong */
+	GPid	   pid;		/* 0 if not running */
+	GIOChannel *to_helper;
+	GIOChannel *from_helper;
+	guint	   watch;	/* Reads replies */
+	guint	   timeout;	/* Checks it's still working */
+	time_t	   progress;	/* Time of last reply, or first new request */
+	GHashTable *pending;	/* Request ID -> ChildThumbnail */
+};
+
+static GHashTable *thumb_batches = NULL;	/* thumb_prog -> ThumbBatch */
+static guint next_request = 1;
+
+typedef struct _Preload Preload;
+
+/* There is one of these for each image waiting for pixmap_preload() */
+struct _Preload {
+	gchar	     *path;
+	MaskedPixmap *image;	/* Set by the preload thread */
+	GFunc	     callback;
+	gpointer     data;
+};
+
+static WorkerPool *preload_pool = NULL;
+
+typedef struct _ThumbInfo ThumbInfo;
+
+/* What we know about one thumbnail on disk. The metadata is read from the
+ * PNG's text chunks the first time we need it; the image itself is only
+ * decoded once we know it's still valid.
+ */
+struct _ThumbInfo {
+	gboolean have_text;	/* mtime and size have been read */
+	time_t	 mtime;		/* Thumb::MTime, or -1 if missing */
+	off_t	 size;		/* Thumb::Size, or -1 if missing */
 };
 
+typedef struct _ThumbDir ThumbDir;
+
+/* A directory of thumbnails, and an index of what's in it */
+struct _ThumbDir {
+	gchar	     *path;
+	GHashTable   *index;	/* MD5 name -> ThumbInfo, or NULL if not loaded */
+	GFileMonitor *monitor;	/* Keeps index up-to-date */
+	time_t	     tried;	/* When we last tried to load index */
+	gboolean     missing;	/* Directory didn't exist last time */
+};
+
+/* Thumbnails are looked for in each of these in turn, and written to the
+ * first. The ones in $XDG_CACHE_HOME are shared with other programs; the
+ * ones in ~/.thumbnails are from older versions.
+ */
+static GPtrArray *thumb_dirs = NULL;
+
+/* Files we couldn't thumbnail last time, in the shared "fail" directory */
+static ThumbDir *thumb_fail_dir = NULL;
+
+/* The size of the thumbnails we make (the "normal" or "large" tier) */
+static int thumb_size = PIXMAP_THUMB_SIZE;
+
+/* The directory part of the last URI hashed, and the MD5 state after it */
+G_LOCK_DEFINE_STATIC(md5_prefix);
+static gchar *md5_prefix = NULL;
+static MD5Context md5_prefix_ctx;
+
 static const char *stocks[] = {
 	ROX_STOCK_SHOW_DETAILS,
 	ROX_STOCK_SHOW_HIDDEN,
@@ -114,11 +230,48 @@ static MaskedPixmap *get_bad_image(void);
 static GdkPixbuf *scale_pixbuf_up(GdkPixbuf *src, int max_w, int max_h);
 static GdkPixbuf *get_thumbnail_for(const char *path);
 static void thumbnail_child_done(ChildThumbnail *info);
-static void child_create_thumbnail(const gchar *path, MIME_type *type);
+static GdkPixbuf *create_thumbnail(const gchar *path, MIME_type *type);
+static void thumbnail_thread(gpointer data, gpointer user_data);
+static gboolean thumbnail_thread_done(gpointer data);
+static void start_helper(ChildThumbnail *info);
+static void helper_done(ChildThumbnail *info);
+static gboolean helper_timeout(gpointer data);
+static ThumbBatch *get_thumb_batch(const gchar *thumb_prog, DirItem *item);
+static gboolean batch_start(ThumbBatch *batch, const gchar *prog);
+static gboolean batch_send(ThumbBatch *batch, const gchar *prog,
+			   ChildThumbnail *info, const gchar *thumb_path);
+static gboolean batch_read(GIOChannel *source, GIOCondition cond,
+			   gpointer data);
+static void batch_reply(ThumbBatch *batch, const gchar *line);
+static gboolean batch_check(gpointer data);
+static void batch_stop(ThumbBatch *batch, gboolean broken);
+static void batch_died(gpointer data);
 static GList *thumbs_purge_cache(Option *option, xmlNode *node, guchar *label);
 static gchar *thumbnail_path(const gchar *path);
+static gboolean write_thumb_data(const gchar *buf, gsize count,
+				 GError **error, gpointer data);
 static gchar *thumbnail_program(MIME_type *type);
-static GdkPixbuf *extract_tiff_thumbnail(const gchar *path);
+static GdkPixbuf *extract_tiff_thumbnail(const gchar *path, int min_size);
+static void make_small(MaskedPixmap *mp);
+static void preload_thread(gpointer data, gpointer user_data);
+static gsize masked_pixmap_size(MaskedPixmap *mp, gpointer data);
+static gboolean preload_done(gpointer data);
+static gchar *thumbnail_uri(const char *pathname);
+static gchar *uri_md5(const gchar *uri);
+static gchar *thumbnail_md5(const char *pathname);
+static void thumb_dirs_init(void);
+static void add_thumb_dir(const gchar *base, const gchar *tier);
+static const gchar *thumb_write_dir(void);
+static gboolean thumb_index_load(ThumbDir *tdir);
+static void thumb_index_note(ThumbDir *tdir, const char *md5, gboolean exists);
+static void thumb_index_note_leaf(ThumbDir *tdir, const char *leaf,
+				  gboolean exists);
+static void thumb_index_changed(GFileMonitor *monitor, GFile *file,
+		GFile *other, GFileMonitorEvent event, gpointer data);
+static void read_thumb_text(const char *thumb_path, ThumbInfo *tinfo);
+static gboolean thumbnail_failed(const char *pathname);
+static void save_failed_thumbnail(const char *pathname);
+static void purge_thumb_dir(ThumbDir *tdir, GList **list);
 
 /****************************************************************
  *			EXTERNAL INTERFACE			*
@@ -132,10 +285,14 @@ void pixmaps_init(void)
 	gtk_widget_push_colormap(gdk_rgb_get_colormap());
 
 	pixmap_cache = g_fscache_new((GFSLoadFunc) image_from_file, NULL, NULL);
+	g_fscache_set_budget(pixmap_cache, (GFSSizeFunc) masked_pixmap_size,
+			     PIXMAP_CACHE_BUDGET);
 	desktop_icon_cache = g_fscache_new((GFSLoadFunc) image_from_desktop_file, NULL, NULL);
 
 	g_timeout_add(10000, purge, NULL);
 
+	thumb_dirs_init();
+
 	factory = gtk_icon_factory_new();
 	for (i = 0; i < G_N_ELEMENTS(stocks); i++)
 	{
@@ -236,6 +393,9 @@ void pixmap_make_huge(MaskedPixmap *mp)
 
 	mp->huge_width = gdk_pixbuf_get_width(mp->huge_pixbuf);
 	mp->huge_height = gdk_pixbuf_get_height(mp->huge_pixbuf);
+
+	if (pixmap_cache)
+		g_fscache_update_size(pixmap_cache, mp);
 }
 
 void pixmap_make_small(MaskedPixmap *mp)
@@ -245,19 +405,16 @@ void pixmap_make_small(MaskedPixmap *mp)
 
 	g_return_if_fail(mp->src_pixbuf != NULL);
 
-	mp->sm_pixbuf = scale_pixbuf(mp->src_pixbuf, SMALL_WIDTH, SMALL_HEIGHT);
+	make_small(mp);
 
-	if (!mp->sm_pixbuf)
-	{
-		mp->sm_pixbuf = mp->src_pixbuf;
-		g_object_ref(mp->sm_pixbuf);
-	}
-
-	mp->sm_width = gdk_pixbuf_get_width(mp->sm_pixbuf);
-	mp->sm_height = gdk_pixbuf_get_height(mp->sm_pixbuf);
+	if (pixmap_cache)
+		g_fscache_update_size(pixmap_cache, mp);
 }
 
 /* Load image 'path' in the background and insert into pixmap_cache.
+ * Up to pixmap_thumb_jobs() thumbnails are made at once by threads, and
+ * the same number of helper programs can run at once; callers may queue as
+ * many as they like.
  * Call callback(data, path) when done (path is NULL => error).
  * If the image is already uptodate, or being created already, calls the
  * callback right away.
@@ -266,10 +423,9 @@ void pixmap_background_thumb(const gchar *path, GFunc callback, gpointer data)
 {
 	gboolean	found;
 	MaskedPixmap	*image;
-	pid_t		child;
 	ChildThumbnail	*info;
 	MIME_type       *type;
-	gchar		*thumb_prog, *base;
+	gchar		*thumb_prog;
 
 	image = pixmap_try_thumb(path, TRUE);
 
@@ -294,7 +450,14 @@ void pixmap_background_thumb(const gchar *path, GFunc callback, gpointer data)
 	}
 
 	/* Not in memory, nor in the thumbnails directory.  We need to
-	 * generate it */
+	 * generate it, unless we failed to before */
+
+	if (thumbnail_failed(path))
+	{
+		g_fscache_insert(pixmap_cache, path, NULL, TRUE);
+		callback(data, NULL);
+		return;
+	}
 
 	type = type_from_path(path);
 	if (!type)
@@ -314,50 +477,65 @@ void pixmap_background_thumb(const gchar *path, GFunc callback, gpointer data)
 		return;		/* Don't know how to handle this type */
 	}
 
-	child = fork();
-	if (child == -1)
+	info = g_new(ChildThumbnail, 1);
+	info->path = g_strdup(path);
+	info->callback = callback;
+	info->data = data;
+	info->type = type;
+	info->thumb_prog = thumb_prog;
+	info->thumb = NULL;
+	info->attempted = FALSE;
+	info->timed_out = FALSE;
+	info->child = -1;
+	info->timeout = 0;
+	info->request = 0;
+
+	if (thumb_prog)
 	{
-		g_free(thumb_prog);
-		delayed_error("fork(): %s", g_strerror(errno));
-		callback(data, NULL);
+		if (n_helpers < pixmap_thumb_jobs())
+			start_helper(info);
+		else
+		{
+			if (!waiting_helpers)
+				waiting_helpers = g_queue_new();
+			g_queue_push_tail(waiting_helpers, info);
+		}
 		return;
 	}
 
-	if (child == 0)
+	if (!thumb_pool)
 	{
-		/* We are the child process.  (We are sloppy with freeing
-		   memory, but since we go away very quickly, that's ok.) */
-		if (thumb_prog)
+		GError *error = NULL;
+
+		thumb_pool = worker_pool_new(thumbnail_thread,
+					     pixmap_thumb_jobs(), &error);
+		if (!thumb_pool)
 		{
-			DirItem *item;
-
-			base = g_path_get_basename(thumb_prog);
-			item = diritem_new(base);
-			g_free(base);
-			diritem_restat(thumb_prog, item, NULL);
-			if (item->flags & ITEM_FLAG_APPDIR)
-				thumb_prog = g_strconcat(thumb_prog, "/AppRun",
-						NULL);
-
-			execl(thumb_prog, thumb_prog, path,
-					thumbnail_path(path),
-					g_strdup_printf("%d", PIXMAP_THUMB_SIZE),
-					NULL);
-
-			_exit(1);
+			delayed_error("%s", error->message);
+			g_error_free(error);
+			thumbnail_child_done(info);
+			return;
 		}
-
-		child_create_thumbnail(path, type);
-		_exit(0);
 	}
 
-	g_free(thumb_prog);
+	worker_pool_push(thumb_pool, info);
+}
 
-	info = g_new(ChildThumbnail, 1);
-	info->path = g_strdup(path);
-	info->callback = callback;
-	info->data = data;
-	on_child_death(child, (CallbackFn) thumbnail_child_done, info);
+/* The number of thumbnails worth making at once (one per CPU) */
+int pixmap_thumb_jobs(void)
+{
+	static int jobs = 0;
+
+	if (!jobs)
+	{
+		long n = -1;
+#ifdef _SC_NPROCESSORS_ONLN
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		jobs = n > 0 ? (int) n : 1;
+	}
+
+	return jobs;
 }
 
 /*
@@ -390,6 +568,7 @@ MaskedPixmap *pixmap_try_thumb(const gchar *path, gboolean can_load)
 	{
 		struct stat info1, info2;
 		char *dir;
+		int i;
 
 		/* Skip zero-byte files. They're either empty, or
 		 * special (may cause us to hang, e.g. /proc/kmsg). */
@@ -399,8 +578,8 @@ MaskedPixmap *pixmap_try_thumb(const gchar *path, gboolean can_load)
 
 		dir = g_path_get_dirname(path);
 
-		/* If the image itself is in ~/.thumbnails, load it now
-		 * (ie, don't create thumbnails for thumbnails!).
+		/* If the image itself is in a thumbnail directory, load it
+		 * now (ie, don't create thumbnails for thumbnails!).
 		 */
 		if (mc_stat(dir, &info1) != 0)
 		{
@@ -409,17 +588,20 @@ MaskedPixmap *pixmap_try_thumb(const gchar *path, gboolean can_load)
 		}
 		g_free(dir);
 
-		if (mc_stat(make_path(home_dir, ".thumbnails/normal"),
-			    &info2) == 0 &&
+		for (i = 0; i < thumb_dirs->len; i++)
+		{
+			ThumbDir *tdir = g_ptr_array_index(thumb_dirs, i);
+
+			if (mc_stat(tdir->path, &info2) == 0 &&
 			    info1.st_dev == info2.st_dev &&
 			    info1.st_ino == info2.st_ino)
-		{
-			pixbuf = rox_pixbuf_new_from_file_at_scale(path,
-					PIXMAP_THUMB_SIZE, PIXMAP_THUMB_SIZE,
-								   TRUE, NULL);
-			if (!pixbuf)
 			{
-				return NULL;
+				pixbuf = rox_pixbuf_new_from_file_at_scale(path,
+						thumb_size, thumb_size,
+						TRUE, NULL);
+				if (!pixbuf)
+					return NULL;
+				break;
 			}
 		}
 	}
@@ -437,241 +619,1179 @@ MaskedPixmap *pixmap_try_thumb(const gchar *path, gboolean can_load)
 	return NULL;
 }
 
+/* Load image 'path' into pixmap_cache using a separate thread, so that a
+ * later g_fscache_lookup() finds it without having to wait.
+ * Call callback(data, path) in the main thread when done (even on error).
+ */
+void pixmap_preload(const gchar *path, GFunc callback, gpointer data)
+{
+	Preload *preload;
+
+	g_return_if_fail(path != NULL);
+
+	if (!preload_pool)
+	{
+		GError *error = NULL;
+
+		preload_pool = worker_pool_new(preload_thread, 1, &error);
+		if (!preload_pool)
+		{
+			g_warning("%s", error->message);
+			g_error_free(error);
+			if (callback)
+				callback(data, (gpointer) path);
+			return;
+		}
+	}
+
+	preload = g_new(Preload, 1);
+	preload->path = g_strdup(path);
+	preload->image = NULL;
+	preload->callback = callback;
+	preload->data = data;
+
+	worker_pool_push(preload_pool, preload);
+}
+
 /****************************************************************
  *			INTERNAL FUNCTIONS			*
  ****************************************************************/
 
-/* Create a thumbnail file for this image */
-static void save_thumbnail(const char *pathname, GdkPixbuf *full)
+/* Make mp's small pixbuf, which the caller has checked isn't there yet.
+ * Doesn't touch pixmap_cache, so may be called from threads.
+ */
+static void make_small(MaskedPixmap *mp)
+{
+	mp->sm_pixbuf = scale_pixbuf(mp->src_pixbuf, SMALL_WIDTH, SMALL_HEIGHT);
+
+	if (!mp->sm_pixbuf)
+	{
+		mp->sm_pixbuf = mp->src_pixbuf;
+		g_object_ref(mp->sm_pixbuf);
+	}
+
+	mp->sm_width = gdk_pixbuf_get_width(mp->sm_pixbuf);
+	mp->sm_height = gdk_pixbuf_get_height(mp->sm_pixbuf);
+}
+
+/* Runs in the preload thread. Must not use GTK or pixmap_cache. */
+static void preload_thread(gpointer data, gpointer user_data)
+{
+	Preload *preload = (Preload *) data;
+
+	preload->image = image_from_file(preload->path);
+	if (preload->image)
+		make_small(preload->image);
+
+	g_idle_add_full(G_PRIORITY_LOW, preload_done, preload, NULL);
+}
+
+/* Back in the main thread */
+static gboolean preload_done(gpointer data)
+{
+	Preload *preload = (Preload *) data;
+
+	if (preload->image)
+	{
+		g_fscache_insert(pixmap_cache, preload->path,
+				 preload->image, TRUE);
+		g_object_unref(preload->image);
+	}
+
+	if (preload->callback)
+		preload->callback(preload->data, preload->path);
+
+	g_free(preload->path);
+	g_free(preload);
+
+	return FALSE;
+}
+
+/* Create a thumbnail file for this image. Returns the thumbnail (unref it
+ * afterwards), or NULL on error.
+ * Called from the thumbnail threads.
+ */
+static GdkPixbuf *save_thumbnail(const char *pathname, GdkPixbuf *full)
+{
+	struct stat info;
+	int original_width, original_height;
+	GString *to;
+	char *md5, *swidth, *sheight, *ssize, *smtime, *uri;
+	int name_len, fd;
+	gboolean saved = FALSE;
+	GdkPixbuf *thumb;
+
+	if (mc_stat(pathname, &info) != 0)
+		return NULL;
+
+	thumb = scale_pixbuf(full, thumb_size, thumb_size);
+
+	original_width = gdk_pixbuf_get_width(full);
+	original_height = gdk_pixbuf_get_height(full);
+
+	swidth = g_strdup_printf("%d", original_width);
+	sheight = g_strdup_printf("%d", original_height);
+	ssize = g_strdup_printf("%" SIZE_FMT, info.st_size);
+	smtime = g_strdup_printf("%ld", (long) info.st_mtime);
+
+	uri = thumbnail_uri(pathname);
+	md5 = uri_md5(uri);
+
+	to = g_string_new(thumb_write_dir());
+	g_string_append_c(to, '/');
+	g_string_append(to, md5);
+	name_len = to->len + 4; /* Truncate to this length when renaming */
+	g_string_append_printf(to, ".png.ROX-Filer-%ld-%p", (long) getpid(),
+			       (void *) g_thread_self());
+
+	g_free(md5);
+
+	/* Private from the start, since the original may be. (Not umask(),
+	 * as that would affect the other threads too.)
+	 */
+	fd = open(to->str, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd != -1)
+	{
+		saved = gdk_pixbuf_save_to_callback(thumb, write_thumb_data,
+				GINT_TO_POINTER(fd), "png", NULL,
+				"tEXt::Thumb::Image::Width", swidth,
+				"tEXt::Thumb::Image::Height", sheight,
+				"tEXt::Thumb::Size", ssize,
+				"tEXt::Thumb::MTime", smtime,
+				"tEXt::Thumb::URI", uri,
+				"tEXt::Software", PROJECT,
+				NULL);
+		if (close(fd))
+			saved = FALSE;
+		if (!saved)
+			unlink(to->str);
+	}
+
+	/* We create the file ###.png.ROX-Filer-PID-THREAD and rename it to
+	 * avoid a race condition if two programs (or threads) create the
+	 * same thumb at once.
+	 */
+	if (saved)
+	{
+		gchar *final;
+
+		final = g_strndup(to->str, name_len);
+		if (rename(to->str, final))
+			g_warning("Failed to rename '%s' to '%s': %s",
+				  to->str, final, g_strerror(errno));
+		g_free(final);
+	}
+
+	g_string_free(to, TRUE);
+	g_free(swidth);
+	g_free(sheight);
+	g_free(ssize);
+	g_free(smtime);
+	g_free(uri);
+
+	return thumb;
+}
+
+/* Called by gdk_pixbuf_save_to_callback() as the PNG is made */
+static gboolean write_thumb_data(const gchar *buf, gsize count,
+				 GError **error, gpointer data)
+{
+	int fd = GPOINTER_TO_INT(data);
+
+	while (count > 0)
+	{
+		ssize_t written;
+
+		written = write(fd, buf, count);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			g_set_error(error, G_FILE_ERROR,
+				    g_file_error_from_errno(errno),
+				    "%s", g_strerror(errno));
+			return FALSE;
+		}
+		buf += written;
+		count -= written;
+	}
+
+	return TRUE;
+}
+
+static gchar *thumbnail_path(const char *path)
+{
+	gchar *md5;
+	gchar *ans;
+
+	md5 = thumbnail_md5(path);
+	ans = g_strdup_printf("%s/%s.png", thumb_write_dir(), md5);
+	g_free(md5);
+
+	return ans;
+}
+
+/* Return a program to create thumbnails for files of this type.
+ * NULL to try to make it ourself (using gdk).
+ * g_free the result.
+ */
+static gchar *thumbnail_program(MIME_type *type)
+{
+	gchar *leaf;
+	gchar *path;
+
+	if (!type)
+		return NULL;
+
+	leaf = g_strconcat(type->media_type, "_", type->subtype, NULL);
+	path = choices_find_xdg_path_load(leaf, "MIME-thumb", SITE);
+	g_free(leaf);
+	if (path)
+	{
+		return path;
+	}
+
+	path = choices_find_xdg_path_load(type->media_type, "MIME-thumb",
+					  SITE);
+
+	return path;
+}
+
+/* Called in a thumbnail thread. Load path and create the thumbnail
+ * file. Returns the thumbnail, or NULL on error.
+ */
+static GdkPixbuf *create_thumbnail(const gchar *path, MIME_type *type)
+{
+	GdkPixbuf *image=NULL;
+	GdkPixbuf *thumb = NULL;
+
+        /* Camera images usually have a preview we can use. If not,
+         * the JPEG loader decodes at 1/2, 1/4 or 1/8 scale to give us
+         * something close to thumb_size, which is much quicker than
+         * decoding it all.
+         */
+        if(strcmp(type->subtype, "jpeg")==0)
+            image=extract_tiff_thumbnail(path, thumb_size);
+
+	if(!image)
+            image = rox_pixbuf_new_from_file_at_scale(path,
+			thumb_size, thumb_size, TRUE, NULL);
+
+	if (image)
+	{
+		thumb = save_thumbnail(path, image);
+		g_object_unref(image);
+	}
+
+	return thumb;
+}
+
+/* Runs in one of the thumb_pool threads. Must not use GTK or pixmap_cache. */
+static void thumbnail_thread(gpointer data, gpointer user_data)
+{
+	ChildThumbnail *info = (ChildThumbnail *) data;
+
+	info->thumb = create_thumbnail(info->path, info->type);
+	info->attempted = TRUE;
+
+	g_idle_add(thumbnail_thread_done, info);
+}
+
+/* Back in the main thread */
+static gboolean thumbnail_thread_done(gpointer data)
+{
+	thumbnail_child_done((ChildThumbnail *) data);
+
+	return FALSE;
+}
+
+/* Run info->thumb_prog to make the thumbnail (or ask it to, if it's
+ * running in batch mode already).
+ */
+static void start_helper(ChildThumbnail *info)
+{
+	DirItem	*item;
+	ThumbBatch *batch;
+	gchar	*base, *prog, *thumb_path, *size;
+	pid_t	child;
+
+	base = g_path_get_basename(info->thumb_prog);
+	item = diritem_new(base);
+	g_free(base);
+	diritem_restat(info->thumb_prog, item, NULL);
+	if (item->flags & ITEM_FLAG_APPDIR)
+		prog = g_strconcat(info->thumb_prog, "/AppRun", NULL);
+	else
+		prog = g_strdup(info->thumb_prog);
+	batch = get_thumb_batch(info->thumb_prog, item);
+	diritem_free(item);
+
+	thumb_path = thumbnail_path(info->path);
+
+	if (batch && batch_send(batch, prog, info, thumb_path))
+	{
+		n_helpers++;
+		g_free(prog);
+		g_free(thumb_path);
+		return;
+	}
+
+	/* (everything the child needs is worked out first; we've got threads,
+	 * so it mustn't do anything but exec)
+	 */
+	size = g_strdup_printf("%d", thumb_size);
+
+	child = fork();
+	if (child == 0)
+	{
+		execl(prog, prog, info->path, thumb_path, size, NULL);
+		_exit(1);
+	}
+
+	g_free(prog);
+	g_free(thumb_path);
+	g_free(size);
+
+	if (child == -1)
+	{
+		delayed_error("fork(): %s", g_strerror(errno));
+		thumbnail_child_done(info);
+		return;
+	}
+
+	n_helpers++;
+	info->child = child;
+	info->timeout = g_timeout_add(THUMB_HELPER_TIMEOUT * 1000,
+				      helper_timeout, info);
+	on_child_death(child, (CallbackFn) helper_done, info);
+}
+
+/* Called when a helper program exits, or a batch helper says it has
+ * finished with this file. If we killed it for taking too long, don't
+ * record it as failed; it may work next time.
+ */
+static void helper_done(ChildThumbnail *info)
+{
+	n_helpers--;
+	info->attempted = !info->timed_out;
+
+	if (info->timeout)
+		g_source_remove(info->timeout);
+
+	thumbnail_child_done(info);
+
+	while (waiting_helpers && n_helpers < pixmap_thumb_jobs() &&
+	       !g_queue_is_empty(waiting_helpers))
+		start_helper(g_queue_pop_head(waiting_helpers));
+}
+
+/* The helper is taking too long. Kill it (helper_done gets called when it
+ * has gone).
+ */
+static gboolean helper_timeout(gpointer data)
+{
+	ChildThumbnail *info = (ChildThumbnail *) data;
+
+	info->timeout = 0;
+	info->timed_out = TRUE;
+	kill(info->child, SIGTERM);
+
+	return FALSE;
+}
+
+/* Returns the ThumbBatch for this helper, or NULL if it can't do batches.
+ * Whether it can is only checked the first time.
+ */
+static ThumbBatch *get_thumb_batch(const gchar *thumb_prog, DirItem *item)
+{
+	ThumbBatch *batch;
+
+	if (!thumb_batches)
+		thumb_batches = g_hash_table_new(g_str_hash, g_str_equal);
+
+	batch = g_hash_table_lookup(thumb_batches, thumb_prog);
+	if (!batch)
+	{
+		XMLwrapper *ai;
+
+		batch = g_new0(ThumbBatch, 1);
+		batch->thumb_prog = g_strdup(thumb_prog);
+		batch->pending = g_hash_table_new(NULL, NULL);
+
+		ai = appinfo_get(thumb_prog, item);
+		if (ai)
+		{
+			xmlNode *node;
+
+			node = xml_get_section(ai, NULL, "Thumbnailer");
+			if (node)
+			{
+				gchar *value;
+
+				value = xmlGetProp(node, "batch");
+				batch->usable = value &&
+					text_to_boolean(value, FALSE);
+				xmlFree(value);
+			}
+			g_object_unref(ai);
+		}
+
+		g_hash_table_insert(thumb_batches, batch->thumb_prog, batch);
+	}
+
+	return batch->usable ? batch : NULL;
+}
+
+/* Run the batch helper 'prog'. FALSE on error (and the batch isn't usable
+ * any more).
+ */
+static gboolean batch_start(ThumbBatch *batch, const gchar *prog)
+{
+	const gchar *argv[] = {NULL, "--batch", NULL};
+	GError *error = NULL;
+	int to_fd, from_fd;
+
+	argv[0] = prog;
+	if (!g_spawn_async_with_pipes(NULL, (gchar **) argv, NULL,
+			G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+			&batch->pid, &to_fd, &from_fd, NULL, &error))
+	{
+		delayed_error("%s", error->message);
+		g_error_free(error);
+		batch->pid = 0;
+		batch->usable = FALSE;
+		return FALSE;
+	}
+
+	/* Other helpers mustn't inherit these */
+	close_on_exec(to_fd, TRUE);
+	close_on_exec(from_fd, TRUE);
+
+	batch->to_helper = g_io_channel_unix_new(to_fd);
+	g_io_channel_set_close_on_unref(batch->to_helper, TRUE);
+	g_io_channel_set_encoding(batch->to_helper, NULL, NULL);
+
+	batch->from_helper = g_io_channel_unix_new(from_fd);
+	g_io_channel_set_close_on_unref(batch->from_helper, TRUE);
+	g_io_channel_set_encoding(batch->from_helper, NULL, NULL);
+	g_io_channel_set_flags(batch->from_helper, G_IO_FLAG_NONBLOCK, NULL);
+
+	batch->watch = g_io_add_watch(batch->from_helper,
+				      G_IO_IN | G_IO_ERR | G_IO_HUP,
+				      batch_read, batch);
+	batch->timeout = g_timeout_add(1000, batch_check, batch);
+	time(&batch->progress);
+
+	on_child_death(batch->pid, batch_died, GINT_TO_POINTER(batch->pid));
+
+	return TRUE;
+}
+
+/* Ask the batch helper to make info's thumbnail, starting it if needed.
+ * FALSE if that can't be done, and the helper should be run for this file
+ * in the usual way instead.
+ */
+static gboolean batch_send(ThumbBatch *batch, const gchar *prog,
+			   ChildThumbnail *info, const gchar *thumb_path)
+{
+	gchar *request;
+	gboolean ok;
+
+	/* (these would break up the request) */
+	if (strpbrk(info->path, "\t\n") || strpbrk(thumb_path, "\t\n"))
+		return FALSE;
+
+	if (!batch->pid && !batch_start(batch, prog))
+		return FALSE;
+
+	info->request = next_request++;
+	request = g_strdup_printf("%u\t%d\t%s\t%s\n", info->request,
+				  thumb_size, info->path, thumb_path);
+	ok = g_io_channel_write_chars(batch->to_helper, request, -1,
+				      NULL, NULL) == G_IO_STATUS_NORMAL &&
+	     g_io_channel_flush(batch->to_helper, NULL) == G_IO_STATUS_NORMAL;
+	g_free(request);
+
+	if (!ok)
+	{
+		batch_stop(batch, TRUE);
+		return FALSE;
+	}
+
+	if (g_hash_table_size(batch->pending) == 0)
+		time(&batch->progress);
+	g_hash_table_insert(batch->pending, GUINT_TO_POINTER(info->request),
+			    info);
+
+	return TRUE;
+}
+
+static gboolean batch_read(GIOChannel *source, GIOCondition cond,
+			   gpointer data)
+{
+	ThumbBatch *batch = (ThumbBatch *) data;
+	GString *line;
+	GIOStatus status;
+
+	line = g_string_new(NULL);
+	do
+	{
+		status = g_io_channel_read_line_string(source, line,
+						       NULL, NULL);
+		if (status == G_IO_STATUS_NORMAL)
+			batch_reply(batch, line->str);
+	} while (status == G_IO_STATUS_NORMAL && batch->from_helper);
+	g_string_free(line, TRUE);
+
+	if (status == G_IO_STATUS_AGAIN || !batch->from_helper)
+		return batch->from_helper != NULL;
+
+	/* End-of-file or error. It shouldn't quit while we're using it */
+	batch->watch = 0;
+	batch_stop(batch, TRUE);
+
+	return FALSE;
+}
+
+/* Handle one line of output from a batch helper */
+static void batch_reply(ThumbBatch *batch, const gchar *line)
+{
+	ChildThumbnail *info;
+	gchar *end;
+	guint request;
+
+	request = strtoul(line, &end, 10);
+	if (end == line || *end != '\t')
+		return;
+
+	info = g_hash_table_lookup(batch->pending, GUINT_TO_POINTER(request));
+	if (!info)
+		return;
+	g_hash_table_remove(batch->pending, GUINT_TO_POINTER(request));
+	time(&batch->progress);
+
+	/* If it failed, thumbnail_child_done() won't find a thumbnail, and
+	 * records that.
+	 */
+	helper_done(info);
+}
+
+static void find_oldest(gpointer key, gpointer value, gpointer data)
+{
+	ChildThumbnail *info = (ChildThumbnail *) value;
+	ChildThumbnail **oldest = (ChildThumbnail **) data;
+
+	if (!*oldest || info->request < (*oldest)->request)
+		*oldest = info;
+}
+
+/* Called every second while a batch helper is running. If it's stopped
+ * making progress, fail its oldest request (the one it's stuck on) and
+ * restart it for the others. Stops it if there's nothing to do.
+ */
+static gboolean batch_check(gpointer data)
+{
+	ThumbBatch *batch = (ThumbBatch *) data;
+	ChildThumbnail *oldest = NULL;
+	time_t now;
+
+	time(&now);
+
+	if (g_hash_table_size(batch->pending) == 0)
+	{
+		if (now < batch->progress + THUMB_BATCH_IDLE_TIME)
+			return TRUE;
+		batch->timeout = 0;
+		batch_stop(batch, FALSE);
+		return FALSE;
+	}
+
+	if (now < batch->progress + THUMB_HELPER_TIMEOUT)
+		return TRUE;
+
+	g_hash_table_foreach(batch->pending, find_oldest, &oldest);
+	g_hash_table_remove(batch->pending, GUINT_TO_POINTER(oldest->request));
+	oldest->timed_out = TRUE;
+
+	batch->timeout = 0;
+	batch_stop(batch, FALSE);
+
+	helper_done(oldest);
+
+	return FALSE;
+}
+
+static void add_to_list(gpointer key, gpointer value, gpointer data)
+{
+	GList **list = (GList **) data;
+
+	*list = g_list_prepend(*list, value);
+}
+
+/* Stop the batch helper. Any requests it hadn't finished are started again,
+ * each with its own helper if 'broken' (ie, don't use batch mode for this
+ * helper any more).
+ */
+static void batch_stop(ThumbBatch *batch, gboolean broken)
+{
+	GList *requests = NULL, *next;
+
+	if (broken)
+		batch->usable = FALSE;
+
+	if (batch->watch)
+		g_source_remove(batch->watch);
+	batch->watch = 0;
+	if (batch->timeout)
+		g_source_remove(batch->timeout);
+	batch->timeout = 0;
+
+	if (batch->to_helper)
+		g_io_channel_unref(batch->to_helper);
+	batch->to_helper = NULL;
+	if (batch->from_helper)
+		g_io_channel_unref(batch->from_helper);
+	batch->from_helper = NULL;
+
+	if (batch->pid)
+		kill(batch->pid, SIGTERM);
+	batch->pid = 0;
+
+	g_hash_table_foreach(batch->pending, add_to_list, &requests);
+	g_hash_table_remove_all(batch->pending);
+
+	for (next = requests; next; next = next->next)
+	{
+		n_helpers--;
+		start_helper((ChildThumbnail *) next->data);
+	}
+	g_list_free(requests);
+}
+
+static gboolean find_batch_pid(gpointer key, gpointer value, gpointer data)
+{
+	return ((ThumbBatch *) value)->pid == GPOINTER_TO_INT(data);
+}
+
+/* A batch helper has exited. If we didn't stop it, something's wrong */
+static void batch_died(gpointer data)
+{
+	ThumbBatch *batch;
+
+	batch = g_hash_table_find(thumb_batches, find_batch_pid, data);
+	if (batch)
+		batch_stop(batch, TRUE);
+}
+
+/* Called in the main thread when the thumbnail has been made (or not) */
+static void thumbnail_child_done(ChildThumbnail *info)
+{
+	GdkPixbuf *thumb;
+
+	if (info->thumb)
+		thumb = info->thumb;
+	else if (info->thumb_prog)
+	{
+		gchar *md5;
+
+		/* Don't wait for the monitor to tell us about it */
+		md5 = thumbnail_md5(info->path);
+		thumb_index_note(g_ptr_array_index(thumb_dirs, 0), md5, TRUE);
+		g_free(md5);
+
+		thumb = get_thumbnail_for(info->path);
+	}
+	else
+		thumb = NULL;
+
+	if (thumb)
+	{
+		MaskedPixmap *image;
+
+		image = masked_pixmap_new(thumb);
+		g_object_unref(thumb);
+
+		g_fscache_insert(pixmap_cache, info->path, image, FALSE);
+		g_object_unref(image);
+
+		info->callback(info->data, info->path);
+	}
+	else
+	{
+		if (info->attempted)
+			save_failed_thumbnail(info->path);
+		info->callback(info->data, NULL);
+	}
+
+	g_free(info->thumb_prog);
+	g_free(info->path);
+	g_free(info);
+}
+
+
+/* Returns the URI used to name the thumbnail for this file.
+ * g_free() the result.
+ */
+static gchar *thumbnail_uri(const char *pathname)
+{
+	gchar *path, *uri;
+
+	path = pathdup(pathname);
+	uri = g_filename_to_uri(path, NULL, NULL);
+	if (!uri)
+	        uri = g_strconcat("file://", path, NULL);
+	g_free(path);
+
+	return uri;
+}
+
+/* Returns the MD5 hash of 'uri'. Files are usually looked up a directory at
+ * a time, so we keep the hash state after the last directory prefix and
+ * only hash the leafname when it's the same. g_free() the result.
+ * Called from the thumbnail threads too.
+ */
+static gchar *uri_md5(const gchar *uri)
+{
+	MD5Context ctx;
+	const gchar *leaf;
+	gsize prefix_len;
+
+	leaf = strrchr(uri, '/');
+	if (!leaf)
+		return md5_hash(uri);
+	leaf++;
+	prefix_len = leaf - uri;
+
+	G_LOCK(md5_prefix);
+	if (!md5_prefix || strlen(md5_prefix) != prefix_len ||
+	    strncmp(md5_prefix, uri, prefix_len) != 0)
+	{
+		g_free(md5_prefix);
+		md5_prefix = g_strndup(uri, prefix_len);
+		md5_hash_start(&md5_prefix_ctx, md5_prefix);
+	}
+	ctx = md5_prefix_ctx;
+	G_UNLOCK(md5_prefix);
+
+	return md5_hash_finish(&ctx, leaf);
+}
+
+/* Returns the MD5 name of the thumbnail for this file. g_free() the result.
+ * Called from the thumbnail threads too.
+ */
+static gchar *thumbnail_md5(const char *pathname)
+{
+	gchar *uri, *md5;
+
+	uri = thumbnail_uri(pathname);
+	md5 = uri_md5(uri);
+	g_free(uri);
+
+	return md5;
+}
+
+/* Work out where thumbnails go. Every display size fits in a "normal"
+ * thumbnail, unless the huge icons are made bigger than that. Bigger
+ * thumbnails can be scaled down, so the "large" ones are used too.
+ */
+static void thumb_dirs_init(void)
+{
+	gchar *xdg, *old;
+
+	if (MAX(HUGE_WIDTH, HUGE_HEIGHT) > PIXMAP_THUMB_SIZE)
+		thumb_size = PIXMAP_THUMB_LARGE_SIZE;
+
+	xdg = g_build_filename(g_get_user_cache_dir(), "thumbnails", NULL);
+	old = g_build_filename(home_dir, ".thumbnails", NULL);
+
+	thumb_dirs = g_ptr_array_new();
+	if (thumb_size == PIXMAP_THUMB_SIZE)
+	{
+		add_thumb_dir(xdg, "normal");
+		add_thumb_dir(old, "normal");
+	}
+	add_thumb_dir(xdg, "large");
+	add_thumb_dir(old, "large");
+
+	/* (named after this version, so that a new one tries again) */
+	thumb_fail_dir = g_new0(ThumbDir, 1);
+	thumb_fail_dir->path = g_build_filename(xdg, "fail",
+					PROJECT "-" VERSION, NULL);
+
+	g_free(xdg);
+	g_free(old);
+}
+
+static void add_thumb_dir(const gchar *base, const gchar *tier)
+{
+	ThumbDir *tdir;
+	gchar *path;
+	int i;
+
+	path = g_build_filename(base, tier, NULL);
+
+	for (i = 0; i < thumb_dirs->len; i++)
+	{
+		tdir = g_ptr_array_index(thumb_dirs, i);
+		if (strcmp(tdir->path, path) == 0)
+		{
+			g_free(path);
+			return;
+		}
+	}
+
+	tdir = g_new0(ThumbDir, 1);
+	tdir->path = path;
+	g_ptr_array_add(thumb_dirs, tdir);
+}
+
+/* Returns the directory we save new thumbnails in, creating it if needed.
+ * Called from the thumbnail threads too.
+ */
+/* The directory new thumbnails go in. Created the first time we need it.
+ * Called from the thumbnail threads too.
+ */
+static const gchar *thumb_write_dir(void)
 {
-	struct stat info;
-	gchar *path;
-	int original_width, original_height;
-	GString *to;
-	char *md5, *swidth, *sheight, *ssize, *smtime, *uri;
-	mode_t old_mask;
-	int name_len;
-	GdkPixbuf *thumb;
+	static gint made = 0;
+	ThumbDir *tdir = g_ptr_array_index(thumb_dirs, 0);
 
-	thumb = scale_pixbuf(full, PIXMAP_THUMB_SIZE, PIXMAP_THUMB_SIZE);
+	if (!g_atomic_int_get(&made))
+	{
+		g_mkdir_with_parents(tdir->path, 0700);
+		g_atomic_int_set(&made, 1);
+	}
 
-	original_width = gdk_pixbuf_get_width(full);
-	original_height = gdk_pixbuf_get_height(full);
+	return tdir->path;
+}
 
-	if (mc_stat(pathname, &info) != 0)
-		return;
+/* Read the names in this thumbnail directory and start watching it, so that
+ * we know which thumbnails exist without having to try opening them.
+ * Returns FALSE if the index isn't available (tdir->missing is set if that's
+ * because the directory doesn't exist).
+ */
+static gboolean thumb_index_load(ThumbDir *tdir)
+{
+	GFile *gf;
+	DIR *dir;
+	struct dirent *ent;
+	time_t now;
 
-	swidth = g_strdup_printf("%d", original_width);
-	sheight = g_strdup_printf("%d", original_height);
-	ssize = g_strdup_printf("%" SIZE_FMT, info.st_size);
-	smtime = g_strdup_printf("%ld", (long) info.st_mtime);
+	if (tdir->index)
+		return TRUE;
 
-	path = pathdup(pathname);
-	uri = g_filename_to_uri(path, NULL, NULL);
-	if (!uri)
-	        uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
-	g_free(path);
+	time(&now);
+	if (now < tdir->tried + THUMB_INDEX_RETRY_TIME)
+		return FALSE;
+	tdir->tried = now;
+
+	/* Start watching first, so that nothing gets missed */
+	gf = g_file_new_for_path(tdir->path);
+	tdir->monitor = g_file_monitor_directory(gf, G_FILE_MONITOR_NONE,
+						 NULL, NULL);
+	g_object_unref(gf);
+	if (!tdir->monitor)
+		return FALSE;
+
+	dir = opendir(tdir->path);
+	if (!dir)
+	{
+		tdir->missing = errno == ENOENT;
+		g_object_unref(tdir->monitor);
+		tdir->monitor = NULL;
+		return FALSE;
+	}
+	tdir->missing = FALSE;
 
-	to = g_string_new(home_dir);
-	g_string_append(to, "/.thumbnails");
-	mkdir(to->str, 0700);
-	g_string_append(to, "/normal/");
-	mkdir(to->str, 0700);
-	g_string_append(to, md5);
-	name_len = to->len + 4; /* Truncate to this length when renaming */
-	g_string_append_printf(to, ".png.ROX-Filer-%ld", (long) getpid());
+	tdir->index = g_hash_table_new_full(g_str_hash, g_str_equal,
+					    g_free, g_free);
+	while ((ent = readdir(dir)))
+		thumb_index_note_leaf(tdir, ent->d_name, TRUE);
+	closedir(dir);
 
-	g_free(md5);
+	g_signal_connect(tdir->monitor, "changed",
+			 G_CALLBACK(thumb_index_changed), tdir);
 
-	old_mask = umask(0077);
-	gdk_pixbuf_save(thumb, to->str, "png", NULL,
-			"tEXt::Thumb::Image::Width", swidth,
-			"tEXt::Thumb::Image::Height", sheight,
-			"tEXt::Thumb::Size", ssize,
-			"tEXt::Thumb::MTime", smtime,
-			"tEXt::Thumb::URI", uri,
-			"tEXt::Software", PROJECT,
-			NULL);
-	umask(old_mask);
+	return TRUE;
+}
 
-	/* We create the file ###.png.ROX-Filer-PID and rename it to avoid
-	 * a race condition if two programs create the same thumb at
-	 * once.
-	 */
+/* The thumbnail 'md5' in tdir has been created, changed or deleted. Forget
+ * anything we knew about its contents.
+ */
+static void thumb_index_note(ThumbDir *tdir, const char *md5, gboolean exists)
+{
+	if (!tdir->index)
 	{
-		gchar *final;
-
-		final = g_strndup(to->str, name_len);
-		if (rename(to->str, final))
-			g_warning("Failed to rename '%s' to '%s': %s",
-				  to->str, final, g_strerror(errno));
-		g_free(final);
+		tdir->tried = 0;	/* (it probably exists now) */
+		return;
 	}
 
-	g_string_free(to, TRUE);
-	g_free(swidth);
-	g_free(sheight);
-	g_free(ssize);
-	g_free(smtime);
-	g_free(uri);
+	if (exists)
+		g_hash_table_replace(tdir->index, g_strdup(md5),
+				     g_new0(ThumbInfo, 1));
+	else
+		g_hash_table_remove(tdir->index, md5);
 }
 
-static gchar *thumbnail_path(const char *path)
+/* As thumb_index_note(), but for a leafname in the thumbnail directory.
+ * Anything not named <md5>.png (eg, temporary files) is ignored.
+ */
+static void thumb_index_note_leaf(ThumbDir *tdir, const char *leaf,
+				  gboolean exists)
 {
-	gchar *uri, *md5;
-	GString *to;
-	gchar *ans;
+	gchar *md5;
 
-	uri = g_filename_to_uri(path, NULL, NULL);
-	if(!uri)
-	       uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
-
-	to = g_string_new(home_dir);
-	g_string_append(to, "/.thumbnails");
-	mkdir(to->str, 0700);
-	g_string_append(to, "/normal/");
-	mkdir(to->str, 0700);
-	g_string_append(to, md5);
-	g_string_append(to, ".png");
+	if (strlen(leaf) != 32 + 4 || strcmp(leaf + 32, ".png") != 0)
+		return;
 
+	md5 = g_strndup(leaf, 32);
+	thumb_index_note(tdir, md5, exists);
 	g_free(md5);
-	g_free(uri);
-
-	ans=to->str;
-	g_string_free(to, FALSE);
-
-	return ans;
 }
 
-/* Return a program to create thumbnails for files of this type.
- * NULL to try to make it ourself (using gdk).
- * g_free the result.
- */
-static gchar *thumbnail_program(MIME_type *type)
+static void thumb_index_changed(GFileMonitor *monitor, GFile *file,
+		GFile *other, GFileMonitorEvent event, gpointer data)
 {
 	gchar *leaf;
-	gchar *path;
-
-	if (!type)
-		return NULL;
+	gboolean exists;
 
-	leaf = g_strconcat(type->media_type, "_", type->subtype, NULL);
-	path = choices_find_xdg_path_load(leaf, "MIME-thumb", SITE);
-	g_free(leaf);
-	if (path)
+	switch (event)
 	{
-		return path;
+		case G_FILE_MONITOR_EVENT_DELETED:
+			exists = FALSE;
+			break;
+		case G_FILE_MONITOR_EVENT_CREATED:
+		case G_FILE_MONITOR_EVENT_CHANGED:
+		case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+		case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
+			exists = TRUE;
+			break;
+		default:
+			return;
 	}
 
-	path = choices_find_xdg_path_load(type->media_type, "MIME-thumb",
-					  SITE);
-
-	return path;
+	leaf = g_file_get_basename(file);
+	thumb_index_note_leaf((ThumbDir *) data, leaf, exists);
+	g_free(leaf);
 }
 
-/* Called in a subprocess. Load path and create the thumbnail
- * file. Parent will notice when we die.
+/* Fill in tinfo from the Thumb::MTime and Thumb::Size text chunks of the PNG
+ * file 'thumb_path', without decoding the image. These usually come before
+ * the image data, but may follow it; other chunks are skipped over, so we
+ * only read the chunk headers until both have been found.
+ * tinfo->mtime is -1 if the file can't be read or isn't a valid thumbnail.
  */
-static void child_create_thumbnail(const gchar *path, MIME_type *type)
+static void read_thumb_text(const char *thumb_path, ThumbInfo *tinfo)
 {
-	GdkPixbuf *image=NULL;
+	static const guchar png_sig[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+	guchar header[8];
+	gchar text[1024];
+	FILE *file;
 
-        if(strcmp(type->subtype, "jpeg")==0)
-            image=extract_tiff_thumbnail(path);
+	tinfo->have_text = TRUE;
+	tinfo->mtime = -1;
+	tinfo->size = -1;
 
-	if(!image)
-            image = rox_pixbuf_new_from_file_at_scale(path,
-			PIXMAP_THUMB_SIZE, PIXMAP_THUMB_SIZE, TRUE, NULL);
+	file = fopen(thumb_path, "rb");
+	if (!file)
+		return;
 
-	if (image)
-		save_thumbnail(path, image);
+	if (fread(header, 1, 8, file) != 8 || memcmp(header, png_sig, 8) != 0)
+		goto out;
+
+	/* Each chunk is length, type, data, CRC */
+	while (fread(header, 1, 8, file) == 8)
+	{
+		guint32 len;
+		gchar *value;
+
+		len = (header[0] << 24) | (header[1] << 16) |
+		      (header[2] << 8) | header[3];
+
+		if (memcmp(header + 4, "IEND", 4) == 0)
+			break;
+
+		if (memcmp(header + 4, "tEXt", 4) != 0 || len >= sizeof(text))
+		{
+			if (fseek(file, (long) len + 4, SEEK_CUR))
+				break;
+			continue;
+		}
+
+		if (fread(text, 1, len, file) != len)
+			break;
+		text[len] = '\0';
+		fseek(file, 4, SEEK_CUR);
+
+		/* Keyword, NUL, value */
+		value = memchr(text, '\0', len);
+		if (!value)
+			continue;
+		value++;
 
-	/* (no need to unref, as we're about to exit) */
+		if (strcmp(text, "Thumb::MTime") == 0)
+			tinfo->mtime = (time_t) atol(value);
+		else if (strcmp(text, "Thumb::Size") == 0)
+			tinfo->size = (off_t) g_ascii_strtoull(value, NULL, 10);
+
+		if (tinfo->mtime != -1 && tinfo->size != -1)
+			break;
+	}
+out:
+	fclose(file);
 }
 
-/* Called when the child process exits */
-static void thumbnail_child_done(ChildThumbnail *info)
+/* Check if we have an up-to-date thumbnail for this image, in any of the
+ * thumbnail directories. If so, return it. Otherwise, returns NULL.
+ * Only the PNG's text chunks are read until we know the thumbnail is valid.
+ */
+static GdkPixbuf *get_thumbnail_for(const char *pathname)
 {
-	GdkPixbuf *thumb;
+	GdkPixbuf *thumb = NULL;
+	char *md5;
+	struct stat info;
+	gboolean statted = FALSE;
+	time_t now;
+	int i;
 
-	thumb = get_thumbnail_for(info->path);
+	md5 = thumbnail_md5(pathname);
 
-	if (thumb)
+	for (i = 0; i < thumb_dirs->len && !thumb; i++)
 	{
-		MaskedPixmap *image;
+		ThumbDir *tdir = g_ptr_array_index(thumb_dirs, i);
+		ThumbInfo *tinfo, unindexed;
+		gchar *thumb_path;
 
-		image = masked_pixmap_new(thumb);
-		g_object_unref(thumb);
+		if (thumb_index_load(tdir))
+		{
+			tinfo = g_hash_table_lookup(tdir->index, md5);
+			if (!tinfo)
+				continue;	/* Don't bother trying to open it */
+		}
+		else if (tdir->missing)
+			continue;
+		else
+		{
+			unindexed.have_text = FALSE;
+			tinfo = &unindexed;
+		}
 
-		g_fscache_insert(pixmap_cache, info->path, image, FALSE);
-		g_object_unref(image);
+		thumb_path = g_strdup_printf("%s/%s.png", tdir->path, md5);
 
-		info->callback(info->data, info->path);
+		if (!tinfo->have_text)
+			read_thumb_text(thumb_path, tinfo);
+
+		if (tinfo->mtime == -1)
+			goto next;
+
+		if (!statted)
+		{
+			if (mc_stat(pathname, &info) != 0)
+			{
+				g_free(thumb_path);
+				break;
+			}
+			statted = TRUE;
+		}
+
+		time(&now);
+		if (info.st_mtime != tinfo->mtime &&
+		    now > tinfo->mtime + PIXMAP_THUMB_TOO_OLD_TIME)
+			goto next;
+
+		if (tinfo->size != -1 && info.st_size < tinfo->size)
+			goto next;
+
+		thumb = gdk_pixbuf_new_from_file(thumb_path, NULL);
+next:
+		g_free(thumb_path);
 	}
-	else
-		info->callback(info->data, NULL);
 
-	g_free(info->path);
-	g_free(info);
-}
+	g_free(md5);
 
+	return thumb;
+}
 
-/* Check if we have an up-to-date thumbnail for this image.
- * If so, return it. Otherwise, returns NULL.
+/* TRUE if we failed to thumbnail this file before, and it hasn't changed
+ * since then.
  */
-static GdkPixbuf *get_thumbnail_for(const char *pathname)
+static gboolean thumbnail_failed(const char *pathname)
 {
-	GdkPixbuf *thumb = NULL;
-	char *thumb_path, *md5, *uri, *path;
-	const char *ssize, *smtime;
+	ThumbInfo *tinfo;
 	struct stat info;
-	time_t ttime, now;
+	gchar *md5;
+	gboolean failed = FALSE;
 
-	path = pathdup(pathname);
-	uri = g_filename_to_uri(path, NULL, NULL);
-	if(!uri)
-	        uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
-	g_free(uri);
+	/* (no point trying to open files if there's no index) */
+	if (!thumb_index_load(thumb_fail_dir))
+		return FALSE;
+
+	md5 = thumbnail_md5(pathname);
+
+	tinfo = g_hash_table_lookup(thumb_fail_dir->index, md5);
+	if (tinfo && !tinfo->have_text)
+	{
+		gchar *fail_path;
+
+		fail_path = g_strdup_printf("%s/%s.png",
+					    thumb_fail_dir->path, md5);
+		read_thumb_text(fail_path, tinfo);
+		g_free(fail_path);
+	}
+
+	if (tinfo && tinfo->mtime != -1 && mc_stat(pathname, &info) == 0)
+		failed = info.st_mtime == tinfo->mtime;
 
-	thumb_path = g_strdup_printf("%s/.thumbnails/normal/%s.png",
-					home_dir, md5);
 	g_free(md5);
 
-	thumb = gdk_pixbuf_new_from_file(thumb_path, NULL);
-	if (!thumb)
-		goto err;
+	return failed;
+}
 
-	/* Note that these don't need freeing... */
-	ssize = gdk_pixbuf_get_option(thumb, "tEXt::Thumb::Size");
-	/* This is optional, so don't flag an error if it is missing */
+/* Record that no thumbnail could be made for this file, so that we don't try
+ * again (even after a restart) until it's modified. As other programs do,
+ * this is an empty PNG in the "fail" directory with the file's URI and
+ * mtime.
+ */
+static void save_failed_thumbnail(const char *pathname)
+{
+	struct stat info;
+	GdkPixbuf *pixbuf;
+	gchar *uri, *md5, *fail_path, *tmp_path, *smtime;
 
-	smtime = gdk_pixbuf_get_option(thumb, "tEXt::Thumb::MTime");
-	if (!smtime)
-		goto err;
+	if (mc_stat(pathname, &info) != 0)
+		return;
 
-	if (mc_stat(path, &info) != 0)
-		goto err;
+	uri = thumbnail_uri(pathname);
+	md5 = uri_md5(uri);
+	smtime = g_strdup_printf("%ld", (long) info.st_mtime);
 
-	ttime=(time_t) atol(smtime);
-	time(&now);
-	if (info.st_mtime != ttime && now>ttime+PIXMAP_THUMB_TOO_OLD_TIME)
-		goto err;
+	g_mkdir_with_parents(thumb_fail_dir->path, 0700);
+	fail_path = g_strdup_printf("%s/%s.png", thumb_fail_dir->path, md5);
+	tmp_path = g_strdup_printf("%s.ROX-Filer-%ld", fail_path,
+				   (long) getpid());
 
-	if (ssize && info.st_size < atol(ssize))
-		goto err;
+	pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, 1, 1);
+	gdk_pixbuf_fill(pixbuf, 0);
 
-	goto out;
-err:
-	if (thumb)
-		g_object_unref(thumb);
-	thumb = NULL;
-out:
-	g_free(path);
-	g_free(thumb_path);
-	return thumb;
+	if (gdk_pixbuf_save(pixbuf, tmp_path, "png", NULL,
+			"tEXt::Thumb::URI", uri,
+			"tEXt::Thumb::MTime", smtime,
+			"tEXt::Software", PROJECT,
+			NULL))
+	{
+		chmod(tmp_path, 0600);
+		if (rename(tmp_path, fail_path) == 0)
+			thumb_index_note(thumb_fail_dir, md5, TRUE);
+		else
+			unlink(tmp_path);
+	}
+
+	g_object_unref(pixbuf);
+	g_free(tmp_path);
+	g_free(fail_path);
+	g_free(smtime);
+	g_free(md5);
+	g_free(uri);
 }
 
 /* Load the image 'path' and return a pointer to the resulting
@@ -832,6 +1952,33 @@ static MaskedPixmap *get_bad_image(void)
 	return mp;
 }
 
+static gsize pixbuf_size(GdkPixbuf *pixbuf)
+{
+	if (!pixbuf)
+		return 0;
+
+	return gdk_pixbuf_get_rowstride(pixbuf) * gdk_pixbuf_get_height(pixbuf);
+}
+
+/* The memory used by this image's pixbufs, for pixmap_cache's budget.
+ * The small and huge versions are counted once they've been made
+ * (pixmap_make_small() and pixmap_make_huge() update the total).
+ */
+static gsize masked_pixmap_size(MaskedPixmap *mp, gpointer data)
+{
+	gsize size;
+
+	size = sizeof(MaskedPixmap) + pixbuf_size(mp->src_pixbuf);
+	if (mp->pixbuf != mp->src_pixbuf)
+		size += pixbuf_size(mp->pixbuf);
+	if (mp->sm_pixbuf != mp->src_pixbuf)
+		size += pixbuf_size(mp->sm_pixbuf);
+	if (mp->huge_pixbuf != mp->src_pixbuf)
+		size += pixbuf_size(mp->huge_pixbuf);
+
+	return size;
+}
+
 /* Called now and then to clear out old pixmaps */
 static gint purge(gpointer data)
 {
@@ -983,35 +2130,43 @@ static void load_default_pixmaps(void)
 	}
 }
 
-/* Also purges memory cache */
-static void purge_disk_cache(GtkWidget *button, gpointer data)
+/* Add the paths of all the thumbnails in tdir to 'list' */
+static void purge_thumb_dir(ThumbDir *tdir, GList **list)
 {
-	char *path;
-	GList *list = NULL;
 	DIR *dir;
 	struct dirent *ent;
 
-	g_fscache_purge(pixmap_cache, 0);
-
-	path = g_strconcat(home_dir, "/.thumbnails/normal/", NULL);
-
-	dir = opendir(path);
+	dir = opendir(tdir->path);
 	if (!dir)
 	{
-		report_error(_("Can't delete thumbnails in %s:\n%s"),
-				path, g_strerror(errno));
-		goto out;
+		if (errno != ENOENT)
+			report_error(_("Can't delete thumbnails in %s:\n%s"),
+					tdir->path, g_strerror(errno));
+		return;
 	}
 
 	while ((ent = readdir(dir)))
 	{
 		if (ent->d_name[0] == '.')
 			continue;
-		list = g_list_prepend(list,
-				      g_strconcat(path, ent->d_name, NULL));
+		*list = g_list_prepend(*list, g_build_filename(tdir->path,
+							ent->d_name, NULL));
 	}
 
 	closedir(dir);
+}
+
+/* Also purges memory cache, and forgets which files couldn't be done */
+static void purge_disk_cache(GtkWidget *button, gpointer data)
+{
+	GList *list = NULL;
+	int i;
+
+	g_fscache_purge(pixmap_cache, 0);
+
+	for (i = 0; i < thumb_dirs->len; i++)
+		purge_thumb_dir(g_ptr_array_index(thumb_dirs, i), &list);
+	purge_thumb_dir(thumb_fail_dir, &list);
 
 	if (list)
 	{
@@ -1020,8 +2175,6 @@ static void purge_disk_cache(GtkWidget *button, gpointer data)
 	}
 	else
 		info_message(_("There are no thumbnails to delete"));
-out:
-	g_free(path);
 }
 
 static GList *thumbs_purge_cache(Option *option, xmlNode *node, guchar *label)
@@ -1092,55 +2245,108 @@ static int s2n(const unsigned char *dat, int off, int len, char format)
     return 0;
 }
 
+/*
+ * Find the Exif APP1 segment of a JPEG file and return its contents after
+ * the "Exif\0\0" header (ie, the TIFF data), or NULL if there isn't one.
+ * Only the headers of the segments before it are read, not the image.
+ * g_free() the result.
+ */
+static unsigned char *read_exif_segment(int fd, int *length)
+{
+    unsigned char header[10];
+    off_t pos=2;
+
+    if(pread(fd, header, 2, 0)!=2 || header[0]!=0xff || header[1]!=0xd8)
+        return NULL;	/* Not a JPEG */
+
+    /* Each segment is 0xff, type, 2-byte length (including itself), data.
+     * Exif data always comes before the start of the image (SOS).
+     */
+    for(;;) {
+        int seglen;
+
+        if(pread(fd, header, 10, pos)!=10 || header[0]!=0xff)
+            return NULL;
+
+        if(header[1]==0xff) {
+            pos++;	/* Fill byte */
+            continue;
+        }
+
+        if(header[1]==0xda || header[1]==0xd9)
+            return NULL;	/* SOS or EOI */
+
+        seglen=header[2]*256+header[3];
+        if(seglen<2)
+            return NULL;
+
+        if(header[1]==0xe1 && seglen>8 &&
+           memcmp(header+4, "Exif\0\0", 6)==0) {
+            unsigned char *data;
+
+            *length=seglen-8;
+            data=g_new(unsigned char, *length);
+            if(pread(fd, data, *length, pos+10)!=*length) {
+                g_free(data);
+                return NULL;
+            }
+
+            return data;
+        }
+
+        pos+=2+seglen;
+    }
+}
+
 /*
  * Load header of JPEG/Exif file and attempt to extract the embedded
- * thumbnail.  Return NULL on failure.
+ * thumbnail. Return NULL on failure, or if the thumbnail is smaller than
+ * min_size in both directions.
  */
-static GdkPixbuf *extract_tiff_thumbnail(const gchar *path)
+static GdkPixbuf *extract_tiff_thumbnail(const gchar *path, int min_size)
 {
-    FILE *in;
-    unsigned char header[256];
-    int i, n;
+    int fd;
+    int i;
     int length;
     unsigned char *data;
     char format;
     int ifd, entries;
     int thumb=0, tlength=0;
     GdkPixbuf *buf=NULL;
+    GdkPixbufLoader *loader;
+    gboolean ok;
 
-    in=fopen(path, "rb");
-    if(!in) {
-        return NULL;
-    }
-
-    /* Check for Exif format */
-    n=fread(header, 1, 12, in);
-    if(n!=12 || strncmp((char *) header, "\377\330\377\341", 4)!=0 ||
-       strncmp((char *)header+6, "Exif", 4)!=0) {
-        fclose(in);
+    fd=open(path, O_RDONLY);
+    if(fd==-1) {
         return NULL;
     }
 
-    /* Read header */
-    length=header[4]*256+header[5];
-    data=g_new(unsigned char, length);
-    n=fread(data, 1, length, in);
-    fclose(in);   /* File no longer needed */
-    if(n!=length) {
-        g_free(data);
+    data=read_exif_segment(fd, &length);
+    close(fd);    /* File no longer needed */
+    if(!data)
         return NULL;
-    }
 
     /* Big or little endian (as 'M' or 'I') */
     format=data[0];
+    if(length<8 || (format!='M' && format!='I'))
+        goto out;
 
     /* Skip over main section */
     ifd=s2n(data, 4, 4, format);
+    if(ifd<8 || ifd>length-2)
+        goto out;
     entries=s2n(data, ifd, 2, format);
 
-    /* Second section contains data on thumbnail */
+    /* Second section contains data on thumbnail. Offsets come from the
+       file, so compare them without adding to them (that could overflow) */
+    if(12*entries+6>length-ifd)
+        goto out;
     ifd=s2n(data, ifd+2+12*entries, 4, format);
+    if(ifd<8 || ifd>length-2)
+        goto out;
     entries=s2n(data, ifd, 2, format);
+    if(12*entries+2>length-ifd)
+        goto out;
 
     /* Loop over the entries */
     for(i=0; i<entries; i++) {
@@ -1161,34 +2367,31 @@ static GdkPixbuf *extract_tiff_thumbnail(const gchar *path)
         }
     }
 
-    if(thumb && tlength) {
-        GError *err=NULL;
-        GdkPixbufLoader *loader;
-
-        /* Don't read outside the header (some files have incorrect data) */
-        if(thumb+tlength>length)
-            tlength=length-thumb;
+    if(thumb<=0 || tlength<=0 || thumb>=length)
+        goto out;
 
-        loader=gdk_pixbuf_loader_new();
-        gdk_pixbuf_loader_write(loader, data+thumb, tlength, &err);
-        if(err) {
-            g_error_free(err);
-            return NULL;
-        }
+    /* Don't read outside the header (some files have incorrect data) */
+    if(tlength>length-thumb)
+        tlength=length-thumb;
 
-        gdk_pixbuf_loader_close(loader, &err);
-        if(err) {
-            g_error_free(err);
-            return NULL;
-        }
+    loader=gdk_pixbuf_loader_new();
+    ok=gdk_pixbuf_loader_write(loader, data+thumb, tlength, NULL);
+    if(!gdk_pixbuf_loader_close(loader, NULL))
+        ok=FALSE;
 
+    if(ok)
         buf=gdk_pixbuf_loader_get_pixbuf(loader);
-        g_object_ref(buf);      /* Ref the image before we unref the loader */
-        g_object_unref(loader);
+    if(buf) {
+        if(gdk_pixbuf_get_width(buf)<min_size &&
+           gdk_pixbuf_get_height(buf)<min_size)
+            buf=NULL;   /* Too small to use */
+        else
+            g_object_ref(buf);  /* Ref the image before we unref the loader */
     }
+    g_object_unref(loader);
 
+out:
     g_free(data);
 
     return buf;
 }
-
@@ -68,7 +68,9 @@ void pixmap_make_huge(MaskedPixmap *mp);
 void pixmap_make_small(MaskedPixmap *mp);
 MaskedPixmap *load_pixmap(const char *name);
 void pixmap_background_thumb(const gchar *path, GFunc callback, gpointer data);
+int pixmap_thumb_jobs(void);
 MaskedPixmap *pixmap_try_thumb(const gchar *path, gboolean can_load);
+void pixmap_preload(const gchar *path, GFunc callback, gpointer data);
 MaskedPixmap *masked_pixmap_new(GdkPixbuf *full_size);
 GdkPixbuf *scale_pixbuf(GdkPixbuf *src, int max_w, int max_h);
 
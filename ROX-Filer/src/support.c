@@ -38,6 +38,12 @@
 #include <libxml/parser.h>
 #include <math.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <utime.h>
+#ifdef HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
 
 #include "global.h"
 
@@ -52,8 +58,22 @@
 static GHashTable *uid_hash = NULL;	/* UID -> User name */
 static GHashTable *gid_hash = NULL;	/* GID -> Group name */
 
+struct _WorkerPool {
+	GThreadPool *pool;
+	GFunc	func;
+	gint	threads;
+	gint	outstanding;	/* Pushed but not finished (atomic) */
+};
+
+/* Every WorkerPool, so that they can all be paused */
+static GList *worker_pools = NULL;
+
 /* Static prototypes */
+static void worker_pool_run(gpointer data, gpointer user_data);
 static void MD5Transform(guint32 buf[4], guint32 const in[16]);
+static guchar *copy_file_spawn(const guchar *from, const guchar *to);
+static int copy_file_data(int in, int out, off_t size,
+			  CopyProgressFn progress);
 
 /****************************************************************
  *			EXTERNAL INTERFACE			*
@@ -583,33 +603,93 @@ char *pretty_time(const time_t *time)
 #  define O_NOFOLLOW 0x0
 #endif
 
+/* Size of the buffer used when the kernel can't copy the data for us */
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+/* How much to have the kernel copy between progress reports */
+#define COPY_RANGE_CHUNK (64 * 1024 * 1024)
+
 /* 'from' and 'to' are complete pathnames of files (not dirs or symlinks).
- * This spawns 'cp' to do the copy if lstat() succeeds, otherwise we
- * do the copy manually using vfs.
+ * Regular files are copied here, preserving the mode, ownership and
+ * timestamps (but not extended attributes; use xattr_copy() for those).
+ * Anything else (devices, fifos) is passed to cp(1).
+ * If 'progress' isn't NULL, it is called as the data is copied.
  *
  * Returns an error string, or NULL on success. g_free() the result.
- *
- * XXX: This was only used for libvfs...
  */
-guchar *copy_file(const guchar *from, const guchar *to)
+guchar *copy_file(const guchar *from, const guchar *to,
+		  CopyProgressFn progress)
 {
-#if defined(HAVE_GETXATTR) || defined(HAVE_ATTROPEN)
-//	const char *argv[] = {"cp", "-pRf", "--preserve=xattr", NULL, NULL, NULL};
-// Puppy linux's cp hasn't support of xattr.
-// So this aims same result without using 'xattr'
-	const char *argv[] = {"cp", "-af",
-		"--no-preserve=context,links", NULL, NULL, NULL};
+	struct stat info;
+	int	in, out;
+	int	err = 0;
 
-	argv[3] = from;
-	argv[4] = to;
+	if (mc_lstat(from, &info))
+		return g_strdup(g_strerror(errno));
+
+	if (!S_ISREG(info.st_mode))
+		return copy_file_spawn(from, to);
+
+	in = open(from, O_RDONLY | O_NOFOLLOW);
+	if (in == -1)
+		return g_strdup(g_strerror(errno));
+
+	/* Start private; the real permissions are set once we've finished */
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+	if (out == -1 && errno != ENOENT)
+	{
+		/* Like cp -f: remove the destination and try again */
+		unlink(to);
+		out = open(to, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	}
+	if (out == -1)
+	{
+		err = errno;
+		close(in);
+		return g_strdup(g_strerror(err));
+	}
+
+	if (copy_file_data(in, out, info.st_size, progress))
+		err = errno;
+	else
+	{
+		/* Ownership first, since chown() may clear the SetUID bit.
+		 * Only root can give files away, so ignore errors here.
+		 */
+		if (fchown(out, info.st_uid, info.st_gid))
+			(void) fchown(out, -1, info.st_gid);
+
+		if (fchmod(out, info.st_mode & 07777) && errno != EPERM)
+			err = errno;
+		else
+		{
+#ifdef HAVE_FUTIMENS
+			struct timespec times[2];
+
+			times[0] = info.st_atim;
+			times[1] = info.st_mtim;
+			futimens(out, times);
 #else
-	const char *argv[] = {"cp", "-pRf", NULL, NULL, NULL};
+			struct utimbuf utb;
 
-	argv[2] = from;
-	argv[3] = to;
+			utb.actime = info.st_atime;
+			utb.modtime = info.st_mtime;
+			utime(to, &utb);
 #endif
+		}
+	}
 
-	return fork_exec_wait(argv);
+	close(in);
+	if (close(out) && !err)
+		err = errno;	/* (eg, NFS reporting a full disk late) */
+
+	if (err)
+	{
+		unlink(to);
+		return g_strdup(g_strerror(err));
+	}
+
+	return NULL;
 }
 
 /* 'word' has all special characters escaped so that it may be inserted
@@ -864,14 +944,6 @@ char *readlink_dup(const char *source)
 
 #define md5byte unsigned char
 
-typedef struct _MD5Context MD5Context;
-
-struct _MD5Context {
-	guint32 buf[4];
-	guint32 bytes[2];
-	guint32 in[16];
-};
-
 #if G_BYTE_ORDER == G_BIG_ENDIAN
 static void byteSwap(guint32 *buf, unsigned words)
 {
@@ -929,6 +1001,16 @@ static void MD5Update(MD5Context *ctx, md5byte const *buf, unsigned len)
 	len -= t;
 
 	/* Process data in 64-byte chunks */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+	/* Aligned data can be used in place */
+	if (((gsize) buf & 3) == 0) {
+		while (len >= 64) {
+			MD5Transform(ctx->buf, (guint32 const *) buf);
+			buf += 64;
+			len -= 64;
+		}
+	}
+#endif
 	while (len >= 64) {
 		memcpy(ctx->in, buf, 64);
 		byteSwap(ctx->in, 16);
@@ -948,6 +1030,7 @@ static void MD5Update(MD5Context *ctx, md5byte const *buf, unsigned len)
  */
 static char *MD5Final(MD5Context *ctx)
 {
+	static const char hex[] = "0123456789abcdef";
 	char *retval;
 	int i;
 	int count = ctx->bytes[0] & 0x3f;	/* Number of bytes in ctx->in */
@@ -979,8 +1062,10 @@ static char *MD5Final(MD5Context *ctx)
 
 	retval = g_malloc(33);
 	bytes = (guint8 *) ctx->buf;
-	for (i = 0; i < 16; i++)
-		sprintf(retval + (i * 2), "%02x", bytes[i]);
+	for (i = 0; i < 16; i++) {
+		retval[i * 2] = hex[bytes[i] >> 4];
+		retval[i * 2 + 1] = hex[bytes[i] & 0xf];
+	}
 	retval[32] = '\0';
 
 	return retval;
@@ -1000,6 +1085,13 @@ static char *MD5Final(MD5Context *ctx)
 #define MD5STEP(f,w,x,y,z,in,s) \
 	 (w += f(x,y,z) + in, w = (w<<s | w>>(32-s)) + x)
 
+/* F2 is (x & z) | (y & ~z). The two halves have no bits in common, so they
+ * can be added separately. x is the result of the previous step, so this
+ * lets most of the step be done before it is ready.
+ */
+#define MD5STEP2(w,x,y,z,in,s) \
+	 (w += (in) + (y & ~z), w += (x & z), w = (w<<s | w>>(32-s)) + x)
+
 /*
  * The core of the MD5 algorithm, this alters an existing MD5 hash to
  * reflect the addition of 16 longwords of new data.  MD5Update blocks
@@ -1031,22 +1123,22 @@ static void MD5Transform(guint32 buf[4], guint32 const in[16])
 	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
 	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
 
-	MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-	MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-	MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-	MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-	MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+	MD5STEP2(a, b, c, d, in[1] + 0xf61e2562, 5);
+	MD5STEP2(d, a, b, c, in[6] + 0xc040b340, 9);
+	MD5STEP2(c, d, a, b, in[11] + 0x265e5a51, 14);
+	MD5STEP2(b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+	MD5STEP2(a, b, c, d, in[5] + 0xd62f105d, 5);
+	MD5STEP2(d, a, b, c, in[10] + 0x02441453, 9);
+	MD5STEP2(c, d, a, b, in[15] + 0xd8a1e681, 14);
+	MD5STEP2(b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+	MD5STEP2(a, b, c, d, in[9] + 0x21e1cde6, 5);
+	MD5STEP2(d, a, b, c, in[14] + 0xc33707d6, 9);
+	MD5STEP2(c, d, a, b, in[3] + 0xf4d50d87, 14);
+	MD5STEP2(b, c, d, a, in[8] + 0x455a14ed, 20);
+	MD5STEP2(a, b, c, d, in[13] + 0xa9e3e905, 5);
+	MD5STEP2(d, a, b, c, in[2] + 0xfcefa3f8, 9);
+	MD5STEP2(c, d, a, b, in[7] + 0x676f02d9, 14);
+	MD5STEP2(b, c, d, a, in[12] + 0x8d2a4c8a, 20);
 
 	MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
 	MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
@@ -1099,6 +1191,28 @@ char *md5_hash(const char *message)
 	return MD5Final(&ctx);
 }
 
+/* Start hashing a message which begins with 'prefix'. 'ctx' can then be
+ * passed to md5_hash_finish() any number of times, so that the prefix is
+ * only hashed once for a whole set of messages (eg, all the URIs in one
+ * directory).
+ */
+void md5_hash_start(MD5Context *ctx, const char *prefix)
+{
+	MD5Init(ctx);
+	MD5Update(ctx, prefix, strlen(prefix));
+}
+
+/* Returns the hash of the prefix given to md5_hash_start() followed by
+ * 'rest'. 'prefix_ctx' is not changed. g_free() the result.
+ */
+char *md5_hash_finish(const MD5Context *prefix_ctx, const char *rest)
+{
+	MD5Context ctx = *prefix_ctx;
+
+	MD5Update(&ctx, rest, strlen(rest));
+	return MD5Final(&ctx);
+}
+
 /* Convert string 'src' from the current locale to UTF-8 */
 gchar *to_utf8(const gchar *src)
 {
@@ -1774,3 +1888,193 @@ gchar *find_app(const char *appname)
   g_strfreev(search);
   return app;
 }
+
+/* Like g_thread_pool_new(), but the pool lasts for the whole session and
+ * worker_pools_pause() can stop it while we fork(). func(data, NULL) is
+ * called in a thread for each item pushed.
+ */
+WorkerPool *worker_pool_new(GFunc func, gint threads, GError **error)
+{
+	WorkerPool *pool;
+
+	pool = g_new(WorkerPool, 1);
+	pool->func = func;
+	pool->threads = threads;
+	pool->outstanding = 0;
+	pool->pool = g_thread_pool_new(worker_pool_run, pool, threads,
+				       FALSE, error);
+	if (!pool->pool)
+	{
+		g_free(pool);
+		return NULL;
+	}
+
+	worker_pools = g_list_prepend(worker_pools, pool);
+
+	return pool;
+}
+
+void worker_pool_push(WorkerPool *pool, gpointer data)
+{
+	g_atomic_int_inc(&pool->outstanding);
+	g_thread_pool_push(pool->pool, data, NULL);
+}
+
+/* A child must not run GLib code while another thread might have been
+ * holding one of its locks when we forked. Stop the pools starting anything
+ * new and wait for whatever they're doing to finish. Queued work waits until
+ * worker_pools_resume().
+ */
+void worker_pools_pause(void)
+{
+	GList	*next;
+
+	for (next = worker_pools; next; next = next->next)
+	{
+		WorkerPool *pool = (WorkerPool *) next->data;
+
+		g_thread_pool_set_max_threads(pool->pool, 0, NULL);
+	}
+
+	for (next = worker_pools; next; next = next->next)
+	{
+		WorkerPool *pool = (WorkerPool *) next->data;
+
+		while (g_atomic_int_get(&pool->outstanding) >
+		       (gint) g_thread_pool_unprocessed(pool->pool))
+			g_usleep(1000);
+	}
+}
+
+void worker_pools_resume(void)
+{
+	GList	*next;
+
+	for (next = worker_pools; next; next = next->next)
+	{
+		WorkerPool *pool = (WorkerPool *) next->data;
+
+		g_thread_pool_set_max_threads(pool->pool, pool->threads, NULL);
+	}
+}
+
+/* Use cp to copy something that isn't a regular file */
+static void worker_pool_run(gpointer data, gpointer user_data)
+{
+	WorkerPool *pool = (WorkerPool *) user_data;
+
+	pool->func(data, NULL);
+
+	g_atomic_int_add(&pool->outstanding, -1);
+}
+
+static guchar *copy_file_spawn(const guchar *from, const guchar *to)
+{
+#if defined(HAVE_GETXATTR) || defined(HAVE_ATTROPEN)
+//	const char *argv[] = {"cp", "-pRf", "--preserve=xattr", NULL, NULL, NULL};
+// Puppy linux's cp hasn't support of xattr.
+// So this aims same result without using 'xattr'
+	const char *argv[] = {"cp", "-af",
+		"--no-preserve=context,links", NULL, NULL, NULL};
+
+	argv[3] = from;
+	argv[4] = to;
+#else
+	const char *argv[] = {"cp", "-pRf", NULL, NULL, NULL};
+
+	argv[2] = from;
+	argv[3] = to;
+#endif
+
+	return fork_exec_wait(argv);
+}
+
+/* Copy the contents of 'in' (which is 'size' bytes long) to 'out'.
+ * Try sharing the blocks (a reflink) first, then have the kernel copy the
+ * data, and only read and write it ourselves if neither works here.
+ * 'size' may be wrong (eg, files in /proc say they're empty), so we copy
+ * until the end of the file rather than trusting it.
+ * Returns 0 on success, or -1 with errno set.
+ */
+static int copy_file_data(int in, int out, off_t size,
+			  CopyProgressFn progress)
+{
+	gchar	*buffer;
+	ssize_t got;
+	off_t	done = 0;
+
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0)
+	{
+		if (progress)
+			progress(size);
+		return 0;
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (1)
+	{
+		got = copy_file_range(in, NULL, out, NULL,
+				      COPY_RANGE_CHUNK, 0);
+		if (got > 0)
+		{
+			done += got;
+			if (progress)
+				progress(got);
+		}
+		else if (got == 0 && done > 0)
+			return 0;
+		else if (got == 0)
+			break;	/* Empty, or a file the kernel can't copy */
+		else if (errno == EINTR)
+			continue;
+		else if (done == 0 && (errno == ENOSYS || errno == EXDEV ||
+			 errno == EINVAL || errno == EOPNOTSUPP ||
+			 errno == EBADF))
+			break;	/* Not supported for these files */
+		else
+			return -1;
+	}
+#endif
+
+	buffer = g_malloc(COPY_BUFFER_SIZE);
+
+	while (1)
+	{
+		gchar	*p;
+
+		got = read(in, buffer, COPY_BUFFER_SIZE);
+		if (got == 0)
+			break;
+		if (got < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			goto err;
+		}
+
+		for (p = buffer; got > 0;)
+		{
+			ssize_t written;
+
+			written = write(out, p, got);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				goto err;
+			}
+			p += written;
+			got -= written;
+			if (progress)
+				progress(written);
+		}
+	}
+
+	g_free(buffer);
+	return 0;
+err:
+	g_free(buffer);
+	return -1;
+}
@@ -9,8 +9,29 @@
 #define PRETTY_SIZE_LIMIT 10000
 #define TIME_FORMAT "%T %d %b %Y"
 
+#include <dirent.h>
 #include <glib-object.h>
 
+/* The S_IFMT bits for a directory entry, if readdir() says, or 0 */
+#if defined(_DIRENT_HAVE_D_TYPE) && defined(DTTOIF)
+# define DIRENT_TYPE(ent) \
+	((ent)->d_type == DT_UNKNOWN ? 0 : DTTOIF((ent)->d_type))
+#else
+# define DIRENT_TYPE(ent) 0
+#endif
+
+/* State of an MD5 hash in progress (see md5_hash_start()) */
+typedef struct _MD5Context MD5Context;
+
+/* Called as data is copied, with the number of bytes just copied */
+typedef void (*CopyProgressFn)(off_t bytes);
+
+struct _MD5Context {
+	guint32 buf[4];
+	guint32 bytes[2];
+	guint32 in[16];
+};
+
 XMLwrapper *xml_cache_load(const gchar *pathname);
 int save_xml_file(xmlDocPtr doc, const gchar *filename);
 xmlDocPtr soap_new(xmlNodePtr *ret_body);
@@ -31,7 +52,8 @@ char *get_local_path(const EscapedPath *escaped_uri);
 void close_on_exec(int fd, gboolean close);
 void set_blocking(int fd, gboolean blocking);
 char *pretty_time(const time_t *time);
-guchar *copy_file(const guchar *from, const guchar *to);
+guchar *copy_file(const guchar *from, const guchar *to,
+		  CopyProgressFn progress);
 guchar *shell_escape(const guchar *word);
 gboolean is_sub_dir(const char *sub, const char *parent);
 gboolean in_list(const guchar *item, const guchar *list);
@@ -43,6 +65,8 @@ gchar *to_utf8(const gchar *src);
 gchar *from_utf8(const gchar *src);
 void ensure_utf8(gchar **string);
 char *md5_hash(const char *message);
+void md5_hash_start(MD5Context *ctx, const char *prefix);
+char *md5_hash_finish(const MD5Context *prefix_ctx, const char *rest);
 gchar *expand_path(const gchar *path);
 void destroy_glist(GList **list);
 void null_g_free(gpointer p);
@@ -71,5 +95,9 @@ gboolean get_values_from_desktop_file(const char *path,
 				      gchar **value, ...);
 gchar *build_command_with_path(const char *cmd, const char *path);
 gchar *find_app(const char *appname);
+WorkerPool *worker_pool_new(GFunc func, gint threads, GError **error);
+void worker_pool_push(WorkerPool *pool, gpointer data);
+void worker_pools_pause(void);
+void worker_pools_resume(void);
 
 #endif /* _SUPPORT_H */
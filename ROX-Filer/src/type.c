@@ -50,6 +50,7 @@
 #include "type.h"
 #include "support.h"
 #include "diritem.h"
+#include "dir.h"
 #include "dnd.h"
 #include "options.h"
 #include "filer.h"
@@ -93,6 +94,11 @@ static gboolean remove_handler_with_confirm(const guchar *path);
 static void set_icon_theme(void);
 static GList *build_icon_theme(Option *option, xmlNode *node, guchar *label);
 static char *find_default_desktop_app(MIME_type *type);
+static void watch_mime_dirs(void);
+static void watch_mime_icon_dirs(void);
+static GtkIconTheme *new_icon_theme(void);
+static void expire_mime_icons(void);
+static gboolean preload_start(gpointer data);
 
 /* Hash of all allocated MIME types, indexed by "media/subtype".
  * MIME_type structs are never freed; this table prevents memory leaks
@@ -122,11 +128,36 @@ static GtkIconTheme *icon_theme = NULL;
 static GtkIconTheme *rox_theme = NULL;
 static GtkIconTheme *gnome_theme = NULL;
 
+/* Icons to preload soon after startup (see preload_next()) */
+#define PRELOAD_START_DELAY 2000	/* ms after startup */
+#define PRELOAD_MAX_PENDING 4		/* Icons being loaded at once */
+
+static GPtrArray *preload_names = NULL;	/* Types still to do */
+static int preload_pending = 0;		/* Calls to pixmap_preload() */
+static guint preload_source = 0;	/* Idle or timeout, or 0 */
+
+/* Monitors on each <data dir>/mime directory, so that we reload the database
+ * when update-mime-database runs instead of polling it.
+ */
+static GList *mime_dir_monitors = NULL;
+static gint mime_reload_timeout = 0;
+
+/* Files in the icon themes' directories are only stat()ed this often by
+ * pixmap_cache (seconds).
+ */
+#define THEME_ICON_CHECK_TIME 60
+
+/* Icons found by type_to_icon() stay valid until one of these monitors on the
+ * MIME-icons directories, or an icon theme, says something has changed.
+ */
+static GList *mime_icon_monitors = NULL;
+static gint icons_changed_timeout = 0;
+
 void type_init(void)
 {
 	int	    i;
 
-	icon_theme = gtk_icon_theme_new();
+	icon_theme = new_icon_theme();
 
 	type_hash = g_hash_table_new(g_str_hash, g_str_equal);
 
@@ -157,9 +188,26 @@ void type_init(void)
 
 	set_icon_theme();
 
+	watch_mime_dirs();
+	watch_mime_icon_dirs();
+
+	preload_source = g_timeout_add(PRELOAD_START_DELAY, preload_start, NULL);
+
 	option_add_notify(options_changed);
 }
 
+static void refresh_type(gpointer key, gpointer value, gpointer data)
+{
+	MIME_type *type = value;
+
+	if (type == application_x_desktop)
+		return;
+
+	type->executable = xdg_mime_mime_type_subclass((gchar *) key,
+						"application/x-executable");
+	null_g_free(&type->comment);
+}
+
 /* Read-load all the glob patterns.
  * Note: calls filer_update_all.
  */
@@ -169,9 +217,105 @@ void reread_mime_files(void)
 
 	xdg_mime_shutdown();
 
+	/* Anything we worked out from the old database may be wrong now */
+	g_hash_table_foreach(type_hash, refresh_type, NULL);
+
+	/* We may have just created a MIME-icons directory, too */
+	watch_mime_icon_dirs();
+	expire_mime_icons();
+
 	filer_update_all();
 }
 
+static gboolean mime_reload_cb(gpointer data)
+{
+	mime_reload_timeout = 0;
+
+	reread_mime_files();
+
+	return FALSE;
+}
+
+static void mime_dir_changed(GFileMonitor *monitor, GFile *file,
+		GFile *other, GFileMonitorEvent event, gpointer data)
+{
+	static const char *db_files[] = {"mime.cache", "globs", "globs2",
+			"magic", "aliases", "subclasses", NULL};
+	char *leaf;
+	int i;
+
+	/* Wait for G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT */
+	if (event == G_FILE_MONITOR_EVENT_CHANGED)
+		return;
+
+	leaf = g_file_get_basename(file);
+	for (i = 0; db_files[i]; i++)
+		if (strcmp(leaf, db_files[i]) == 0)
+			break;
+	/* The mime directory itself was created or removed if leaf is
+	 * "mime".
+	 */
+	if (db_files[i] || strcmp(leaf, "mime") == 0)
+	{
+		/* update-mime-database replaces several files in turn.
+		 * Reload once it has finished.
+		 */
+		if (mime_reload_timeout)
+			g_source_remove(mime_reload_timeout);
+		mime_reload_timeout = g_timeout_add(500, mime_reload_cb, NULL);
+	}
+	g_free(leaf);
+}
+
+static int watch_mime_dir(const char *directory, gboolean *ok)
+{
+	GFileMonitor *monitor;
+	GFile *gf;
+	char *path;
+
+	path = g_build_filename(directory, "mime", NULL);
+	gf = g_file_new_for_path(path);
+	g_free(path);
+
+	/* (works even if the directory doesn't exist yet) */
+	monitor = g_file_monitor_directory(gf, G_FILE_MONITOR_NONE,
+					   NULL, NULL);
+	g_object_unref(gf);
+
+	if (!monitor)
+	{
+		*ok = FALSE;
+		return TRUE;	/* Stop */
+	}
+
+	g_signal_connect(monitor, "changed",
+			 G_CALLBACK(mime_dir_changed), NULL);
+	mime_dir_monitors = g_list_prepend(mime_dir_monitors, monitor);
+
+	return FALSE;
+}
+
+/* Ask to be told when the shared MIME database changes, so that xdgmime
+ * doesn't need to check all its files every few seconds. If we can't watch
+ * every directory, fall back to letting xdgmime poll.
+ */
+static void watch_mime_dirs(void)
+{
+	gboolean ok = TRUE;
+
+	xdg_mime_foreach_data_dir((XdgMimeDirFunc) watch_mime_dir, &ok);
+
+	if (ok)
+	{
+		xdg_mime_set_dirs_watched(TRUE);
+		return;
+	}
+
+	g_list_foreach(mime_dir_monitors, (GFunc) g_object_unref, NULL);
+	g_list_free(mime_dir_monitors);
+	mime_dir_monitors = NULL;
+}
+
 /* Returns the MIME_type structure for the given type name. It is looked
  * up in type_hash and returned if found. If not found (and can_create is
  * TRUE) then a new MIME_type is made, added to type_hash and returned.
@@ -306,14 +450,25 @@ MIME_type *type_get_type(const guchar *path)
  * NULL if we can't think of anything.
  */
 MIME_type *type_from_path(const char *path)
+{
+	return type_from_path_full(path, TRUE);
+}
+
+/* As type_from_path(), but only looks for the extended attribute if
+ * check_xattr is TRUE (for callers which already know it isn't there).
+ */
+MIME_type *type_from_path_full(const char *path, gboolean check_xattr)
 {
 	MIME_type *mime_type = NULL;
 	const char *type_name;
 
 	/* Check for extended attribute first */
-	mime_type = xtype_get(path);
-	if (mime_type)
-		return mime_type;
+	if (check_xattr)
+	{
+		mime_type = xtype_get(path);
+		if (mime_type)
+			return mime_type;
+	}
 
 	/* Try name and contents next */
 	type_name = xdg_mime_get_mime_type_for_file(path, NULL);
@@ -522,7 +677,7 @@ static void init_aux_theme(GtkIconTheme **ptheme, const char *name)
 {
 	if (*ptheme)
 		return;
-	*ptheme = gtk_icon_theme_new();
+	*ptheme = new_icon_theme();
 	gtk_icon_theme_set_custom_theme(*ptheme, name);
 }
 
@@ -574,6 +729,327 @@ static GtkIconInfo *mime_type_lookup_icon_info(GtkIconTheme *theme,
 	return full;
 }
 
+/* Find this type's icon in the icon themes.
+ * Returns the icon's file name, or NULL. g_free() the result.
+ */
+static gchar *theme_icon_path(MIME_type *type)
+{
+	GtkIconInfo *full;
+	gchar *path = NULL;
+
+	full = mime_type_lookup_icon_info(icon_theme, type);
+	if (!full && icon_theme != rox_theme)
+	{
+		init_rox_theme();
+		full = mime_type_lookup_icon_info(rox_theme, type);
+	}
+	if (!full && icon_theme != gnome_theme)
+	{
+		init_gnome_theme();
+		full = mime_type_lookup_icon_info(gnome_theme, type);
+	}
+	if (full)
+	{
+		/* NULL shouldn't happen, because we didn't use
+		 * GTK_ICON_LOOKUP_USE_BUILTIN.
+		 */
+		path = g_strdup(gtk_icon_info_get_filename(full));
+		gtk_icon_info_free(full);
+	}
+
+	return path;
+}
+
+static void expire_icon(gpointer key, gpointer value, gpointer data)
+{
+	MIME_type *type = value;
+
+	if (type->image)
+	{
+		g_object_unref(type->image);
+		type->image = NULL;
+	}
+}
+
+/* Make type_to_icon() look up every type's icon again */
+static void expire_mime_icons(void)
+{
+	g_hash_table_foreach(type_hash, expire_icon, NULL);
+}
+
+static gboolean icons_changed_cb(gpointer data)
+{
+	icons_changed_timeout = 0;
+
+	filer_update_all();
+
+	return FALSE;
+}
+
+/* Something that type_to_icon() depends on has changed. Forget the old
+ * icons now, and update the windows once things have settled down.
+ */
+static void mime_icons_changed(void)
+{
+	expire_mime_icons();
+
+	if (icons_changed_timeout)
+		g_source_remove(icons_changed_timeout);
+	icons_changed_timeout = g_timeout_add(500, icons_changed_cb, NULL);
+}
+
+static void icon_theme_changed(GtkIconTheme *theme, gpointer data)
+{
+	mime_icons_changed();
+}
+
+static void mime_icon_dir_changed(GFileMonitor *monitor, GFile *file,
+		GFile *other, GFileMonitorEvent event, gpointer data)
+{
+	gchar *path;
+
+	/* Wait for G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT */
+	if (event == G_FILE_MONITOR_EVENT_CHANGED)
+		return;
+
+	/* pixmap_cache trusts files in here until we say otherwise */
+	path = g_file_get_path(file);
+	if (path)
+	{
+		g_fscache_invalidate(pixmap_cache, path);
+		g_free(path);
+	}
+
+	mime_icons_changed();
+}
+
+static void unwatch_mime_icon_dir(gpointer monitor, gpointer data)
+{
+	const gchar *dir;
+
+	dir = g_object_get_data(G_OBJECT(monitor), "rox-dir");
+	g_fscache_set_policy(pixmap_cache, dir, FSCACHE_CHECK_STAT, 0);
+
+	g_object_unref(monitor);
+}
+
+/* (Re)start watching all the MIME-icons directories that exist */
+static void watch_mime_icon_dirs(void)
+{
+	GPtrArray *dirs;
+	int i;
+
+	g_list_foreach(mime_icon_monitors, unwatch_mime_icon_dir, NULL);
+	g_list_free(mime_icon_monitors);
+	mime_icon_monitors = NULL;
+
+	dirs = choices_list_load_dirs("MIME-icons", SITE);
+	g_return_if_fail(dirs != NULL);
+
+	for (i = 0; i < dirs->len; i++)
+	{
+		GFileMonitor *monitor;
+		GFile *gf;
+
+		gf = g_file_new_for_path(dirs->pdata[i]);
+		monitor = g_file_monitor_directory(gf, G_FILE_MONITOR_NONE,
+						   NULL, NULL);
+		g_object_unref(gf);
+
+		if (!monitor)
+			continue;
+
+		g_object_set_data_full(G_OBJECT(monitor), "rox-dir",
+				       g_strdup(dirs->pdata[i]), g_free);
+		g_signal_connect(monitor, "changed",
+				 G_CALLBACK(mime_icon_dir_changed), NULL);
+		mime_icon_monitors = g_list_prepend(mime_icon_monitors,
+						    monitor);
+
+		/* No need to stat() these icons on every lookup */
+		g_fscache_set_policy(pixmap_cache, dirs->pdata[i],
+				     FSCACHE_CHECK_MONITOR, 0);
+	}
+
+	choices_free_list(dirs);
+}
+
+static GtkIconTheme *new_icon_theme(void)
+{
+	GtkIconTheme *theme;
+	gchar	**dirs;
+	gint	n_dirs, i;
+
+	theme = gtk_icon_theme_new();
+	g_signal_connect(theme, "changed",
+			 G_CALLBACK(icon_theme_changed), NULL);
+
+	/* Theme icons hardly ever change, so don't make pixmap_cache stat()
+	 * them every time. GTK only rechecks the themes now and then anyway.
+	 */
+	gtk_icon_theme_get_search_path(theme, &dirs, &n_dirs);
+	for (i = 0; i < n_dirs; i++)
+	{
+		if (dirs[i][0] == '/')
+			g_fscache_set_policy(pixmap_cache, dirs[i],
+					FSCACHE_CHECK_AFTER, THEME_ICON_CHECK_TIME);
+	}
+	g_strfreev(dirs);
+
+	return theme;
+}
+
+/* Preloading icons.
+ *
+ * Soon after startup, we look up the icon for every type in the MIME database
+ * and have pixmap_preload() load it in the background, so that the first
+ * windows opened don't each have to wait while new icons are decoded and
+ * scaled. Looking up the icon needs the icon theme, which isn't thread-safe,
+ * so that part is done here, one type at a time, when idle and not scanning.
+ */
+static gboolean preload_next(gpointer data);
+
+static void add_preload_name(gpointer key, gpointer value, gpointer data)
+{
+	g_ptr_array_add((GPtrArray *) data, g_strdup((gchar *) key));
+}
+
+/* Add the names in <directory>/mime/types to the 'names' hash */
+static int read_type_names(const char *directory, void *data)
+{
+	GHashTable *names = data;
+	gchar *path, *contents;
+	gchar **lines, **line;
+
+	path = g_build_filename(directory, "mime", "types", NULL);
+	if (g_file_get_contents(path, &contents, NULL, NULL))
+	{
+		lines = g_strsplit(contents, "\n", 0);
+		for (line = lines; *line; line++)
+		{
+			if (strchr(*line, '/') &&
+			    !g_hash_table_lookup(names, *line))
+				g_hash_table_insert(names, g_strdup(*line),
+						    *line);
+		}
+		g_strfreev(lines);
+		g_free(contents);
+	}
+	g_free(path);
+
+	return FALSE;	/* Keep going */
+}
+
+static void preload_schedule(void)
+{
+	if (preload_source || !preload_names ||
+	    preload_pending >= PRELOAD_MAX_PENDING)
+		return;
+
+	preload_source = g_idle_add_full(G_PRIORITY_LOW, preload_next,
+					 NULL, NULL);
+}
+
+static void preload_done(gpointer data, gpointer path)
+{
+	preload_pending--;
+	preload_schedule();
+}
+
+static gboolean preload_retry(gpointer data)
+{
+	preload_source = 0;
+	preload_schedule();
+
+	return FALSE;
+}
+
+/* Look up the icon for one more type and start loading it */
+static gboolean preload_next(gpointer data)
+{
+	MIME_type type;
+	MaskedPixmap *image;
+	GFSCacheStats stats;
+	gchar *name, *leaf, *path;
+	gboolean found;
+
+	if (dir_any_scanning())
+	{
+		/* Don't slow down the scan; try again later */
+		preload_source = g_timeout_add(500, preload_retry, NULL);
+		return FALSE;
+	}
+
+	g_fscache_get_stats(pixmap_cache, &stats);
+	if (preload_names->len == 0 ||
+	    (stats.budget && stats.size > stats.budget / 2))
+	{
+		/* Done, or we'd just be pushing out useful images */
+		g_ptr_array_free(preload_names, TRUE);
+		preload_names = NULL;
+		preload_source = 0;
+		return FALSE;
+	}
+
+	name = g_ptr_array_remove_index_fast(preload_names,
+					     preload_names->len - 1);
+	memset(&type, 0, sizeof(type));
+	type.media_type = name;
+	type.subtype = strchr(name, '/');
+	*(type.subtype++) = '\0';
+
+	/* Types with their own MIME-icons use them instead of the theme */
+	leaf = g_strconcat(type.media_type, "_", type.subtype, ".png", NULL);
+	path = choices_find_xdg_path_load(leaf, "MIME-icons", SITE);
+	g_free(leaf);
+	if (!path)
+		path = theme_icon_path(&type);
+
+	found = FALSE;
+	if (path)
+	{
+		image = g_fscache_lookup_full(pixmap_cache, path,
+				FSCACHE_LOOKUP_ONLY_NEW, &found);
+		if (image)
+			g_object_unref(image);
+	}
+	if (path && !found)
+	{
+		preload_pending++;
+		pixmap_preload(path, preload_done, NULL);
+	}
+	g_free(path);
+	g_free(name);
+
+	if (preload_pending >= PRELOAD_MAX_PENDING)
+	{
+		/* preload_done() will start us again */
+		preload_source = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Called once, some time after startup */
+static gboolean preload_start(gpointer data)
+{
+	GHashTable *names;
+
+	preload_source = 0;
+
+	names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	xdg_mime_foreach_data_dir(read_type_names, names);
+
+	preload_names = g_ptr_array_new();
+	g_hash_table_foreach(names, add_preload_name, preload_names);
+	g_hash_table_destroy(names);
+
+	preload_schedule();
+
+	return FALSE;
+}
+
 /*			Actions for types 			*/
 
 /* Return the image for this type, loading it if needed.
@@ -586,13 +1062,16 @@ static GtkIconInfo *mime_type_lookup_icon_info(GtkIconTheme *theme,
  * Special case: If an icon cannot be found for inode/mount-point, the icon for
  * inode/directory will be returned (if possible).
  *
+ * Once found, the image is kept until the MIME-icons directories, the icon
+ * theme or the theme option change (see mime_icons_changed()), so this
+ * doesn't touch the filesystem except for the first lookup of each type.
+ *
  * Note: You must g_object_unref() the image afterwards.
  */
 MaskedPixmap *type_to_icon(MIME_type *type)
 {
-	GtkIconInfo *full;
 	char	*type_name, *path;
-	time_t	now;
+	MIME_type *wanted = type;
 
 	if (type == NULL)
 	{
@@ -600,18 +1079,11 @@ MaskedPixmap *type_to_icon(MIME_type *type)
 		return im_unknown;
 	}
 
-	now = time(NULL);
 	/* Already got an image? */
 	if (type->image)
 	{
-		/* Yes - don't recheck too often */
-		if (abs(now - type->image_time) < 2)
-		{
-			g_object_ref(type->image);
-			return type->image;
-		}
-		g_object_unref(type->image);
-		type->image = NULL;
+		g_object_ref(type->image);
+		return type->image;
 	}
 
 again:
@@ -628,36 +1100,22 @@ again:
 	if (type->image)
 		goto out;
 
-	full = mime_type_lookup_icon_info(icon_theme, type);
-	if (!full && icon_theme != rox_theme)
-	{
-		init_rox_theme();
-		full = mime_type_lookup_icon_info(rox_theme, type);
-	}
-	if (!full && icon_theme != gnome_theme)
-	{
-		init_gnome_theme();
-		full = mime_type_lookup_icon_info(gnome_theme, type);
-	}
-	if (!full && type == inode_mountpoint)
+	path = theme_icon_path(type);
+	if (!path && type == inode_mountpoint)
 	{
 		/* Try to use the inode/directory icon for inode/mount-point */
 		type = inode_directory;
+		if (type->image)
+			goto out;
 		goto again;
 	}
-	if (full)
+	if (path)
 	{
-		const char *icon_path;
 		/* Get the actual icon through our cache, not through GTK, because
 		 * GTK doesn't cache icons.
 		 */
-		icon_path = gtk_icon_info_get_filename(full);
-		if (icon_path != NULL)
-			type->image = g_fscache_lookup(pixmap_cache, icon_path);
-		/* else shouldn't happen, because we didn't use
-		 * GTK_ICON_LOOKUP_USE_BUILTIN.
-		 */
-		gtk_icon_info_free(full);
+		type->image = g_fscache_lookup(pixmap_cache, path);
+		g_free(path);
 	}
 
 out:
@@ -668,7 +1126,12 @@ out:
 		g_object_ref(im_unknown);
 	}
 
-	type->image_time = now;
+	if (wanted != type)
+	{
+		/* Remember that inode/mount-point uses the directory icon */
+		wanted->image = type->image;
+		g_object_ref(wanted->image);
+	}
 
 	g_object_ref(type->image);
 	return type->image;
@@ -1251,21 +1714,13 @@ static void alloc_type_colours(void)
 	}
 }
 
-static void expire_timer(gpointer key, gpointer value, gpointer data)
-{
-	MIME_type *type = value;
-
-	type->image_time = 0;
-}
-
 static void options_changed(void)
 {
 	alloc_type_colours();
 	if (o_icon_theme.has_changed)
 	{
 		set_icon_theme();
-		g_hash_table_foreach(type_hash, expire_timer, NULL);
-		full_refresh();
+		full_refresh();		/* (expires the MIME icons) */
 	}
 }
 
@@ -1413,7 +1868,7 @@ static void set_icon_theme(void)
 	else
 	{
 		if (icon_theme == rox_theme || icon_theme == gnome_theme)
-			icon_theme = gtk_icon_theme_new();
+			icon_theme = new_icon_theme();
 		gtk_icon_theme_set_custom_theme(icon_theme, theme_name);
 	}
 
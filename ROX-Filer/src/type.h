@@ -27,7 +27,6 @@ struct _MIME_type
 	char		*media_type;
 	char		*subtype;
 	MaskedPixmap 	*image;		/* NULL => not loaded yet */
-	time_t		image_time;	/* When we loaded the image */
 
 	/* Private: use mime_type_comment() instead */
 	char		*comment;	/* Name in local language */
@@ -40,6 +39,7 @@ const char *basetype_name(DirItem *item);
 MIME_type *type_get_type(const guchar *path);
 
 MIME_type *type_from_path(const char *path);
+MIME_type *type_from_path_full(const char *path, gboolean check_xattr);
 MaskedPixmap *type_to_icon(MIME_type *type);
 GdkAtom type_to_atom(MIME_type *type);
 MIME_type *mime_type_from_base_type(int base_type);
@@ -0,0 +1,916 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* usage.c - counting the space used by directories
+ *
+ * This is used by the Disk Usage action and by the Properties box. A pool of
+ * threads reads directories in parallel. Files with several links are only
+ * counted once, and we total both the size of each file and the space
+ * allocated to it on the disk.
+ *
+ * What we find in each directory (not including its subdirectories) is
+ * remembered in a cache file, by device, inode and mtime. If a directory
+ * hasn't changed since then we don't read it or stat() its files again; we
+ * just go on to its subdirectories. Note that changing a file in place
+ * doesn't change its directory's mtime, so such changes aren't seen until
+ * something in the directory is added, removed or renamed.
+ *
+ * The cache file is mapped into memory and each directory's record is found
+ * by a binary search on its device and inode, so a scan only reads the
+ * parts it needs. It is only written out again when a directory has been
+ * (re)counted or an old record needs to be dropped.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "global.h"
+
+#include "options.h"
+#include "support.h"
+#include "usage.h"
+
+/* Forget directories we haven't counted for this long */
+#define USAGE_CACHE_DAYS 30
+
+/* How often usage_scan_path() calls the progress function (ms) */
+#define USAGE_PROGRESS_TIME 500
+
+#define USAGE_CACHE_MAGIC "ROX-Filer usage cache 2\n"
+
+typedef struct _UsageDir UsageDir;
+typedef struct _UsageLink UsageLink;
+typedef struct _UsageRecord UsageRecord;
+typedef struct _UsageHeader UsageHeader;
+typedef struct _UsageIndex UsageIndex;
+typedef struct _UsageSave UsageSave;
+typedef struct _UsageJob UsageJob;
+
+/* A file with several links, which must only be counted once */
+struct _UsageLink {
+	guint64	dev, ino;
+	gint64	apparent, allocated;
+};
+
+/* How a UsageDir is stored in the cache file. Followed by n_links
+ * UsageLinks and then subdirs_len bytes of leafnames, padded to a multiple
+ * of 8 bytes (see record_size()).
+ */
+struct _UsageRecord {
+	guint64	dev, ino;
+	gint64	mtime;
+	gint64	used;		/* When last counted, for expiry */
+	gint64	apparent, allocated, files;	/* Files with one link */
+	guint32	n_links;
+	guint32	subdirs_len;
+};
+
+/* The cache file starts with this, followed by n_dirs UsageIndexes sorted
+ * by device and inode, and then the records themselves.
+ */
+struct _UsageHeader {
+	gchar	magic[sizeof(USAGE_CACHE_MAGIC) - 1];
+	guint64	n_dirs;
+	gint64	oldest;		/* Smallest 'used' of any record */
+};
+
+struct _UsageIndex {
+	guint64	dev, ino;
+	guint64	offset;		/* Of the UsageRecord, from the file's start */
+};
+
+/* A record to go in the new cache file; either 'dir' or 'cached' is set */
+struct _UsageSave {
+	guint64	dev, ino;
+	UsageDir *dir;
+	const UsageRecord *cached;
+};
+
+/* What we found in one directory */
+struct _UsageDir {
+	UsageRecord r;
+	UsageLink *links;
+	gchar	*subdirs;	/* Leafnames, each followed by '\0' */
+	gboolean complete;	/* Contents are known and can be reused */
+	gboolean seen;		/* Counted by this scan */
+};
+
+struct _UsageScan {
+	GThreadPool	*pool;
+	GAsyncQueue	*done;		/* Gets a token when pending hits 0 */
+	gint		pending;	/* Directories unfinished (atomic) */
+	gint		cancelled;	/* (atomic) */
+	time_t		start;
+	gint64		expired;	/* Records last used before this go */
+	gboolean	loaded;		/* Tried to map the cache file */
+	gboolean	changed;	/* Need to write the cache file */
+
+	const guchar	*map;		/* The cache file, or NULL */
+	gsize		map_size;
+	const UsageIndex *index;	/* Sorted; part of map */
+	guint64		n_index;
+
+	GMutex		*lock;		/* For the following */
+	UsageTotals	*totals;	/* For the current usage_scan_path() */
+	gchar		*error;		/* First problem found */
+	GHashTable	*dirs;		/* UsageDir -> UsageDir, for the
+					 * directories seen by this scan */
+	GHashTable	*links;		/* Set of UsageLinks counted */
+};
+
+struct _UsageJob {
+	gchar		*path;
+	struct stat	info;
+};
+
+Option o_usage_cache;
+
+/* Static prototypes */
+static guint inode_hash(gconstpointer key);
+static gboolean inode_equal(gconstpointer a, gconstpointer b);
+static void usage_dir_free(gpointer data);
+static gchar *cache_path(void);
+static void map_cache(UsageScan *scan);
+static gsize record_size(const UsageRecord *r);
+static const UsageRecord *cached_record(UsageScan *scan,
+					const UsageIndex *index);
+static UsageDir *load_dir(UsageScan *scan, guint64 dev, guint64 ino);
+static gint inode_cmp(gconstpointer a, gconstpointer b);
+static void add_save(gpointer key, gpointer value, gpointer data);
+static void write_cache(UsageScan *scan, FILE *file);
+static void queue_dir(UsageScan *scan, gchar *path, const struct stat *info);
+static void usage_thread(gpointer data, gpointer user_data);
+static void count_dir(UsageScan *scan, const char *path,
+		      const struct stat *info);
+static void read_dir(UsageScan *scan, UsageDir *dir, const char *path,
+		     UsageTotals *found, GArray *links, GString *subdirs);
+static void reuse_dir(UsageScan *scan, UsageDir *dir, const char *path,
+		      UsageTotals *found);
+static void count_links(UsageScan *scan, UsageLink *links, int n,
+			UsageTotals *found);
+static void add_size(UsageTotals *totals, const struct stat *info);
+static void scan_error(UsageScan *scan, const char *path, int err);
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+void usage_init(void)
+{
+	option_add_int(&o_usage_cache, "usage_cache", TRUE);
+}
+
+/* Create a new scan, using a pool of 'threads' threads. Files are only
+ * counted once per scan, even if they are found several times. Pass TRUE
+ * for 'exclusive' in a child process, where threads shared with the rest
+ * of the program don't exist.
+ */
+UsageScan *usage_scan_new(int threads, gboolean exclusive)
+{
+	UsageScan *scan;
+
+	scan = g_new0(UsageScan, 1);
+	scan->done = g_async_queue_new();
+	scan->start = time(NULL);
+	scan->expired = scan->start - USAGE_CACHE_DAYS * 24 * 60 * 60;
+	scan->lock = g_mutex_new();
+	scan->dirs = g_hash_table_new_full(inode_hash, inode_equal,
+					   NULL, usage_dir_free);
+	scan->links = g_hash_table_new_full(inode_hash, inode_equal,
+					    g_free, NULL);
+	scan->pool = g_thread_pool_new(usage_thread, scan, MAX(threads, 1),
+				       exclusive, NULL);
+
+	return scan;
+}
+
+/* Count everything in 'path' (which need not be a directory), setting
+ * 'totals'. Blocks until done, calling 'progress' (if not NULL) every so
+ * often. Returns an error message for the first problem found, if any.
+ * g_free() the result.
+ */
+gchar *usage_scan_path(UsageScan *scan, const char *path,
+		       UsageTotals *totals,
+		       UsageProgressFn progress, gpointer data)
+{
+	struct stat info;
+	gchar	*error;
+
+	memset(totals, 0, sizeof(*totals));
+
+	if (!scan->loaded)
+	{
+		scan->loaded = TRUE;
+		if (o_usage_cache.int_value)
+			map_cache(scan);
+	}
+
+	if (lstat(path, &info))
+	{
+		totals->errors++;
+		return g_strdup_printf("%s: %s", path, g_strerror(errno));
+	}
+
+	if (!S_ISDIR(info.st_mode))
+	{
+		usage_scan_add(scan, &info, totals);
+		return NULL;
+	}
+
+	g_mutex_lock(scan->lock);
+	scan->totals = totals;
+	g_mutex_unlock(scan->lock);
+
+	queue_dir(scan, g_strdup(path), &info);
+
+	while (1)
+	{
+		GTimeVal end;
+
+		g_get_current_time(&end);
+		g_time_val_add(&end, USAGE_PROGRESS_TIME * 1000);
+		if (g_async_queue_timed_pop(scan->done, &end))
+			break;
+
+		if (progress)
+		{
+			UsageTotals so_far;
+
+			g_mutex_lock(scan->lock);
+			so_far = *totals;
+			g_mutex_unlock(scan->lock);
+
+			progress(&so_far, data);
+		}
+	}
+
+	g_mutex_lock(scan->lock);
+	scan->totals = NULL;
+	error = scan->error;
+	scan->error = NULL;
+	g_mutex_unlock(scan->lock);
+
+	return error;
+}
+
+/* Add one object, which the caller has lstat()ed, to 'totals'. Doesn't
+ * look inside directories.
+ */
+void usage_scan_add(UsageScan *scan, const struct stat *info,
+		    UsageTotals *totals)
+{
+	UsageLink link;
+
+	if (S_ISDIR(info->st_mode) || info->st_nlink < 2)
+	{
+		if (S_ISDIR(info->st_mode))
+			totals->dirs++;
+		else
+			totals->files++;
+		add_size(totals, info);
+		return;
+	}
+
+	link.dev = info->st_dev;
+	link.ino = info->st_ino;
+	link.apparent = info->st_size;
+	link.allocated = (gint64) info->st_blocks * 512;
+	count_links(scan, &link, 1, totals);
+}
+
+/* Stop usage_scan_path() early. May be called from any thread. */
+void usage_scan_cancel(UsageScan *scan)
+{
+	g_atomic_int_set(&scan->cancelled, 1);
+}
+
+/* Write what we found to the cache file, if anything has changed. Best
+ * done in a thread, since the file may be large.
+ */
+void usage_scan_finish(UsageScan *scan)
+{
+	gchar	*path, *dir, *tmp;
+	FILE	*file = NULL;
+	int	fd;
+
+	if (!scan->changed || !o_usage_cache.int_value)
+		return;
+	scan->changed = FALSE;
+
+	path = cache_path();
+	dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	/* Write to a temporary file first, in case another scan (in this
+	 * filer or another) is doing the same thing.
+	 */
+	tmp = g_strconcat(path, ".XXXXXX", NULL);
+	fd = g_mkstemp(tmp);
+	if (fd != -1)
+	{
+		file = fdopen(fd, "wb");
+		if (!file)
+		{
+			close(fd);
+			unlink(tmp);
+		}
+	}
+	if (file)
+	{
+		write_cache(scan, file);
+
+		if (fclose(file) != 0 || rename(tmp, path) != 0)
+			unlink(tmp);
+	}
+
+	g_free(tmp);
+	g_free(path);
+}
+
+void usage_totals_add(UsageTotals *totals, const UsageTotals *found)
+{
+	totals->apparent += found->apparent;
+	totals->allocated += found->allocated;
+	totals->files += found->files;
+	totals->dirs += found->dirs;
+	totals->errors += found->errors;
+}
+
+/* Return the sizes in 'totals' in the form '23 M (20 M on disk)'.
+ * g_free() the result.
+ */
+gchar *usage_format_sizes(const UsageTotals *totals)
+{
+	gchar	*apparent, *sizes;
+
+	apparent = g_strdup(format_double_size(totals->apparent));
+	sizes = g_strdup_printf(_("%s (%s on disk)"), apparent,
+				format_double_size(totals->allocated));
+	g_free(apparent);
+
+	return sizes;
+}
+
+void usage_scan_free(UsageScan *scan)
+{
+	g_thread_pool_free(scan->pool, TRUE, TRUE);
+	g_async_queue_unref(scan->done);
+	g_mutex_free(scan->lock);
+	g_hash_table_destroy(scan->dirs);
+	g_hash_table_destroy(scan->links);
+	if (scan->map)
+		munmap((gpointer) scan->map, scan->map_size);
+	g_free(scan->error);
+	g_free(scan);
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+/* UsageDirs, UsageRecords, UsageIndexes, UsageSaves and UsageLinks all
+ * start with dev and ino.
+ */
+static guint inode_hash(gconstpointer key)
+{
+	const guint64 *inode = key;
+
+	return (guint) (inode[1] ^ (inode[1] >> 32) ^ (inode[0] * 31));
+}
+
+static gboolean inode_equal(gconstpointer a, gconstpointer b)
+{
+	const guint64 *ia = a, *ib = b;
+
+	return ia[0] == ib[0] && ia[1] == ib[1];
+}
+
+static void usage_dir_free(gpointer data)
+{
+	UsageDir *dir = data;
+
+	g_free(dir->links);
+	g_free(dir->subdirs);
+	g_free(dir);
+}
+
+static gchar *cache_path(void)
+{
+	return g_build_filename(g_get_user_cache_dir(),
+				"rox.sourceforge.net", PROJECT, "usage", NULL);
+}
+
+/* Map the cache file, if any. Records are looked up in it as directories
+ * are found.
+ */
+static void map_cache(UsageScan *scan)
+{
+	gchar	*path;
+	struct stat info;
+	const UsageHeader *header;
+	gpointer map;
+	int	fd;
+
+	path = cache_path();
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	g_free(path);
+	if (fd == -1)
+		return;
+
+	if (fstat(fd, &info) || info.st_size < sizeof(UsageHeader))
+	{
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	header = map;
+	if (memcmp(header->magic, USAGE_CACHE_MAGIC,
+		   sizeof(header->magic)) != 0 ||
+	    header->n_dirs > (info.st_size - sizeof(UsageHeader)) /
+				sizeof(UsageIndex))
+	{
+		munmap(map, info.st_size);
+		return;
+	}
+
+	scan->map = map;
+	scan->map_size = info.st_size;
+	scan->index = (const UsageIndex *) (header + 1);
+	scan->n_index = header->n_dirs;
+
+	if (header->oldest < scan->expired)
+		scan->changed = TRUE;	/* Drop the old records */
+}
+
+/* Bytes taken by 'r' in the cache file, including its links, leafnames
+ * and padding.
+ */
+static gsize record_size(const UsageRecord *r)
+{
+	gsize size;
+
+	size = sizeof(UsageRecord) + (gsize) r->n_links * sizeof(UsageLink) +
+		r->subdirs_len;
+
+	return (size + 7) & ~(gsize) 7;
+}
+
+/* Find the record 'index' refers to in the mapped cache file, or NULL if
+ * it's corrupted.
+ */
+static const UsageRecord *cached_record(UsageScan *scan,
+					const UsageIndex *index)
+{
+	const UsageRecord *r;
+
+	if (index->offset % 8 || index->offset > scan->map_size ||
+	    scan->map_size - index->offset < sizeof(UsageRecord))
+		return NULL;
+
+	r = (const UsageRecord *) (scan->map + index->offset);
+	if (r->dev != index->dev || r->ino != index->ino ||
+	    r->n_links > (1 << 24) || r->subdirs_len > (1 << 28) ||
+	    record_size(r) > scan->map_size - index->offset)
+		return NULL;
+
+	return r;
+}
+
+/* Look for the directory in the cache file. If it's there (and not too
+ * old), add a copy of it to scan->dirs and return it. Call with scan->lock
+ * held.
+ */
+static UsageDir *load_dir(UsageScan *scan, guint64 dev, guint64 ino)
+{
+	const UsageRecord *r = NULL;
+	UsageDir *dir;
+	guint64	low = 0, high = scan->n_index;
+
+	while (low < high)
+	{
+		guint64 mid = low + (high - low) / 2;
+		const UsageIndex *index = &scan->index[mid];
+
+		if (index->dev == dev && index->ino == ino)
+		{
+			r = cached_record(scan, index);
+			break;
+		}
+		if (index->dev < dev || (index->dev == dev && index->ino < ino))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (!r || r->used < scan->expired)
+		return NULL;
+
+	dir = g_new0(UsageDir, 1);
+	dir->r = *r;
+	dir->links = g_memdup(r + 1, r->n_links * sizeof(UsageLink));
+	dir->subdirs = g_malloc(r->subdirs_len + 1);
+	memcpy(dir->subdirs, (const guchar *) (r + 1) +
+			r->n_links * sizeof(UsageLink), r->subdirs_len);
+	dir->subdirs[r->subdirs_len] = '\0';
+	dir->complete = TRUE;
+	g_hash_table_replace(scan->dirs, dir, dir);
+
+	return dir;
+}
+
+/* Sort UsageSaves by device and inode */
+static gint inode_cmp(gconstpointer a, gconstpointer b)
+{
+	const guint64 *ia = a, *ib = b;
+
+	if (ia[0] != ib[0])
+		return ia[0] < ib[0] ? -1 : 1;
+	if (ia[1] != ib[1])
+		return ia[1] < ib[1] ? -1 : 1;
+	return 0;
+}
+
+static void add_save(gpointer key, gpointer value, gpointer data)
+{
+	UsageDir *dir = value;
+	UsageSave save;
+
+	if (!dir->complete)
+		return;
+
+	save.dev = dir->r.dev;
+	save.ino = dir->r.ino;
+	save.dir = dir;
+	save.cached = NULL;
+	g_array_append_val((GArray *) data, save);
+}
+
+/* Write the directories seen by this scan to 'file', along with any
+ * records from the old file which are still wanted.
+ */
+static void write_cache(UsageScan *scan, FILE *file)
+{
+	static const gchar padding[8] = {0};
+	UsageHeader header;
+	GArray	*saves;
+	guint64	i, offset;
+
+	saves = g_array_new(FALSE, FALSE, sizeof(UsageSave));
+	g_hash_table_foreach(scan->dirs, add_save, saves);
+
+	for (i = 0; i < scan->n_index; i++)
+	{
+		const UsageIndex *index = &scan->index[i];
+		UsageSave save;
+
+		if (g_hash_table_lookup(scan->dirs, index))
+			continue;	/* Seen again, or gone */
+
+		save.cached = cached_record(scan, index);
+		if (!save.cached || save.cached->used < scan->expired)
+			continue;
+		save.dev = index->dev;
+		save.ino = index->ino;
+		save.dir = NULL;
+		g_array_append_val(saves, save);
+	}
+
+	g_array_sort(saves, inode_cmp);
+
+	memcpy(header.magic, USAGE_CACHE_MAGIC, sizeof(header.magic));
+	header.n_dirs = saves->len;
+	header.oldest = scan->start;
+	for (i = 0; i < saves->len; i++)
+	{
+		UsageSave *save = &g_array_index(saves, UsageSave, i);
+		const UsageRecord *r = save->dir ? &save->dir->r : save->cached;
+
+		header.oldest = MIN(header.oldest, r->used);
+	}
+	fwrite(&header, sizeof(header), 1, file);
+
+	offset = sizeof(header) + saves->len * sizeof(UsageIndex);
+	for (i = 0; i < saves->len; i++)
+	{
+		UsageSave *save = &g_array_index(saves, UsageSave, i);
+		UsageIndex index;
+
+		index.dev = save->dev;
+		index.ino = save->ino;
+		index.offset = offset;
+		fwrite(&index, sizeof(index), 1, file);
+
+		offset += record_size(save->dir ? &save->dir->r : save->cached);
+	}
+
+	for (i = 0; i < saves->len; i++)
+	{
+		UsageSave *save = &g_array_index(saves, UsageSave, i);
+		UsageDir *dir = save->dir;
+		gsize	size;
+
+		if (!dir)
+		{
+			fwrite(save->cached, record_size(save->cached), 1,
+			       file);
+			continue;
+		}
+
+		size = sizeof(dir->r) + dir->r.n_links * sizeof(UsageLink) +
+			dir->r.subdirs_len;
+		fwrite(&dir->r, sizeof(dir->r), 1, file);
+		fwrite(dir->links, sizeof(UsageLink), dir->r.n_links, file);
+		fwrite(dir->subdirs, 1, dir->r.subdirs_len, file);
+		fwrite(padding, 1, record_size(&dir->r) - size, file);
+	}
+
+	g_array_free(saves, TRUE);
+}
+
+/* Takes ownership of 'path' */
+static void queue_dir(UsageScan *scan, gchar *path, const struct stat *info)
+{
+	UsageJob *job;
+
+	job = g_new(UsageJob, 1);
+	job->path = path;
+	job->info = *info;
+
+	g_atomic_int_inc(&scan->pending);
+	g_thread_pool_push(scan->pool, job, NULL);
+}
+
+static void usage_thread(gpointer data, gpointer user_data)
+{
+	UsageJob *job = data;
+	UsageScan *scan = user_data;
+
+	if (!g_atomic_int_get(&scan->cancelled))
+		count_dir(scan, job->path, &job->info);
+
+	g_free(job->path);
+	g_free(job);
+
+	if (g_atomic_int_dec_and_test(&scan->pending))
+		g_async_queue_push(scan->done, scan);
+}
+
+/* Count the directory 'path', which has been lstat()ed, and queue its
+ * subdirectories.
+ */
+static void count_dir(UsageScan *scan, const char *path,
+		      const struct stat *info)
+{
+	UsageTotals found;
+	UsageDir key, *dir;
+	gboolean reuse;
+
+	memset(&found, 0, sizeof(found));
+	found.dirs = 1;
+	add_size(&found, info);
+
+	key.r.dev = info->st_dev;
+	key.r.ino = info->st_ino;
+
+	g_mutex_lock(scan->lock);
+	dir = g_hash_table_lookup(scan->dirs, &key);
+	if (!dir)
+		dir = load_dir(scan, key.r.dev, key.r.ino);
+	if (dir && dir->seen)
+	{
+		/* Already counted (a bind mount, or inside another item) */
+		g_mutex_unlock(scan->lock);
+		return;
+	}
+
+	reuse = dir && dir->complete && dir->r.mtime == info->st_mtime;
+	if (!reuse)
+	{
+		dir = g_new0(UsageDir, 1);
+		dir->r.dev = info->st_dev;
+		dir->r.ino = info->st_ino;
+		dir->r.mtime = info->st_mtime;
+		g_hash_table_replace(scan->dirs, dir, dir);
+		scan->changed = TRUE;
+	}
+	dir->seen = TRUE;
+	dir->r.used = scan->start;
+	g_mutex_unlock(scan->lock);
+
+	/* Nothing else changes dir now that it has been seen */
+
+	if (reuse)
+		reuse_dir(scan, dir, path, &found);
+	else
+	{
+		GArray	*links;
+		GString	*subdirs;
+
+		links = g_array_new(FALSE, FALSE, sizeof(UsageLink));
+		subdirs = g_string_new(NULL);
+
+		read_dir(scan, dir, path, &found, links, subdirs);
+		count_links(scan, (UsageLink *) links->data, links->len,
+			    &found);
+
+		dir->r.n_links = links->len;
+		dir->links = (UsageLink *) g_array_free(links, FALSE);
+		dir->r.subdirs_len = subdirs->len;
+		dir->subdirs = g_string_free(subdirs, FALSE);
+	}
+
+	g_mutex_lock(scan->lock);
+	if (scan->totals)
+		usage_totals_add(scan->totals, &found);
+	g_mutex_unlock(scan->lock);
+}
+
+/* Read the contents of 'path' into 'dir', adding files with one link to
+ * 'found', others to 'links' and subdirectory names to 'subdirs'.
+ */
+static void read_dir(UsageScan *scan, UsageDir *dir, const char *path,
+		     UsageTotals *found, GArray *links, GString *subdirs)
+{
+	struct dirent *ent;
+	DIR	*d;
+	int	fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	d = fd == -1 ? NULL : fdopendir(fd);
+	if (!d)
+	{
+		int err = errno;
+
+		if (fd != -1)
+			close(fd);
+		found->errors++;
+		scan_error(scan, path, err);
+		return;
+	}
+
+	while ((ent = readdir(d)))
+	{
+		struct stat info;
+		const char *name = ent->d_name;
+
+		if (g_atomic_int_get(&scan->cancelled))
+			break;
+
+		if (name[0] == '.' && (name[1] == '\0' ||
+				(name[1] == '.' && name[2] == '\0')))
+			continue;
+
+		if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW))
+		{
+			int err = errno;
+			gchar *child = g_build_filename(path, name, NULL);
+
+			found->errors++;
+			scan_error(scan, child, err);
+			g_free(child);
+			continue;
+		}
+
+		if (S_ISDIR(info.st_mode))
+		{
+			g_string_append_len(subdirs, name, strlen(name) + 1);
+			queue_dir(scan, g_build_filename(path, name, NULL),
+				  &info);
+		}
+		else if (info.st_nlink > 1)
+		{
+			UsageLink link;
+
+			link.dev = info.st_dev;
+			link.ino = info.st_ino;
+			link.apparent = info.st_size;
+			link.allocated = (gint64) info.st_blocks * 512;
+			g_array_append_val(links, link);
+		}
+		else
+		{
+			dir->r.files++;
+			dir->r.apparent += info.st_size;
+			dir->r.allocated += (gint64) info.st_blocks * 512;
+		}
+	}
+
+	closedir(d);
+
+	found->files += dir->r.files;
+	found->apparent += dir->r.apparent;
+	found->allocated += dir->r.allocated;
+
+	/* A directory changed in the last second might change again
+	 * without its mtime changing. Don't trust it next time.
+	 */
+	dir->complete = found->errors == 0 &&
+			!g_atomic_int_get(&scan->cancelled) &&
+			dir->r.mtime < scan->start - 1;
+}
+
+/* 'dir' hasn't changed since we last read it. Use what we found then,
+ * and queue its subdirectories.
+ */
+static void reuse_dir(UsageScan *scan, UsageDir *dir, const char *path,
+		      UsageTotals *found)
+{
+	const gchar *name;
+	const gchar *end = dir->subdirs + dir->r.subdirs_len;
+
+	found->files += dir->r.files;
+	found->apparent += dir->r.apparent;
+	found->allocated += dir->r.allocated;
+	count_links(scan, dir->links, dir->r.n_links, found);
+
+	for (name = dir->subdirs; name < end; name += strlen(name) + 1)
+	{
+		struct stat info;
+		gchar *child;
+
+		child = g_build_filename(path, name, NULL);
+		if (lstat(child, &info))
+		{
+			found->errors++;
+			scan_error(scan, child, errno);
+			g_free(child);
+		}
+		else if (S_ISDIR(info.st_mode))
+			queue_dir(scan, child, &info);
+		else
+			g_free(child);	/* Replaced since; mtime was wrong */
+	}
+}
+
+/* Add each file in 'links' to 'found', unless this scan has already
+ * counted it.
+ */
+static void count_links(UsageScan *scan, UsageLink *links, int n,
+			UsageTotals *found)
+{
+	int	i;
+
+	if (n == 0)
+		return;
+
+	g_mutex_lock(scan->lock);
+	for (i = 0; i < n; i++)
+	{
+		if (g_hash_table_lookup(scan->links, &links[i]))
+			continue;
+
+		g_hash_table_insert(scan->links, g_memdup(&links[i],
+					sizeof(UsageLink)), GINT_TO_POINTER(1));
+		found->files++;
+		found->apparent += links[i].apparent;
+		found->allocated += links[i].allocated;
+	}
+	g_mutex_unlock(scan->lock);
+}
+
+static void add_size(UsageTotals *totals, const struct stat *info)
+{
+	totals->apparent += info->st_size;
+	totals->allocated += (gint64) info->st_blocks * 512;
+}
+
+/* Remember the first problem, for usage_scan_path() to return */
+static void scan_error(UsageScan *scan, const char *path, int err)
+{
+	g_mutex_lock(scan->lock);
+	if (!scan->error)
+		scan->error = g_strdup_printf("%s: %s", path, g_strerror(err));
+	g_mutex_unlock(scan->lock);
+}
@@ -0,0 +1,40 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * By Thomas Leonard, <tal197@users.sourceforge.net>.
+ */
+
+#ifndef _USAGE_H
+#define _USAGE_H
+
+#include <sys/stat.h>
+#include <glib.h>
+
+typedef struct _UsageTotals UsageTotals;
+
+struct _UsageTotals {
+	gint64	apparent;	/* Sum of st_size */
+	gint64	allocated;	/* Space used on the disk, in bytes */
+	gint64	files;		/* Everything except directories */
+	gint64	dirs;
+	gint64	errors;		/* Things we couldn't read */
+};
+
+/* Called every so often by usage_scan_path() with the totals so far */
+typedef void (*UsageProgressFn)(const UsageTotals *so_far, gpointer data);
+
+extern Option o_usage_cache;
+
+void usage_init(void);
+UsageScan *usage_scan_new(int threads, gboolean exclusive);
+gchar *usage_scan_path(UsageScan *scan, const char *path,
+		       UsageTotals *totals,
+		       UsageProgressFn progress, gpointer data);
+void usage_scan_add(UsageScan *scan, const struct stat *info,
+		    UsageTotals *totals);
+void usage_scan_cancel(UsageScan *scan);
+void usage_scan_finish(UsageScan *scan);
+void usage_totals_add(UsageTotals *totals, const UsageTotals *found);
+gchar *usage_format_sizes(const UsageTotals *totals);
+void usage_scan_free(UsageScan *scan);
+
+#endif /* _USAGE_H */
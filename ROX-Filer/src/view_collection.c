@@ -168,6 +168,7 @@ static void view_collection_start_lasso_box(ViewIface *view,
 static void view_collection_extend_tip(ViewIface *view, ViewIter *iter,
 					GString *tip);
 static gboolean view_collection_auto_scroll_callback(ViewIface *view);
+static int view_collection_visible_distance(ViewIface *view, ViewIter *iter);
 
 static DirItem *iter_next(ViewIter *iter);
 static DirItem *iter_prev(ViewIter *iter);
@@ -744,6 +745,7 @@ static void view_collection_iface_init(gpointer giface, gpointer iface_data)
 	iface->start_lasso_box = view_collection_start_lasso_box;
 	iface->extend_tip = view_collection_extend_tip;
 	iface->auto_scroll_callback = view_collection_auto_scroll_callback;
+	iface->visible_distance = view_collection_visible_distance;
 }
 
 static void view_collection_extend_tip(ViewIface *view, ViewIter *iter,
@@ -1635,3 +1637,19 @@ static gboolean view_collection_auto_scroll_callback(ViewIface *view)
 
 	return TRUE;
 }
+
+static int view_collection_visible_distance(ViewIface *view, ViewIter *iter)
+{
+	ViewCollection	*view_collection = (ViewCollection *) view;
+	Collection	*collection = view_collection->collection;
+	int		row, col, first, last;
+
+	collection_item_to_rowcol(collection, iter->i, &row, &col);
+	collection_get_visible_rows(collection, &first, &last);
+
+	if (row < first)
+		return first - row;
+	if (row > last)
+		return row - last;
+	return 0;
+}
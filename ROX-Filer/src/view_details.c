@@ -106,6 +106,7 @@ static void view_details_start_lasso_box(ViewIface *view,
 static void view_details_extend_tip(ViewIface *view,
 				    ViewIter *iter, GString *tip);
 static gboolean view_details_auto_scroll_callback(ViewIface *view);
+static int view_details_visible_distance(ViewIface *view, ViewIter *iter);
 
 static DirItem *iter_peek(ViewIter *iter);
 static DirItem *iter_prev(ViewIter *iter);
@@ -1243,6 +1244,7 @@ static void view_details_iface_init(gpointer giface, gpointer iface_data)
 	iface->start_lasso_box = view_details_start_lasso_box;
 	iface->extend_tip = view_details_extend_tip;
 	iface->auto_scroll_callback = view_details_auto_scroll_callback;
+	iface->visible_distance = view_details_visible_distance;
 }
 
 
@@ -2117,3 +2119,26 @@ static gboolean view_details_auto_scroll_callback(ViewIface *view)
 
 	return TRUE;
 }
+
+static int view_details_visible_distance(ViewIface *view, ViewIter *iter)
+{
+	GtkTreePath	*start, *end;
+	int		first, last;
+
+	if (!GTK_WIDGET_REALIZED(GTK_WIDGET(view)) ||
+	    !gtk_tree_view_get_visible_range((GtkTreeView *) view,
+					     &start, &end))
+		return iter->i;
+
+	/* (this is a list, so there's only one index) */
+	first = gtk_tree_path_get_indices(start)[0];
+	last = gtk_tree_path_get_indices(end)[0];
+	gtk_tree_path_free(start);
+	gtk_tree_path_free(end);
+
+	if (iter->i < first)
+		return first - iter->i;
+	if (iter->i > last)
+		return iter->i - last;
+	return 0;
+}
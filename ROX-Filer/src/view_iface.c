@@ -412,3 +412,15 @@ gboolean view_auto_scroll_callback(ViewIface *obj)
 	return VIEW_IFACE_GET_CLASS(obj)->auto_scroll_callback(obj);
 }
 
+/* How far the item is from the part of the view that can be seen, in rows.
+ * 0 if the item is visible. Used to make thumbnails for what the user is
+ * looking at first.
+ */
+int view_visible_distance(ViewIface *obj, ViewIter *iter)
+{
+	g_return_val_if_fail(VIEW_IS_IFACE(obj), 0);
+	g_return_val_if_fail(iter != NULL && iter->i >= 0, 0);
+
+	return VIEW_IFACE_GET_CLASS(obj)->visible_distance(obj, iter);
+}
+
@@ -85,6 +85,7 @@ struct _ViewIfaceClass {
 	void (*start_lasso_box)(ViewIface *obj, GdkEventButton *event);
 	void (*extend_tip)(ViewIface *obj, ViewIter *iter, GString *tip);
 	gboolean (*auto_scroll_callback)(ViewIface *obj);
+	int (*visible_distance)(ViewIface *obj, ViewIter *iter);
 };
 
 #define VIEW_TYPE_IFACE           (view_iface_get_type())
@@ -143,5 +144,6 @@ void view_set_base(ViewIface *obj, ViewIter *iter);
 void view_start_lasso_box(ViewIface *obj, GdkEventButton *event);
 void view_extend_tip(ViewIface *obj, ViewIter *iter, GString *tip);
 gboolean view_auto_scroll_callback(ViewIface *obj);
+int view_visible_distance(ViewIface *obj, ViewIter *iter);
 
 #endif /* __VIEW_IFACE_H__ */
@@ -49,6 +49,8 @@ typedef struct XdgCallbackList XdgCallbackList;
 
 static int need_reread = TRUE;
 static time_t last_stat_time = 0;
+static int dirs_watched = FALSE;
+static unsigned int database_version = 0;
 
 static XdgGlobHash *global_hash = NULL;
 static XdgMimeMagic *global_magic = NULL;
@@ -424,11 +426,13 @@ xdg_check_time_and_dirs (void)
 }
 
 /* Called in every public function.  It reloads the hash function if need be.
+ * If the caller is watching the directories itself (see
+ * xdg_mime_set_dirs_watched), we don't stat anything here.
  */
 static void
 xdg_mime_init (void)
 {
-  if (xdg_check_time_and_dirs ())
+  if (!dirs_watched && xdg_check_time_and_dirs ())
     {
       xdg_mime_shutdown ();
     }
@@ -643,6 +647,38 @@ xdg_mime_shutdown (void)
     (list->callback) (list->data);
 
   need_reread = TRUE;
+  database_version++;
+}
+
+/* If watched is TRUE, the caller promises to call xdg_mime_shutdown() when
+ * any of the files in the directories listed by xdg_mime_foreach_data_dir()
+ * change, and we stop checking their modification times ourselves.
+ */
+void
+xdg_mime_set_dirs_watched (int watched)
+{
+  dirs_watched = watched;
+  last_stat_time = 0;
+}
+
+/* Calls func for each directory in the search path (each of which may
+ * contain a 'mime' subdirectory).  If func returns TRUE, further
+ * directories aren't looked at.
+ */
+void
+xdg_mime_foreach_data_dir (XdgMimeDirFunc  func,
+			   void           *user_data)
+{
+  xdg_run_command_on_dirs ((XdgDirectoryFunc) func, user_data);
+}
+
+/* Returns a number which changes every time the database is discarded, so
+ * that callers can tell whether anything they cached is out of date.
+ */
+unsigned int
+xdg_mime_get_database_version (void)
+{
+  return database_version;
 }
 
 int
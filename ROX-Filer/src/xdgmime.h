@@ -48,6 +48,8 @@ extern "C" {
 
 typedef void (*XdgMimeCallback) (void *user_data);
 typedef void (*XdgMimeDestroy)  (void *user_data);
+typedef int  (*XdgMimeDirFunc)  (const char *directory,
+				 void       *user_data);
 
   
 #ifdef XDG_PREFIX
@@ -67,6 +69,9 @@ typedef void (*XdgMimeDestroy)  (void *user_data);
 #define xdg_mime_dump                         XDG_ENTRY(dump)
 #define xdg_mime_register_reload_callback     XDG_ENTRY(register_reload_callback)
 #define xdg_mime_remove_callback              XDG_ENTRY(remove_callback)
+#define xdg_mime_set_dirs_watched             XDG_ENTRY(set_dirs_watched)
+#define xdg_mime_foreach_data_dir             XDG_ENTRY(foreach_data_dir)
+#define xdg_mime_get_database_version         XDG_ENTRY(get_database_version)
 #define xdg_mime_type_unknown                 XDG_ENTRY(type_unknown)
 #define xdg_mime_type_empty                   XDG_ENTRY(type_empty)
 #define xdg_mime_type_textplain               XDG_ENTRY(type_textplain)
@@ -118,6 +123,10 @@ int          xdg_mime_register_reload_callback     (XdgMimeCallback  callback,
 						    void            *data,
 						    XdgMimeDestroy   destroy);
 void         xdg_mime_remove_callback              (int              callback_id);
+void         xdg_mime_set_dirs_watched             (int              watched);
+void         xdg_mime_foreach_data_dir             (XdgMimeDirFunc   func,
+						    void            *user_data);
+unsigned int xdg_mime_get_database_version         (void);
 
    /* Private versions of functions that don't call xdg_mime_init () */
 int          _xdg_mime_mime_type_equal             (const char *mime_a,
@@ -31,6 +31,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#endif
 
 #include <glib.h>
 
@@ -62,6 +65,27 @@ static ssize_t (*dyn_listxattr)(const char *path, char *list,
 static int (*dyn_removexattr)(const char *path,
 		const char *name) = NULL;
 
+/* What we know about extended attribute support on each filesystem we've
+ * seen, so that we don't keep asking ones that can't have any.
+ */
+typedef struct {
+	dev_t		dev;
+	gboolean	supported;
+} XAttrFS;
+
+static GArray *known_filesystems = NULL;
+
+/* statfs() f_type values for filesystems which never have user attributes */
+static const long no_xattr_fs_types[] = {
+	0x4d44,		/* MSDOS_SUPER_MAGIC */
+	0x2011bab0,	/* EXFAT_SUPER_MAGIC */
+	0x9660,		/* ISOFS_SUPER_MAGIC */
+	0x15013346,	/* UDF_SUPER_MAGIC */
+	0x9fa0,		/* PROC_SUPER_MAGIC */
+	0x62656572,	/* SYSFS_MAGIC */
+	0
+};
+
 void xattr_init(void)
 {
 	void *libc;
@@ -124,6 +148,119 @@ int xattr_have(const char *path)
 	return (nent>0);
 }
 
+/* Can the filesystem holding path (with stat details info) have attributes?
+ * The answer is worked out once per device: from the filesystem type if
+ * possible, or else by seeing whether asking for one fails with ENOTSUP.
+ */
+static gboolean filesystem_has_xattrs(const char *path,
+				      const struct stat *info)
+{
+	XAttrFS fs;
+	int i;
+
+	if (!info)
+		return TRUE;	/* Don't know which filesystem */
+
+	if (!known_filesystems)
+		known_filesystems = g_array_new(FALSE, FALSE, sizeof(XAttrFS));
+
+	for (i = 0; i < known_filesystems->len; i++)
+	{
+		XAttrFS *known = &g_array_index(known_filesystems, XAttrFS, i);
+
+		if (known->dev == info->st_dev)
+			return known->supported;
+	}
+
+	fs.dev = info->st_dev;
+	fs.supported = TRUE;
+
+#ifdef HAVE_SYS_VFS_H
+	{
+		struct statfs sfs;
+
+		if (statfs(path, &sfs) == 0)
+		{
+			for (i = 0; no_xattr_fs_types[i]; i++)
+				if (sfs.f_type == no_xattr_fs_types[i])
+					fs.supported = FALSE;
+		}
+	}
+#endif
+
+	if (fs.supported)
+	{
+		char buf[1];
+
+		errno = 0;
+		if (dyn_getxattr(path, XATTR_MIME_TYPE, buf, sizeof(buf)) < 0
+				&& errno == ENOTSUP)
+			fs.supported = FALSE;
+	}
+
+	g_array_append_val(known_filesystems, fs);
+
+	return fs.supported;
+}
+
+/* Find out which attributes path has, with a single listxattr() (or none at
+ * all if its filesystem can't have any). info is path's stat details (for
+ * symlinks, the target's), or NULL if unknown.
+ * Returns a mask of XATTR_SCAN_* flags; only call xattr_get() for attributes
+ * which are present.
+ */
+int xattr_scan(const char *path, const struct stat *info)
+{
+	char buf[1024];
+	char *list = buf;
+	char *l;
+	ssize_t len;
+	int found = 0;
+
+	RETURN_IF_IGNORED(0);
+
+	if (!dyn_listxattr || !dyn_getxattr)
+		return 0;
+
+	if (!filesystem_has_xattrs(path, info))
+		return 0;
+
+	len = dyn_listxattr(path, buf, sizeof(buf));
+	if (len < 0 && errno == ERANGE)
+	{
+		/* Lots of attributes; get them all */
+		len = dyn_listxattr(path, NULL, 0);
+		if (len > 0)
+		{
+			list = g_new(char, len);
+			len = dyn_listxattr(path, list, len);
+		}
+	}
+
+	if (len > 0)
+		found |= XATTR_SCAN_ANY;
+
+	for (l = list; len > 0 && l < list + len; l += strlen(l) + 1)
+	{
+		if (strcmp(l, XATTR_MIME_TYPE) == 0)
+			found |= XATTR_SCAN_MIME_TYPE;
+		else if (strcmp(l, XATTR_LABEL) == 0)
+			found |= XATTR_SCAN_LABEL;
+	}
+
+	if (list != buf)
+		g_free(list);
+
+	return found;
+}
+
+/* Filesystems may have been remounted with different options */
+void xattr_forget_filesystems(void)
+{
+	if (known_filesystems)
+		g_array_set_size(known_filesystems, 0);
+}
+
 gchar *xattr_get(const char *path, const char *attr, int *len)
 {
 	ssize_t size;
@@ -231,6 +368,19 @@ int xattr_have(const char *path)
 #endif
 }
 
+int xattr_scan(const char *path, const struct stat *info)
+{
+	if (!xattr_have(path))
+		return 0;
+
+	/* Can't tell which ones without opening the attribute directory */
+	return XATTR_SCAN_ANY | XATTR_SCAN_MIME_TYPE | XATTR_SCAN_LABEL;
+}
+
+void xattr_forget_filesystems(void)
+{
+}
+
 #define MAX_ATTR_SIZE BUFSIZ
 gchar *xattr_get(const char *path, const char *attr, int *len)
 {
@@ -334,6 +484,15 @@ int xattr_have(const char *path)
 	return FALSE;
 }
 
+int xattr_scan(const char *path, const struct stat *info)
+{
+	return 0;
+}
+
+void xattr_forget_filesystems(void)
+{
+}
+
 gchar *xattr_get(const char *path, const char *attr, int *len)
 {
 	/* Fall back to non-extended */
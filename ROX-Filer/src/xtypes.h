@@ -13,6 +13,14 @@
 #define XATTR_HIDDEN    "user.hidden"
 #define XATTR_LABEL		"user.label"
 
+/* Flags returned by xattr_scan() */
+typedef enum
+{
+	XATTR_SCAN_ANY		= 0x1,	/* Has some attribute */
+	XATTR_SCAN_MIME_TYPE	= 0x2,	/* Has XATTR_MIME_TYPE */
+	XATTR_SCAN_LABEL	= 0x4,	/* Has XATTR_LABEL */
+} XAttrScanFlags;
+
 /* If set, do not use extended attributes */
 extern Option o_xattr_ignore;    /* Set up in xattr_init() */
 
@@ -23,6 +31,8 @@ void xattr_init(void);
 int xattr_supported(const char *path);
 
 int xattr_have(const char *path);
+int xattr_scan(const char *path, const struct stat *info);
+void xattr_forget_filesystems(void);
 gchar *xattr_get(const char *path, const char *attr, int *len);
 int xattr_set(const char *path, const char *attr,
 	      const char *value, int value_len);